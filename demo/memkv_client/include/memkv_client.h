@@ -2,11 +2,13 @@
 // Created by akzi on 17-6-17.
 //
 #pragma once
+#include <list>
 #include <string>
 #include <utility>
 #include <vector>
 #include "acl_cpp/lib_acl.hpp"
 #include "memkv_proto.h"
+#include "proto_gen/memkv.pb.h"
 #include "addr_info.h"
 #include "cluster_config.h"
 #include "raft_config.h"
@@ -14,6 +16,97 @@
 #include "http_rpc.h"
 
 
+//result of async request
+struct memkv_result
+{
+    memkv_result()
+        :ok(false),
+         id(0)
+    {
+    }
+    //leader answered the request
+    bool ok;
+    unsigned long long id;
+    std::string status;
+    //value of get
+    std::string value;
+};
+
+//a page of scan
+struct memkv_scan_result
+{
+    memkv_scan_result()
+        :ok(false),
+         more(false)
+    {
+    }
+    bool ok;
+    std::vector<std::pair<std::string, std::string> > items;
+    //there are more items, and next is start of next page
+    bool more;
+    std::string next;
+};
+
+//callback of async request. it is invoked in worker thread of client
+struct memkv_callback
+{
+    virtual ~memkv_callback()
+    {
+    }
+    virtual void operator()(const memkv_result &result) = 0;
+};
+
+//wait for result of async request.
+//it must not be deleted before request done
+class memkv_future : public memkv_callback
+{
+public:
+    memkv_future()
+        :done_(false)
+    {
+        acl_assert(acl_pthread_cond_init(&cond_, NULL) == 0);
+        acl_assert(acl_pthread_mutex_init(&mutex_, NULL) == 0);
+    }
+
+    ~memkv_future()
+    {
+        acl_pthread_cond_destroy(&cond_);
+        acl_pthread_mutex_destroy(&mutex_);
+    }
+
+    virtual void operator()(const memkv_result &result)
+    {
+        acl_pthread_mutex_lock(&mutex_);
+        result_ = result;
+        done_ = true;
+        acl_pthread_cond_signal(&cond_);
+        acl_pthread_mutex_unlock(&mutex_);
+    }
+
+    //wait until request done
+    const memkv_result &get()
+    {
+        acl_pthread_mutex_lock(&mutex_);
+        while (!done_)
+            acl_pthread_cond_wait(&cond_, &mutex_);
+        acl_pthread_mutex_unlock(&mutex_);
+        return result_;
+    }
+
+    bool done()
+    {
+        acl_pthread_mutex_lock(&mutex_);
+        bool done = done_;
+        acl_pthread_mutex_unlock(&mutex_);
+        return done;
+    }
+private:
+    acl_pthread_mutex_t mutex_;
+    acl_pthread_cond_t cond_;
+    memkv_result result_;
+    bool done_;
+};
+
 class memkv_client {
 public:
     typedef acl::http_rpc_client::status_t status_t;
@@ -21,23 +114,35 @@ public:
     typedef service_map_t::iterator service_map_iterator_t;
 
     memkv_client()
-        :rpc_client(acl::http_rpc_client::get_instance())
+        :rpc_client(acl::http_rpc_client::get_instance()),
+         leader_(-1),
+         next_id_(0)
     {
 
     }
 
     ~memkv_client()
     {
-
+        stop_async();
     }
 
     void set_cluster(const cluster_config &_cluster_config)
     {
         std::vector<std::string> services;
-        services.push_back("store/get");
-        services.push_back("store/set");
-        services.push_back("store/del");
-        services.push_back("store/exist");
+        //protobuf services of store
+        services.push_back("store/pb/get");
+        services.push_back("store/pb/set");
+        services.push_back("store/pb/del");
+        services.push_back("store/pb/exist");
+        services.push_back("store/pb/cas");
+        services.push_back("store/pb/mget");
+        services.push_back("store/pb/mset");
+        services.push_back("store/pb/mdel");
+        services.push_back("store/pb/scan");
+        services.push_back("store/pb/prefix");
+
+        for (size_t i = 0; i < _cluster_config.addrs.size(); ++i)
+            ids_.push_back(_cluster_config.addrs[i].id);
 
         for (size_t j = 0; j < services.size(); ++j)
         {
@@ -70,118 +175,290 @@ public:
 
     std::pair<bool, std::string> get(const std::string &key)
     {
+        unsigned long long version = 0;
+        return get(key, version);
+    }
 
-        get_req req;
-        get_resp resp;
-        std::vector<std::string> services = services_["get"];
-
-        if (services.empty())
-            logger_fatal("not service to call");
+    //version is the log index key written at, it is used by cas
+    std::pair<bool, std::string> get(const std::string &key,
+                                     unsigned long long &version)
+    {
+        memkv_pb::get_req req;
+        memkv_pb::get_resp resp;
 
-        req.key = key;
+        req.set_key(key);
 
-        for (int i = 0; i < services.size(); ++i)
+        if (call("get", req, resp))
         {
+            version = resp.version();
+            if (resp.status() == "ok")
+                return std::make_pair(true, resp.value());
 
-            const char* service_path = services[i].c_str();
-
-            logger("do json call. service_path:%s",
-                   service_path);
+            logger("get response error. %s",
+                   resp.status().c_str());
+        }
+        return std::make_pair(false, "get failed");
+    };
 
-            status_t status =
-                rpc_client.json_call(service_path, req, resp);
+    //key is deleted after ttl milliseconds.0 for never
+    std::string set(const std::string &key,
+                    const std::string &value,
+                    unsigned int ttl = 0)
+    {
+        memkv_pb::set_req req;
+        memkv_pb::set_resp resp;
 
-            if (status)
-            {
-                if (resp.status == "ok")
-                    return std::make_pair(true, resp.value);
+        req.set_key(key);
+        req.set_value(value);
+        req.set_ttl(ttl);
 
-                logger("get response error. %s",
-                       resp.status.c_str());
-            }
-            logger("json_call error. %s",
-                   status.error_str_.c_str());
+        if (call("set", req, resp))
+        {
+            if (resp.status() == "ok")
+                return resp.status();
 
+            logger("set response error. %s",
+                   resp.status().c_str());
         }
-        return std::make_pair(false, "get failed");
-    };
+        return "set request failed";
+    }
 
-    std::string set(const std::string &key, const std::string &value)
+    std::string del(const std::string &key)
     {
-        set_req req;
-        set_resp resp;
-        std::vector<std::string> services = services_["set"];
+        memkv_pb::del_req req;
+        memkv_pb::del_resp resp;
 
-        req.key = key;
-        req.value = value;
+        req.set_key(key);
 
-        for (int i = 0; i < services.size(); ++i)
+        if (call("del", req, resp))
         {
-            logger("call (%s)", services[i].c_str());
+            if (resp.status() == "ok")
+                return resp.status();
 
-            status_t status =
-                rpc_client.json_call(services[i].c_str(), req, resp);
+            logger("del response error. %s",
+                   resp.status().c_str());
+        }
+        return "del request failed";
+    }
 
-            if (status)
-            {
-                if (resp.status == "ok")
-                    return resp.status;
+    /**
+     * set key if its version is version.version 0 means key
+     * must not exist.
+     * status is "version mismatch" if key is changed by others,
+     * and version is set to version of key after the request
+     */
+    std::string cas(const std::string &key,
+                    const std::string &value,
+                    unsigned long long &version,
+                    unsigned int ttl = 0)
+    {
+        memkv_pb::cas_req req;
+
+        req.set_key(key);
+        req.set_value(value);
+        req.set_version(version);
+        req.set_ttl(ttl);
+        return cas_call(req, version);
+    }
+
+    //delete key if its version is version
+    std::string cas_del(const std::string &key, unsigned long long &version)
+    {
+        memkv_pb::cas_req req;
+
+        req.set_key(key);
+        req.set_version(version);
+        req.set_deleted(true);
+        return cas_call(req, version);
+    }
+
+    std::pair<bool, std::string> exist(const std::string &key)
+    {
+        memkv_pb::exist_req req;
+        memkv_pb::exist_resp resp;
+
+        req.set_key(key);
+
+        if (call("exist", req, resp))
+            return std::make_pair(true, resp.status());
+
+        return std::make_pair(false, std::string("exist request failed"));
+    };
+
+    //get keys in one request.not found keys are not in result
+    std::pair<bool, std::map<std::string, std::string> >
+    mget(const std::vector<std::string> &keys)
+    {
+        memkv_pb::mget_req req;
+        memkv_pb::mget_resp resp;
+        std::map<std::string, std::string> items;
 
-                logger("set response error. %s",
-                       resp.status.c_str());
+        for (size_t i = 0; i < keys.size(); ++i)
+            req.add_keys(keys[i]);
+
+        if (call("mget", req, resp))
+        {
+            if (resp.status() == "ok")
+            {
+                for (int j = 0; j < resp.items_size(); ++j)
+                    items[resp.items(j).key()] = resp.items(j).value();
+                return std::make_pair(true, items);
             }
+            logger("mget response error. %s",
+                   resp.status().c_str());
         }
-        return "set request failed";
+        return std::make_pair(false, items);
     }
 
-    std::string del(const std::string &key)
+    //set keys in one log entry
+    std::string mset(const std::map<std::string, std::string> &items)
     {
-        del_req req;
-        del_resp resp;
-        std::vector<std::string> services = services_["det"];
+        memkv_pb::mset_req req;
+        memkv_pb::mset_resp resp;
 
-        req.key = key;
-        for (int i = 0; i < services.size(); ++i)
+        std::map<std::string, std::string>::const_iterator it;
+        for (it = items.begin(); it != items.end(); ++it)
         {
+            memkv_pb::kv *item = req.add_items();
+            item->set_key(it->first);
+            item->set_value(it->second);
+        }
 
-            status_t status =
-                rpc_client.json_call(services[i].c_str(), req, resp);
-            if (status)
-            {
-                if (resp.status == "ok")
-                    return resp.status;
+        if (call("mset", req, resp))
+        {
+            if (resp.status() == "ok")
+                return resp.status();
 
-                logger("del response error. %s",
-                       resp.status.c_str());
-            }
+            logger("mset response error. %s",
+                   resp.status().c_str());
         }
-        return "del request failed";
+        return "mset request failed";
     }
 
-    std::pair<bool, std::string> exist(const std::string &key)
+    //delete keys in one log entry
+    std::string mdel(const std::vector<std::string> &keys)
     {
-        exist_req req;
-        exist_resp resp;
-        std::vector<std::string> services = services_["det"];
+        memkv_pb::mdel_req req;
+        memkv_pb::mdel_resp resp;
 
-        req.key = key;
+        for (size_t i = 0; i < keys.size(); ++i)
+            req.add_keys(keys[i]);
 
-        for (int i = 0; i < services.size(); ++i)
+        if (call("mdel", req, resp))
         {
+            if (resp.status() == "ok")
+                return resp.status();
 
-            status_t status =
-                rpc_client.json_call(services[i].c_str(), req, resp);
-            if (status)
-            {
-                if (resp.status != "no leader")
-                    return std::make_pair(true, resp.status);
+            logger("mdel response error. %s",
+                   resp.status().c_str());
+        }
+        return "mdel request failed";
+    }
 
-                logger("exist response error. %s",
-                       resp.status.c_str());
-            }
+    /**
+     * get a page of items of keys in [start, end) in key order.
+     * end empty for no upper bound. limit 0 for server default
+     */
+    memkv_scan_result scan(const std::string &start,
+                           const std::string &end,
+                           unsigned int limit = 0)
+    {
+        memkv_pb::scan_req req;
+        memkv_pb::scan_resp resp;
+
+        req.set_start(start);
+        req.set_end(end);
+        req.set_limit(limit);
+
+        memkv_scan_result result;
+        if (call("scan", req, resp))
+            get_scan_result(resp, result);
+        return result;
+    }
+
+    /**
+     * get a page of items of keys begin with prefix.
+     * start is next of last page, empty for first page
+     */
+    memkv_scan_result prefix(const std::string &prefix,
+                             unsigned int limit = 0,
+                             const std::string &start = "")
+    {
+        memkv_pb::prefix_req req;
+        memkv_pb::scan_resp resp;
+
+        req.set_prefix(prefix);
+        req.set_start(start);
+        req.set_limit(limit);
+
+        memkv_scan_result result;
+        if (call("prefix", req, resp))
+            get_scan_result(resp, result);
+        return result;
+    }
+
+    /**
+     * start worker threads of async requests.
+     * requests of the same key go to the same worker, so they
+     * are done in order. requests of different keys are sent
+     * at the same time over connections of rpc client pool.
+     */
+    void start_async(int threads = 8)
+    {
+        acl::lock_guard lg(workers_locker_);
+        start_workers(threads);
+    }
+
+    //wait for requests issued, and stop worker threads
+    void stop_async()
+    {
+        /*
+         * requests issued before are pushed to workers already.
+         * take workers out under lock, and wait them without it,
+         * so callbacks can still issue requests
+         */
+        std::vector<async_worker *> workers;
+        {
+            acl::lock_guard lg(workers_locker_);
+            workers.swap(workers_);
         }
-        return std::make_pair(false, std::string("exist request failed"));
-    };
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            workers[i]->stop();
+            workers[i]->wait();
+            delete workers[i];
+        }
+    }
+
+    /**
+     * async requests. callback is invoked with the result
+     * in worker thread. return id of the request
+     */
+    unsigned long long async_get(const std::string &key,
+                                 memkv_callback *callback)
+    {
+        return async_call("get", key, "", callback);
+    }
+
+    unsigned long long async_set(const std::string &key,
+                                 const std::string &value,
+                                 memkv_callback *callback)
+    {
+        return async_call("set", key, value, callback);
+    }
+
+    unsigned long long async_del(const std::string &key,
+                                 memkv_callback *callback)
+    {
+        return async_call("del", key, "", callback);
+    }
+
+    unsigned long long async_exist(const std::string &key,
+                                   memkv_callback *callback)
+    {
+        return async_call("exist", key, "", callback);
+    }
+
     void print_service_info()
     {
         logger("-------------------services----------------------");
@@ -197,6 +474,286 @@ public:
         logger("-------------------services----------------------");
     }
 private:
+    struct async_task
+    {
+        unsigned long long id;
+        std::string action;
+        std::string key;
+        std::string value;
+        memkv_callback *callback;
+    };
+
+    class async_worker : public acl::thread
+    {
+    public:
+        explicit async_worker(memkv_client &client)
+            :client_(client),
+             stop_(false)
+        {
+            acl_assert(acl_pthread_cond_init(&cond_, NULL) == 0);
+            acl_assert(acl_pthread_mutex_init(&mutex_, NULL) == 0);
+        }
+
+        ~async_worker()
+        {
+            acl_pthread_cond_destroy(&cond_);
+            acl_pthread_mutex_destroy(&mutex_);
+        }
+
+        void push(const async_task &task)
+        {
+            acl_pthread_mutex_lock(&mutex_);
+            tasks_.push_back(task);
+            acl_pthread_cond_signal(&cond_);
+            acl_pthread_mutex_unlock(&mutex_);
+        }
+
+        //stop after tasks in queue done
+        void stop()
+        {
+            acl_pthread_mutex_lock(&mutex_);
+            stop_ = true;
+            acl_pthread_cond_signal(&cond_);
+            acl_pthread_mutex_unlock(&mutex_);
+        }
+    private:
+        virtual void *run()
+        {
+            while (true)
+            {
+                acl_pthread_mutex_lock(&mutex_);
+                while (tasks_.empty() && !stop_)
+                    acl_pthread_cond_wait(&cond_, &mutex_);
+
+                if (tasks_.empty())
+                {
+                    acl_pthread_mutex_unlock(&mutex_);
+                    break;
+                }
+                async_task task = tasks_.front();
+                tasks_.pop_front();
+                acl_pthread_mutex_unlock(&mutex_);
+
+                client_.do_async(task);
+            }
+            return NULL;
+        }
+
+        memkv_client &client_;
+        std::list<async_task> tasks_;
+        acl_pthread_mutex_t mutex_;
+        acl_pthread_cond_t cond_;
+        bool stop_;
+    };
+
+    //workers_locker_ is held
+    void start_workers(int threads)
+    {
+        if (!workers_.empty())
+            return;
+        if (threads < 1)
+            threads = 1;
+
+        for (int i = 0; i < threads; ++i)
+        {
+            async_worker *worker = new async_worker(*this);
+            worker->start();
+            workers_.push_back(worker);
+        }
+    }
+
+    unsigned long long async_call(const char *action,
+                                  const std::string &key,
+                                  const std::string &value,
+                                  memkv_callback *callback)
+    {
+        async_task task;
+        task.action = action;
+        task.key = key;
+        task.value = value;
+        task.callback = callback;
+        {
+            acl::lock_guard lg(leader_locker_);
+            task.id = ++next_id_;
+        }
+
+        //FNV-1a hash of key chooses worker
+        unsigned int hash = 2166136261u;
+        for (size_t i = 0; i < key.size(); ++i)
+        {
+            hash ^= (unsigned char) key[i];
+            hash *= 16777619u;
+        }
+
+        //stop_async can't delete the worker before task is pushed
+        acl::lock_guard lg(workers_locker_);
+        start_workers(8);
+        workers_[hash % workers_.size()]->push(task);
+        return task.id;
+    }
+
+    void do_async(const async_task &task)
+    {
+        memkv_result result;
+        result.id = task.id;
+
+        if (task.action == "get")
+        {
+            memkv_pb::get_req req;
+            memkv_pb::get_resp resp;
+            req.set_key(task.key);
+            result.ok = call("get", req, resp);
+            result.status = resp.status();
+            result.value = resp.value();
+        }
+        else if (task.action == "set")
+        {
+            memkv_pb::set_req req;
+            memkv_pb::set_resp resp;
+            req.set_key(task.key);
+            req.set_value(task.value);
+            result.ok = call("set", req, resp);
+            result.status = resp.status();
+        }
+        else if (task.action == "del")
+        {
+            memkv_pb::del_req req;
+            memkv_pb::del_resp resp;
+            req.set_key(task.key);
+            result.ok = call("del", req, resp);
+            result.status = resp.status();
+        }
+        else
+        {
+            memkv_pb::exist_req req;
+            memkv_pb::exist_resp resp;
+            req.set_key(task.key);
+            result.ok = call("exist", req, resp);
+            result.status = resp.status();
+        }
+        if (task.callback)
+            (*task.callback)(result);
+    }
+
+    void get_scan_result(const memkv_pb::scan_resp &resp,
+                         memkv_scan_result &result)
+    {
+        if (resp.status() != "ok")
+        {
+            logger("scan response error. %s", resp.status().c_str());
+            return;
+        }
+        result.ok = true;
+        for (int i = 0; i < resp.items_size(); ++i)
+        {
+            result.items.push_back(std::make_pair(resp.items(i).key(),
+                                                  resp.items(i).value()));
+        }
+        result.more = resp.more();
+        result.next = resp.next();
+    }
+
+    int get_leader()
+    {
+        acl::lock_guard lg(leader_locker_);
+        return leader_;
+    }
+
+    void set_leader(int leader)
+    {
+        acl::lock_guard lg(leader_locker_);
+        leader_ = leader;
+    }
+
+    int find_node(const std::string &id) const
+    {
+        for (size_t i = 0; i < ids_.size(); ++i)
+        {
+            if (ids_[i] == id)
+                return (int) i;
+        }
+        return -1;
+    }
+
+    /**
+     * call service of cached leader.if node is not leader,
+     * it tell the leader in response, and call goes to it.
+     * other nodes are tried when leader unknown or call failed.
+     * return true if a leader answered the request
+     */
+    template<class REQ, class RESP>
+    bool call(const char *action, const REQ &req, RESP &resp)
+    {
+        //services_ is not changed after set_cluster.find is thread safe
+        service_map_iterator_t it = services_.find(action);
+        if (it == services_.end() || it->second.empty())
+            logger_fatal("not service to call");
+
+        const std::vector<std::string> &services = it->second;
+        std::vector<bool> tried(services.size(), false);
+        int node = get_leader();
+
+        for (size_t i = 0; i < services.size(); ++i)
+        {
+            //next node not tried
+            if (node < 0 || tried[node])
+            {
+                node = -1;
+                for (size_t j = 0; j < tried.size() && node < 0; ++j)
+                {
+                    if (!tried[j])
+                        node = (int) j;
+                }
+            }
+            tried[node] = true;
+
+            const char *service_path = services[node].c_str();
+            status_t status = rpc_client.pb_call(service_path, req, resp);
+            if (!status)
+            {
+                logger("pb_call error. %s %s",
+                       service_path,
+                       status.error_str_.c_str());
+                node = -1;
+                continue;
+            }
+            if (resp.status() != "no leader")
+            {
+                set_leader(node);
+                return true;
+            }
+            //redirect to leader known by the node
+            node = find_node(resp.leader());
+        }
+        set_leader(-1);
+        return false;
+    }
+
+    std::string cas_call(const memkv_pb::cas_req &req,
+                         unsigned long long &version)
+    {
+        memkv_pb::cas_resp resp;
+
+        if (call("cas", req, resp))
+        {
+            version = resp.version();
+            if (resp.status() != "ok")
+                logger("cas response error. %s",
+                       resp.status().c_str());
+            return resp.status();
+        }
+        return "cas request failed";
+    }
+
     acl::http_rpc_client &rpc_client;
     service_map_t services_;
+    //ids of nodes.services of each action are in this order
+    std::vector<std::string> ids_;
+    //index of leader in ids_. -1 if it is unknown
+    int leader_;
+    acl::locker leader_locker_;
+
+    unsigned long long next_id_;
+    std::vector<async_worker *> workers_;
+    acl::locker workers_locker_;
 };
@@ -60,6 +60,41 @@ int main(int argc, char *argv[])
             std::cout << client.set(key,value) << std::endl;
         }
 
+    }
+    else if(cmd == std::string("setex"))
+    {
+        if (argc < 5)
+            logger_fatal("Param Error.\n memkv_client setex key value ttl");
+
+        std::cout << client.set(argv[2], argv[3], atoi(argv[4])) << std::endl;
+    }
+    else if(cmd == std::string("cas"))
+    {
+        if (argc < 5)
+            logger_fatal("Param Error.\n memkv_client cas key value version");
+
+        unsigned long long version = strtoull(argv[4], NULL, 10);
+        std::cout << client.cas(argv[2], argv[3], version)
+                  << " version:" << version << std::endl;
+    }
+    else if(cmd == std::string("incr"))
+    {
+        //read modify write with cas, retry if key is changed by others
+        if (argc < 3)
+            logger_fatal("Param Error.\n memkv_client incr key");
+
+        std::string status;
+        do
+        {
+            unsigned long long version = 0;
+            std::pair<bool, std::string> result = client.get(argv[2], version);
+            long long value = result.first ? atoll(result.second.c_str()) : 0;
+
+            acl::string data;
+            data.format("%lld", value + 1);
+            status = client.cas(argv[2], data.c_str(), version);
+            std::cout << status << " " << data.c_str() << std::endl;
+        } while (status == "version mismatch");
     }else if(cmd == std::string("del"))
     {
         std::string key = argv[2];
@@ -72,6 +107,95 @@ int main(int argc, char *argv[])
         std::string key = argv[2];
 
         std::cout << client.exist(key).second << std::endl;
+    }
+    else if(cmd == std::string("async_set"))
+    {
+        if(argc != 5)
+            logger_fatal("Param Error.\n memkv_client async_set key value count");
+
+        int count = atoi(argv[4]);
+        std::vector<memkv_future *> futures;
+
+        //requests of different keys are sent at the same time
+        for(int i = 0; i < count; i++)
+        {
+            acl::string key;
+            key.format("%s_%d", argv[2], i);
+
+            memkv_future *future = new memkv_future;
+            client.async_set(key.c_str(), argv[3], future);
+            futures.push_back(future);
+        }
+
+        int ok = 0;
+        for(size_t i = 0; i < futures.size(); i++)
+        {
+            const memkv_result &result = futures[i]->get();
+            if(result.ok && result.status == "ok")
+                ok++;
+            delete futures[i];
+        }
+        std::cout << "async_set " << ok << "/" << count << " ok" << std::endl;
+    }
+    else if(cmd == std::string("scan") || cmd == std::string("prefix"))
+    {
+        //scan start [end] / prefix prefix. all pages are printed
+        if(argc < 3)
+            logger_fatal("Param Error.\n memkv_client scan start [end]"
+                         "\n memkv_client prefix prefix");
+
+        bool scan = cmd == std::string("scan");
+        std::string start = argv[2];
+        std::string end = argc > 3 ? argv[3] : "";
+        memkv_scan_result result;
+
+        do
+        {
+            if(scan)
+                result = client.scan(start, end);
+            else
+                result = client.prefix(argv[2], 0, start);
+
+            if(!result.ok)
+            {
+                std::cout << cmd << " failed" << std::endl;
+                break;
+            }
+            for(size_t i = 0; i < result.items.size(); i++)
+                std::cout << result.items[i].first << " : "
+                          << result.items[i].second << std::endl;
+            start = result.next;
+        }while(result.more);
+    }
+    else if(cmd == std::string("mget"))
+    {
+        std::vector<std::string> keys(argv + 2, argv + argc);
+
+        std::pair<bool, std::map<std::string, std::string> > result =
+            client.mget(keys);
+        if(!result.first)
+            std::cout << "mget failed" << std::endl;
+
+        std::map<std::string, std::string>::iterator it;
+        for(it = result.second.begin(); it != result.second.end(); ++it)
+            std::cout << it->first << " : " << it->second << std::endl;
+    }
+    else if(cmd == std::string("mset"))
+    {
+        if(argc < 4 || argc % 2)
+            logger_fatal("Param Error.\n memkv_client mset key value ...");
+
+        std::map<std::string, std::string> items;
+        for(int i = 2; i + 1 < argc; i += 2)
+            items[argv[i]] = argv[i + 1];
+
+        std::cout << client.mset(items) << std::endl;
+    }
+    else if(cmd == std::string("mdel"))
+    {
+        std::vector<std::string> keys(argv + 2, argv + argc);
+
+        std::cout << client.mdel(keys) << std::endl;
     }else
     {
         logger("unknown cmd:%s",cmd);
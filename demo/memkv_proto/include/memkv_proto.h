@@ -11,8 +11,15 @@ struct get_resp
 
 struct set_req
 {
+	set_req()
+		:ttl(0)
+	{
+	}
 	std::string key;
 	std::string value;
+	//key expire after ttl milliseconds. 0 for never
+	//Gson@optional
+	int ttl;
 };
 
 struct set_resp
@@ -4,6 +4,25 @@
 
 struct raft_config
 {
+	raft_config()
+		:election_timeout(0),
+		heartbeat_interval(0),
+		min_election_timeout(0),
+		adaptive_timing(false),
+		snapshot_chunk_size(0),
+		snapshot_inflight(0),
+		snapshot_rate(0),
+		max_snapshot_transfers(0),
+		max_delta_chain(-1),
+		snapshot_compress(true),
+		compress_snapshot_transfer(false),
+		max_log_bytes(0),
+		compaction_keep_entries(-1),
+		compaction_peer_lag(-1),
+		max_replay_entries(0),
+		expire_interval(0)
+	{
+	}
 	std::string log_path;
 	std::string snapshot_path;
 	std::string metadata_path;
@@ -15,4 +34,53 @@ struct raft_config
 	std::vector<addr_info> peer_addrs;
 	//myself addr
 	addr_info node_addr;
+
+	//election timeout (milliseconds). 0 for default
+	//Gson@optional
+	int election_timeout;
+	//heartbeat interval (milliseconds). 0 for default
+	//Gson@optional
+	int heartbeat_interval;
+	//min election timeout of adaptive timing (milliseconds)
+	//Gson@optional
+	int min_election_timeout;
+	//derive election timeout and heartbeat from measured RTT
+	//Gson@optional
+	bool adaptive_timing;
+	//bytes of install snapshot request. 0 for default
+	//Gson@optional
+	int snapshot_chunk_size;
+	//install snapshot requests in flight to one peer. 0 for default
+	//Gson@optional
+	int snapshot_inflight;
+	//bytes per second of snapshot data sent by leader. 0 for no limit
+	//Gson@optional
+	int snapshot_rate;
+	//max followers leader send snapshot to at the same time. 0 for default
+	//Gson@optional
+	int max_snapshot_transfers;
+	//max delta snapshots after a full snapshot. 0 for full snapshot only
+	//Gson@optional
+	int max_delta_chain;
+	//write snapshot in compressed blocks
+	//Gson@optional
+	bool snapshot_compress;
+	//compress snapshot chunks sent to followers
+	//Gson@optional
+	bool compress_snapshot_transfer;
+	//max bytes of log entries. 0 for no limit
+	//Gson@optional
+	int max_log_bytes;
+	//log entries kept before snapshot index when log compaction
+	//Gson@optional
+	int compaction_keep_entries;
+	//leader keep log entries for followers behind less than this
+	//Gson@optional
+	int compaction_peer_lag;
+	//make snapshot when applied entries after it more than this
+	//Gson@optional
+	int max_replay_entries;
+	//interval leader check expired keys (milliseconds). 0 for default
+	//Gson@optional
+	int expire_interval;
 };
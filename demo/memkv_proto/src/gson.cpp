@@ -520,6 +520,86 @@ namespace acl
         else
             $node.add_child("node_addr", acl::gson($json, $obj.node_addr));
 
+        if (check_nullptr($obj.election_timeout))
+            $node.add_null("election_timeout");
+        else
+            $node.add_number("election_timeout", acl::get_value($obj.election_timeout));
+
+        if (check_nullptr($obj.heartbeat_interval))
+            $node.add_null("heartbeat_interval");
+        else
+            $node.add_number("heartbeat_interval", acl::get_value($obj.heartbeat_interval));
+
+        if (check_nullptr($obj.min_election_timeout))
+            $node.add_null("min_election_timeout");
+        else
+            $node.add_number("min_election_timeout", acl::get_value($obj.min_election_timeout));
+
+        if (check_nullptr($obj.adaptive_timing))
+            $node.add_null("adaptive_timing");
+        else
+            $node.add_bool("adaptive_timing", acl::get_value($obj.adaptive_timing));
+
+        if (check_nullptr($obj.snapshot_chunk_size))
+            $node.add_null("snapshot_chunk_size");
+        else
+            $node.add_number("snapshot_chunk_size", acl::get_value($obj.snapshot_chunk_size));
+
+        if (check_nullptr($obj.snapshot_inflight))
+            $node.add_null("snapshot_inflight");
+        else
+            $node.add_number("snapshot_inflight", acl::get_value($obj.snapshot_inflight));
+
+        if (check_nullptr($obj.snapshot_rate))
+            $node.add_null("snapshot_rate");
+        else
+            $node.add_number("snapshot_rate", acl::get_value($obj.snapshot_rate));
+
+        if (check_nullptr($obj.max_snapshot_transfers))
+            $node.add_null("max_snapshot_transfers");
+        else
+            $node.add_number("max_snapshot_transfers", acl::get_value($obj.max_snapshot_transfers));
+
+        if (check_nullptr($obj.max_delta_chain))
+            $node.add_null("max_delta_chain");
+        else
+            $node.add_number("max_delta_chain", acl::get_value($obj.max_delta_chain));
+
+        if (check_nullptr($obj.snapshot_compress))
+            $node.add_null("snapshot_compress");
+        else
+            $node.add_bool("snapshot_compress", acl::get_value($obj.snapshot_compress));
+
+        if (check_nullptr($obj.compress_snapshot_transfer))
+            $node.add_null("compress_snapshot_transfer");
+        else
+            $node.add_bool("compress_snapshot_transfer", acl::get_value($obj.compress_snapshot_transfer));
+
+        if (check_nullptr($obj.max_log_bytes))
+            $node.add_null("max_log_bytes");
+        else
+            $node.add_number("max_log_bytes", acl::get_value($obj.max_log_bytes));
+
+        if (check_nullptr($obj.compaction_keep_entries))
+            $node.add_null("compaction_keep_entries");
+        else
+            $node.add_number("compaction_keep_entries", acl::get_value($obj.compaction_keep_entries));
+
+        if (check_nullptr($obj.compaction_peer_lag))
+            $node.add_null("compaction_peer_lag");
+        else
+            $node.add_number("compaction_peer_lag", acl::get_value($obj.compaction_peer_lag));
+
+        if (check_nullptr($obj.max_replay_entries))
+            $node.add_null("max_replay_entries");
+        else
+            $node.add_number("max_replay_entries", acl::get_value($obj.max_replay_entries));
+
+        if (check_nullptr($obj.expire_interval))
+            $node.add_null("expire_interval");
+        else
+            $node.add_number("expire_interval", acl::get_value($obj.expire_interval));
+
 
         return $node;
     }
@@ -547,6 +627,22 @@ namespace acl
         acl::json_node *max_log_count = $node["max_log_count"];
         acl::json_node *peer_addrs = $node["peer_addrs"];
         acl::json_node *node_addr = $node["node_addr"];
+        acl::json_node *election_timeout = $node["election_timeout"];
+        acl::json_node *heartbeat_interval = $node["heartbeat_interval"];
+        acl::json_node *min_election_timeout = $node["min_election_timeout"];
+        acl::json_node *adaptive_timing = $node["adaptive_timing"];
+        acl::json_node *snapshot_chunk_size = $node["snapshot_chunk_size"];
+        acl::json_node *snapshot_inflight = $node["snapshot_inflight"];
+        acl::json_node *snapshot_rate = $node["snapshot_rate"];
+        acl::json_node *max_snapshot_transfers = $node["max_snapshot_transfers"];
+        acl::json_node *max_delta_chain = $node["max_delta_chain"];
+        acl::json_node *snapshot_compress = $node["snapshot_compress"];
+        acl::json_node *compress_snapshot_transfer = $node["compress_snapshot_transfer"];
+        acl::json_node *max_log_bytes = $node["max_log_bytes"];
+        acl::json_node *compaction_keep_entries = $node["compaction_keep_entries"];
+        acl::json_node *compaction_peer_lag = $node["compaction_peer_lag"];
+        acl::json_node *max_replay_entries = $node["max_replay_entries"];
+        acl::json_node *expire_interval = $node["expire_interval"];
         std::pair<bool, std::string> $result;
 
         if(!log_path ||!($result = gson(*log_path, &$obj.log_path), $result.first))
@@ -570,6 +666,54 @@ namespace acl
         if(!node_addr ||!node_addr->get_obj()||!($result = gson(*node_addr->get_obj(), &$obj.node_addr), $result.first))
             return std::make_pair(false, "required [raft_config.node_addr] failed:{"+$result.second+"}");
      
+        if(election_timeout)
+            gson(*election_timeout, &$obj.election_timeout);
+     
+        if(heartbeat_interval)
+            gson(*heartbeat_interval, &$obj.heartbeat_interval);
+     
+        if(min_election_timeout)
+            gson(*min_election_timeout, &$obj.min_election_timeout);
+     
+        if(adaptive_timing)
+            gson(*adaptive_timing, &$obj.adaptive_timing);
+     
+        if(snapshot_chunk_size)
+            gson(*snapshot_chunk_size, &$obj.snapshot_chunk_size);
+     
+        if(snapshot_inflight)
+            gson(*snapshot_inflight, &$obj.snapshot_inflight);
+     
+        if(snapshot_rate)
+            gson(*snapshot_rate, &$obj.snapshot_rate);
+     
+        if(max_snapshot_transfers)
+            gson(*max_snapshot_transfers, &$obj.max_snapshot_transfers);
+     
+        if(max_delta_chain)
+            gson(*max_delta_chain, &$obj.max_delta_chain);
+     
+        if(snapshot_compress)
+            gson(*snapshot_compress, &$obj.snapshot_compress);
+     
+        if(compress_snapshot_transfer)
+            gson(*compress_snapshot_transfer, &$obj.compress_snapshot_transfer);
+     
+        if(max_log_bytes)
+            gson(*max_log_bytes, &$obj.max_log_bytes);
+     
+        if(compaction_keep_entries)
+            gson(*compaction_keep_entries, &$obj.compaction_keep_entries);
+     
+        if(compaction_peer_lag)
+            gson(*compaction_peer_lag, &$obj.compaction_peer_lag);
+     
+        if(max_replay_entries)
+            gson(*max_replay_entries, &$obj.max_replay_entries);
+     
+        if(expire_interval)
+            gson(*expire_interval, &$obj.expire_interval);
+     
         return std::make_pair(true,"");
     }
 
@@ -606,6 +750,11 @@ namespace acl
         else
             $node.add_text("value", acl::get_value($obj.value));
 
+        if (check_nullptr($obj.ttl))
+            $node.add_null("ttl");
+        else
+            $node.add_number("ttl", acl::get_value($obj.ttl));
+
 
         return $node;
     }
@@ -628,6 +777,7 @@ namespace acl
     {
         acl::json_node *key = $node["key"];
         acl::json_node *value = $node["value"];
+        acl::json_node *ttl = $node["ttl"];
         std::pair<bool, std::string> $result;
 
         if(!key ||!($result = gson(*key, &$obj.key), $result.first))
@@ -636,6 +786,9 @@ namespace acl
         if(!value ||!($result = gson(*value, &$obj.value), $result.first))
             return std::make_pair(false, "required [set_req.value] failed:{"+$result.second+"}");
      
+        if(ttl)
+            gson(*ttl, &$obj.ttl);
+     
         return std::make_pair(true,"");
     }
 
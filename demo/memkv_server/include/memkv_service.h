@@ -2,7 +2,12 @@
 
 struct memkv_load_snapshot_callback;
 struct memkv_make_snapshot_callback;
+struct memkv_snapshot_sink;
+struct memkv_snapshot_view;
 struct memkv_apply_callback;
+struct memkv_recover_callback;
+struct memkv_log_entry;
+class replicate_future;
 
 class memkv_service : public acl::service_base
 {
@@ -13,10 +18,12 @@ public:
 private:
 	friend struct memkv_load_snapshot_callback;
 	friend struct memkv_make_snapshot_callback;
+	friend struct memkv_snapshot_sink;
+	friend struct memkv_snapshot_view;
 	friend struct memkv_apply_callback;
+	friend struct memkv_recover_callback;
+	friend class replicate_future;
 
-	typedef std::map<std::string, std::string> memkv_store_t;
-	
 
 	virtual void init();
 
@@ -30,12 +37,53 @@ private:
 	//raft from raft framework
 	bool load_snapshot(const std::string &file_path);
 
+	//swap in store built by snapshot sink
+	bool load_snapshot(memkv_store::items_t &store,
+					   const raft::version &ver);
+
+	//freeze store and capture current version
+	raft::snapshot_view *capture_snapshot();
+
+	//dirty keys are changed after ver
+	void set_dirty_base(const raft::version &ver);
+
 	bool make_snapshot(const std::string &path, std::string &file_path);
 
+	bool write_snapshot(const std::string &path,
+						const memkv_store::items_t &items,
+						const raft::version &ver,
+						std::string &file_path);
+
+	//write dirty keys of frozen items as delta of base
+	bool write_delta(const std::string &path,
+					 const memkv_store::items_t &items,
+					 const raft::version &ver,
+					 const raft::version &base,
+					 std::string &file_path);
+
+	bool load_delta(raft::zip_istream &in,
+					const raft::version &ver,
+					const raft::version &base);
+
 	bool apply(const std::string& data, const raft::version& ver);
 	//end
 
-	//helper function
+	//decode log data.it is thread safe, recover parse logs in threads
+	static memkv_log_entry *parse(const std::string &data);
+
+	//log written by old version: json of req and flag
+	static memkv_log_entry *parse_json(const std::string &data);
+
+	//result of conditional write is set to entry
+	bool apply(memkv_log_entry &entry, const raft::version &ver);
+
+	//replicate entry.it is applied when committed
+	bool replicate(memkv_log_entry &entry, std::string &status);
+
+	/**
+	 * reads are served if it is true, so they may be stale
+	 * when a new leader is elected in other partition
+	 */
 	bool check_leader()const;
 	
 	//memkv services
@@ -47,6 +95,70 @@ private:
 
 	bool del(const del_req &req, del_resp &resp);
 
+	//memkv protobuf services
+	bool pb_get(const memkv_pb::get_req &req, memkv_pb::get_resp &resp);
+
+	bool pb_exist(const memkv_pb::exist_req &req,
+				  memkv_pb::exist_resp &resp);
+
+	bool pb_set(const memkv_pb::set_req &req, memkv_pb::set_resp &resp);
+
+	bool pb_del(const memkv_pb::del_req &req, memkv_pb::del_resp &resp);
+
+	//set or delete key if its version not changed
+	bool pb_cas(const memkv_pb::cas_req &req, memkv_pb::cas_resp &resp);
+
+	bool pb_mget(const memkv_pb::mget_req &req, memkv_pb::mget_resp &resp);
+
+	//keys are set in one log entry
+	bool pb_mset(const memkv_pb::mset_req &req, memkv_pb::mset_resp &resp);
+
+	//keys are deleted in one log entry
+	bool pb_mdel(const memkv_pb::mdel_req &req, memkv_pb::mdel_resp &resp);
+
+	//items of key range in order, in pages
+	bool pb_scan(const memkv_pb::scan_req &req, memkv_pb::scan_resp &resp);
+
+	bool pb_prefix(const memkv_pb::prefix_req &req,
+				   memkv_pb::scan_resp &resp);
+
+	//store operations shared by json and protobuf services
+	void do_get(const std::string &key,
+				std::string &value,
+				std::string &status,
+				unsigned long long *version = NULL);
+
+	void do_exist(const std::string &key, std::string &status);
+
+	//ttl milliseconds.0 for never expire
+	void do_set(const std::string &key,
+				const std::string &value,
+				unsigned int ttl,
+				std::string &status);
+
+	void do_del(const std::string &key, std::string &status);
+
+	//version of key after it is given by version
+	void do_cas(const std::string &key,
+				const std::string &value,
+				bool deleted,
+				unsigned long long expected,
+				unsigned int ttl,
+				std::string &status,
+				unsigned long long &version);
+
+	void do_scan(const std::string &start,
+				 const std::string &end,
+				 unsigned int limit,
+				 memkv_pb::scan_resp &resp);
+
+	//replicate writes as one log entry, and then write them to store
+	void do_write(memkv_store::write_batch_t &batch,
+				  std::string &status);
+
+	//leader replicate expire log when keys are expired
+	void do_expire();
+
     void do_print_status();
 private:
     struct print_status :public  acl::thread
@@ -64,10 +176,26 @@ private:
         bool is_stop_;
         memkv_service *memkv_service_;
     };
+    struct expire_keys :public acl::thread
+    {
+        void *run()
+        {
+            while (!is_stop_)
+            {
+                memkv_service_->do_expire();
+                acl_doze(interval_);
+            }
+            return NULL;
+        }
+        bool is_stop_;
+        unsigned int interval_;
+        memkv_service *memkv_service_;
+    };
 
     //raft callback handles
     memkv_load_snapshot_callback *load_snapshot_callback_;
     memkv_make_snapshot_callback *make_snapshot_callback_;
+    memkv_snapshot_sink          *snapshot_sink_;
     memkv_apply_callback         *apply_callback_;
 
 	//raft node
@@ -77,8 +205,12 @@ private:
 	raft_config cfg_;
 
     //kv store
-	memkv_store_t   store_;
+	memkv_store     store_;
     raft::version   curr_ver_;
+    //version of last snapshot.dirty keys are changed after it
+    raft::version   dirty_base_;
+    //guard dirty_base_ only.taken inside mem_store_locker_
+    acl::locker     dirty_base_locker_;
     acl::locker     mem_store_locker_;
 
 	//config file_path
@@ -88,4 +220,5 @@ private:
     size_t last_writes_;
 
     print_status *print_status_;
+    expire_keys *expire_keys_;
 };
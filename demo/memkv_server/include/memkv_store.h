@@ -0,0 +1,549 @@
+#pragma once
+
+#ifndef __MEMKV_SHARDS__
+#define __MEMKV_SHARDS__ 64
+#endif
+
+#ifndef __MEMKV_ARENA_CHUNK__
+#define __MEMKV_ARENA_CHUNK__ (1024 * 1024)
+#endif
+
+#ifndef __MEMKV_ARENA_MIN_CHUNK__
+#define __MEMKV_ARENA_MIN_CHUNK__ (4 * 1024)
+#endif
+
+//bytes of key or value in arena
+struct memkv_bytes
+{
+	memkv_bytes()
+		:data(NULL),
+		 size(0)
+	{
+	}
+	std::string str() const
+	{
+		return std::string(data, size);
+	}
+	const char *data;
+	size_t size;
+};
+
+//version and expire time of key, kept in the record of key
+struct memkv_meta
+{
+	memkv_meta()
+		:version(0),
+		 expire_at(0)
+	{
+	}
+	//log index key is written at.0 for no version
+	unsigned long long version;
+	//milliseconds since epoch.0 for no expire
+	unsigned long long expire_at;
+};
+
+/**
+ * memory of key value records in chunks.
+ * record is varint key size, varint value size, varint version,
+ * varint expire time, key and value, so there is no allocation
+ * for each key.0 means record has no version or expire time.
+ * records are appended to the last chunk.space of released
+ * records is counted as garbage, it is reclaimed when owner
+ * copy live records to a new arena.
+ */
+class memkv_arena
+{
+public:
+	//chunk and offset of record
+	struct ref
+	{
+		unsigned int chunk;
+		unsigned int offset;
+	};
+
+	memkv_arena();
+
+	ref add(const std::string &key,
+			const std::string &value,
+			const memkv_meta &meta = memkv_meta());
+
+	ref add(const memkv_bytes &key,
+			const memkv_bytes &value,
+			const memkv_meta &meta = memkv_meta());
+
+	/**
+	 * \param meta meta of record is given if it is not NULL
+	 */
+	void get(const ref &_ref,
+			 memkv_bytes &key,
+			 memkv_bytes &value,
+			 memkv_meta *meta = NULL) const;
+
+	/**
+	 * write value and meta over old ones if they are
+	 * the same size.
+	 * \return false if size not match
+	 */
+	bool replace(const ref &_ref,
+				 const std::string &value,
+				 const memkv_meta &meta);
+
+	//record is not used any more
+	void release(const ref &_ref);
+
+	//bytes of chunks
+	size_t bytes() const;
+
+	//bytes of live records
+	size_t used() const;
+
+	//bytes of released records and unused tail of chunks
+	size_t garbage() const;
+
+	void clear();
+
+	void swap(memkv_arena &other);
+private:
+	char *alloc(size_t size, ref &_ref);
+
+	std::vector<std::vector<char> > chunks_;
+	//used bytes of the last chunk
+	size_t tail_;
+	size_t bytes_;
+	size_t used_;
+	size_t garbage_;
+};
+
+/**
+ * open addressing hash table of key value items.
+ * it is not thread safe, memkv_store lock it by shard.
+ * slots are probed linearly, and erased slot is marked deleted
+ * until the table is rehashed.
+ * a slot is hash and arena ref of the record (12 bytes), key,
+ * value and meta are in arena.arena is compacted when garbage
+ * is more than live records.
+ */
+class memkv_hash
+{
+public:
+	typedef std::pair<std::string, std::string> item_t;
+
+	class const_iterator
+	{
+	public:
+		const_iterator();
+
+		//bytes are valid until hash is changed
+		memkv_bytes key() const;
+
+		memkv_bytes value() const;
+
+		memkv_meta meta() const;
+
+		const_iterator &operator++();
+
+		bool operator==(const const_iterator &other) const;
+
+		bool operator!=(const const_iterator &other) const;
+	private:
+		friend class memkv_hash;
+
+		const_iterator(const memkv_hash *hash, size_t pos);
+
+		//move to next used slot
+		void skip();
+
+		const memkv_hash *hash_;
+		size_t pos_;
+	};
+
+	memkv_hash();
+
+	//FNV-1a hash of key
+	static unsigned int hash(const std::string &key);
+
+	static unsigned int hash(const char *data, size_t len);
+
+	/**
+	 * return false if key not found.
+	 * \param value value is copied to it if it is not NULL
+	 * \param meta meta of key is given if it is not NULL
+	 */
+	bool find(const std::string &key,
+			  std::string *value,
+			  memkv_meta *meta = NULL) const;
+
+	/**
+	 * return true if key is new
+	 * \param meta version and expire time of key
+	 */
+	bool set(const std::string &key,
+			 const std::string &value,
+			 const memkv_meta &meta = memkv_meta());
+
+	/**
+	 * return false if key not found
+	 */
+	bool erase(const std::string &key);
+
+	size_t size() const;
+
+	//bytes of slots
+	size_t table_bytes() const;
+
+	const memkv_arena &arena() const;
+
+	void clear();
+
+	void swap(memkv_hash &other);
+
+	const_iterator begin() const;
+
+	const_iterator end() const;
+private:
+	//ref.chunk of slot not used
+	enum
+	{
+		e_empty = 0xffffffff,
+		e_deleted = 0xfffffffe,
+	};
+	struct slot
+	{
+		slot()
+			:hash(0)
+		{
+			ref.chunk = e_empty;
+			ref.offset = 0;
+		}
+		bool used() const
+		{
+			return ref.chunk < e_deleted;
+		}
+		unsigned int hash;
+		memkv_arena::ref ref;
+	};
+
+	/**
+	 * find slot of key.if key not found, return slot to
+	 * insert it.table must not be empty
+	 */
+	size_t lookup(const std::string &key,
+				  unsigned int hash,
+				  bool &found) const;
+
+	//rehash to drop deleted slots, and make room for more items
+	void grow();
+
+	//copy live records to a new arena
+	void compact();
+
+	std::vector<slot> slots_;
+	size_t size_;
+	//used and deleted slots
+	size_t used_;
+	memkv_arena arena_;
+};
+
+/**
+ * items split into shards of memkv_hash by hash of key
+ */
+class memkv_items
+{
+public:
+	explicit memkv_items(size_t shards = __MEMKV_SHARDS__);
+
+	size_t shards() const;
+
+	size_t shard_index(const std::string &key) const;
+
+	memkv_hash &shard(size_t index);
+
+	const memkv_hash &shard(size_t index) const;
+
+	bool find(const std::string &key,
+			  std::string *value,
+			  memkv_meta *meta = NULL) const;
+
+	bool set(const std::string &key,
+			 const std::string &value,
+			 const memkv_meta &meta = memkv_meta());
+
+	bool erase(const std::string &key);
+
+	size_t size() const;
+
+	void clear();
+
+	void swap(memkv_items &other);
+private:
+	std::vector<memkv_hash> shards_;
+};
+
+/**
+ * memkv_store is a kv store that can be frozen for snapshot.
+ * items are in shards, and each shard has a reader writer lock,
+ * so reads of different keys do not wait each other.
+ * keys of each shard are also kept in an ordered index for scan,
+ * it is changed under the shard lock when key is added or deleted.
+ * expire time of key is kept in the record of key, and keys
+ * with expire time are in buckets of seconds, so expire does
+ * not scan all keys.
+ * version of key is the log index it is written at, it is kept
+ * in the record of key and used by compare and swap.
+ * any key is a key of user, store does not reserve keys.
+ * when it is frozen, items are not changed anymore, and writes
+ * go to delta of the shard (deleted key is kept as tombstone).
+ * snapshot thread read the frozen items without lock, and
+ * delta is merged into items when unfreeze.
+ * keys changed since last snapshot are kept as dirty keys,
+ * delta snapshot only write these keys.
+ */
+class memkv_store
+{
+public:
+	typedef memkv_items items_t;
+	typedef std::set<std::string> keys_t;
+
+	//a set or delete of write batch
+	struct write_op
+	{
+		write_op()
+			:deleted(false),
+			 expire_at(0),
+			 version(0)
+		{
+		}
+		bool deleted;
+		std::string key;
+		std::string value;
+		//milliseconds since epoch.0 for no expire
+		unsigned long long expire_at;
+		//version of key after set.0 for no version
+		unsigned long long version;
+	};
+	typedef std::vector<write_op> write_batch_t;
+	typedef std::vector<memkv_hash::item_t> scan_items_t;
+
+	//memory used by items
+	struct memory_stats
+	{
+		memory_stats()
+			:keys(0),
+			 items(0),
+			 table_bytes(0),
+			 arena_bytes(0),
+			 garbage_bytes(0),
+			 index_bytes(0)
+		{
+		}
+		//keys of user
+		size_t keys;
+		//records in hash tables
+		size_t items;
+		size_t table_bytes;
+		size_t arena_bytes;
+		//bytes of arena not used by live items
+		size_t garbage_bytes;
+		//estimated bytes of ordered index and expire buckets
+		size_t index_bytes;
+	};
+
+	memkv_store();
+
+	~memkv_store();
+
+	/**
+	 * \param version version of key is given if it is not NULL
+	 */
+	bool get(const std::string &key,
+			 std::string &value,
+			 unsigned long long *version = NULL);
+
+	bool exist(const std::string &key);
+
+	/**
+	 * version of key is the log index it is written at.
+	 * 0 if key not found.keys written without version
+	 * (snapshot of old version) are version 1
+	 */
+	unsigned long long version(const std::string &key);
+
+	/**
+	 * set key with expire time.key is deleted by expire().
+	 * \param expire_at milliseconds since epoch.0 for no expire
+	 * \param version version of key.0 for no version
+	 */
+	void set(const std::string &key,
+			 const std::string &value,
+			 unsigned long long expire_at = 0,
+			 unsigned long long version = 0);
+
+	void del(const std::string &key);
+
+	/**
+	 * do write op if version of key is expected.
+	 * expected 0 means key must not exist.
+	 * \param current version of key after it
+	 * \return false if version not match, key is not changed
+	 */
+	bool cas(const write_op &op,
+			 unsigned long long expected,
+			 unsigned long long &current);
+
+	/**
+	 * delete keys expire at or before time.
+	 * it only visits keys in time buckets before time.
+	 * \return count of keys deleted
+	 */
+	size_t expire(unsigned long long time);
+
+	/**
+	 * earliest time keys expire, in second precision.
+	 * 0 if no key has expire time
+	 */
+	unsigned long long next_expire();
+
+	/**
+	 * meta of key in snapshot and delta files.it is empty
+	 * if key has no version and expire time
+	 */
+	static std::string encode_meta(const memkv_meta &meta);
+
+	//return false if data is not encoded meta
+	static bool decode_meta(const std::string &data, memkv_meta &meta);
+
+	/**
+	 * files written before meta was in records keep version and
+	 * expire time of key as items "\0v" + key and "\0t" + key.
+	 * move them into records of keys and erase them.
+	 * only items of such files are passed to it
+	 */
+	static void fold_legacy_items(items_t &items);
+
+	/**
+	 * do sets and deletes of batch in order.
+	 * shards of keys are locked together, so readers see all
+	 * writes of the batch or none of them.
+	 */
+	void write(const write_batch_t &batch);
+
+	size_t size();
+
+	/**
+	 * memory of items, ordered index and expire buckets.
+	 * delta of frozen store is not counted
+	 */
+	void memory(memory_stats &stats);
+
+	/**
+	 * get items of keys in [start, end) in key order.
+	 * keys of shards are merged, it stops at limit items.
+	 * \param end empty for no upper bound
+	 * \param limit max count of items
+	 * \param next first key after items is given if it is not NULL
+	 * \return true if there are more items after them
+	 */
+	bool scan(const std::string &start,
+			  const std::string &end,
+			  size_t limit,
+			  scan_items_t &items,
+			  std::string *next = NULL);
+
+	/**
+	 * first key after keys begin with prefix.
+	 * empty if there is no such key
+	 */
+	static std::string prefix_end(const std::string &prefix);
+
+	/**
+	 * replace all items with items.
+	 * it wait for frozen items released.
+	 */
+	void reset(items_t &items);
+
+	/**
+	 * apply changes of a delta snapshot.keys are not dirty.
+	 * it wait for frozen items released.
+	 */
+	void patch(items_t &sets, const keys_t &dels);
+
+	/**
+	 * freeze current items of all shards.
+	 * return NULL if it is frozen already.
+	 * caller must invoke unfreeze() after using the items.
+	 * dirty keys are taken by the frozen items, keys changed
+	 * after freeze are dirty for next snapshot.
+	 */
+	const items_t *freeze();
+
+	/**
+	 * dirty keys of a shard of frozen items.
+	 * only valid while frozen
+	 */
+	const keys_t &frozen_dirty(size_t shard) const;
+
+	/**
+	 * count of dirty keys of frozen items
+	 */
+	size_t frozen_dirty_size() const;
+
+	/**
+	 * snapshot of frozen items is not written.
+	 * give back dirty keys of frozen items.
+	 */
+	void restore_dirty();
+
+	void unfreeze();
+private:
+	struct shard;
+	struct expiry;
+
+	bool find(shard &_shard,
+			  size_t index,
+			  const std::string &key,
+			  std::string *value,
+			  memkv_meta *meta = NULL);
+
+	//shard is locked.0 if key not found
+	unsigned long long get_version(shard &_shard,
+								   size_t index,
+								   const std::string &key);
+
+	//shard is locked for write
+	void set(shard &_shard,
+			 size_t index,
+			 const std::string &key,
+			 const std::string &value,
+			 unsigned long long expire_at,
+			 unsigned long long version);
+
+	void del(shard &_shard, size_t index, const std::string &key);
+
+	void write(shard &_shard, size_t index, const write_op &op);
+
+	//write item without index and expire buckets
+	void put(shard &_shard,
+			 size_t index,
+			 const std::string &key,
+			 const std::string &value,
+			 const memkv_meta &meta = memkv_meta());
+
+	void remove(shard &_shard, size_t index, const std::string &key);
+
+	/**
+	 * rebuild index and expire buckets from items.
+	 * shards are locked
+	 */
+	void rebuild_index();
+
+	void lock_all();
+
+	void unlock_all();
+
+	//hold while items frozen
+	acl::locker freeze_locker_;
+
+	items_t items_;
+	std::vector<shard *> shards_;
+	expiry *expiry_;
+};
@@ -1,8 +1,10 @@
 #include "raft.hpp"
 #include "addr_info.h"
 #include "memkv_proto.h"
+#include "proto_gen/memkv.pb.h"
 #include "cluster_config.h"
 #include "raft_config.h"
+#include "memkv_store.h"
 #include "memkv_service.h"
 #include "memkv.h"
 
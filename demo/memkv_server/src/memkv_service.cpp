@@ -3,15 +3,24 @@
 #include "addr_info.h"
 #include "raft_config.h"
 #include "memkv_proto.h"
+#include "proto_gen/memkv.pb.h"
 #include "cluster_config.h"
 #include "gson.h"
 #include "raft.hpp"
+#include "memkv_store.h"
 #include "memkv_service.h"
 
 extern char *var_cfg_raft_config;
 
 typedef raft::replicate_callback::status_t replicate_status_t;
 
+/*
+ * item count of snapshot and delta files is after it if meta of
+ * keys is written after values.files written before it have
+ * version and expire time of keys as items
+ */
+#define MEMKV_META_FORMAT 0xffffffff
+
 struct memkv_load_snapshot_callback :raft::load_snapshot_callback
 {
 	explicit memkv_load_snapshot_callback(memkv_service *memkv)
@@ -36,8 +45,279 @@ struct memkv_make_snapshot_callback :raft::make_snapshot_callback
 	{
 		return memkv_service_->make_snapshot(path, file_path);
 	}
+	virtual raft::snapshot_view *capture()
+	{
+		return memkv_service_->capture_snapshot();
+	}
+	memkv_service *memkv_service_;
+};
+
+/**
+ * frozen items of store. it is written to snapshot file
+ * without blocking requests.
+ * if it is not written, dirty keys are given back to store
+ */
+struct memkv_snapshot_view :raft::snapshot_view
+{
+	memkv_snapshot_view(memkv_service *memkv,
+						const memkv_store::items_t *items,
+						const raft::version &ver,
+						const raft::version &base)
+		:memkv_service_(memkv),
+		 items_(items),
+		 ver_(ver),
+		 base_(base),
+		 written_(false)
+	{
+
+	}
+	~memkv_snapshot_view()
+	{
+		/*
+		 * dirty_base_ is changed while store is frozen.
+		 * mem_store_locker_ can't be taken here, load_snapshot
+		 * holds it and waits in store reset until unfreeze
+		 */
+		if (written_)
+			memkv_service_->set_dirty_base(ver_);
+		else
+			memkv_service_->store_.restore_dirty();
+		memkv_service_->store_.unfreeze();
+	}
+	virtual bool write(const std::string &path, std::string &file_path)
+	{
+		written_ = memkv_service_->write_snapshot(path,
+												  *items_,
+												  ver_,
+												  file_path);
+		return written_;
+	}
+	virtual bool write_delta(const std::string &path,
+							 const raft::version &base,
+							 std::string &file_path)
+	{
+		//dirty keys are changed after base_ only
+		if (!base_.index_ ||
+			base.index_ != base_.index_ ||
+			base.term_ != base_.term_)
+			return false;
+
+		written_ = memkv_service_->write_delta(path,
+											   *items_,
+											   ver_,
+											   base_,
+											   file_path);
+		return written_;
+	}
+	memkv_service *memkv_service_;
+	const memkv_store::items_t *items_;
+	raft::version ver_;
+	raft::version base_;
+	bool written_;
+};
+/**
+ * parse snapshot bytes into a new store while they arrive.
+ * snapshot file: version header, meta format mark, item count,
+ * and then key, value and meta of keys.data after header is in zip blocks if
+ * open() says it is compressed, they are decompressed before
+ * parsing.
+ */
+struct memkv_snapshot_sink :raft::snapshot_sink
+{
+	explicit memkv_snapshot_sink(memkv_service *memkv)
+		:memkv_service_(memkv),
+		 state_(e_magic),
+		 items_(0),
+		 meta_(false),
+		 compressed_(false)
+	{
+
+	}
+	virtual bool open(const raft::version &ver, bool compressed)
+	{
+		reset();
+		ver_ = ver;
+		compressed_ = compressed;
+		return true;
+	}
+	virtual bool write(const char *data, size_t len)
+	{
+		if (state_ > e_version)
+			return feed(data, len);
+
+		buffer_.append(data, len);
+
+		size_t pos = 0;
+		while (state_ <= e_version && parse(pos));
+
+		if (state_ <= e_version)
+		{
+			buffer_.erase(0, pos);
+			return true;
+		}
+		//data after header
+		std::string rest = buffer_.substr(pos);
+		buffer_.clear();
+		return feed(rest.data(), rest.size());
+	}
+	virtual bool close(bool done)
+	{
+		bool ok = done &&
+			state_ == e_key &&
+			buffer_.empty() &&
+			decoder_.finished() &&
+			store_.size() == items_;
+
+		if (done && !ok)
+			logger_error("snapshot not finished");
+
+		if (ok && !meta_)
+			memkv_store::fold_legacy_items(store_);
+		if (ok)
+			ok = memkv_service_->load_snapshot(store_, ver_);
+
+		reset();
+		return ok;
+	}
+private:
+	enum state_t
+	{
+		e_magic,
+		e_version,
+		e_items,
+		e_key,
+		e_value,
+		e_meta,
+	};
+	void reset()
+	{
+		store_.clear();
+		buffer_.clear();
+		key_.clear();
+		value_.clear();
+		decoder_.reset();
+		state_ = e_magic;
+		items_ = 0;
+		meta_ = false;
+		compressed_ = false;
+	}
+	bool feed(const char *data, size_t len)
+	{
+		if (!compressed_)
+		{
+			buffer_.append(data, len);
+		}
+		else if (!decoder_.update(data, len, buffer_))
+		{
+			logger_error("snapshot zip block error");
+			return false;
+		}
+
+		size_t pos = 0;
+		while (parse(pos));
+
+		buffer_.erase(0, pos);
+		return true;
+	}
+	//get a length prefixed string from buffer
+	bool get_string(size_t &pos, std::string *str)
+	{
+		if (buffer_.size() - pos < sizeof(unsigned int))
+			return false;
+
+		unsigned char *ptr = (unsigned char *) buffer_.data() + pos;
+		unsigned int len = raft::get_uint32(ptr);
+
+		if (buffer_.size() - pos - sizeof(unsigned int) < len)
+			return false;
+
+		if (str)
+			str->assign((char *) ptr, len);
+		pos += sizeof(unsigned int) + len;
+		return true;
+	}
+	bool parse(size_t &pos)
+	{
+		switch (state_)
+		{
+		case e_magic:
+			if (!get_string(pos, NULL))
+				return false;
+			state_ = e_version;
+			return true;
+		case e_version:
+			//version and compressed are given by open()
+			if (!get_string(pos, NULL))
+				return false;
+			state_ = e_items;
+			return true;
+		case e_items:
+		{
+			if (buffer_.size() - pos < sizeof(unsigned int))
+				return false;
+			unsigned char *ptr = (unsigned char *) buffer_.data() + pos;
+			unsigned int items = raft::get_uint32(ptr);
+			pos += sizeof(unsigned int);
+
+			//item count is after the mark
+			if (items == MEMKV_META_FORMAT && !meta_)
+			{
+				meta_ = true;
+				return true;
+			}
+			items_ = items;
+			state_ = e_key;
+			return true;
+		}
+		case e_key:
+			if (!get_string(pos, &key_))
+				return false;
+			state_ = e_value;
+			return true;
+		case e_value:
+			if (!get_string(pos, &value_))
+				return false;
+			if (meta_)
+			{
+				state_ = e_meta;
+				return true;
+			}
+			store_.set(key_, value_);
+			state_ = e_key;
+			return true;
+		case e_meta:
+		{
+			std::string data;
+			memkv_meta meta;
+			if (!get_string(pos, &data))
+				return false;
+			if (!memkv_store::decode_meta(data, meta))
+			{
+				logger_error("snapshot meta error");
+				return false;
+			}
+			store_.set(key_, value_, meta);
+			state_ = e_key;
+			return true;
+		}
+		}
+		return false;
+	}
+
 	memkv_service *memkv_service_;
+	memkv_store::items_t store_;
+	raft::version ver_;
+	std::string buffer_;
+	std::string key_;
+	std::string value_;
+	raft::zip_decoder decoder_;
+	state_t state_;
+	unsigned int items_;
+	//meta of keys is after values
+	bool meta_;
+	bool compressed_;
 };
+
 struct memkv_apply_callback : raft::apply_callback
 {
 	explicit memkv_apply_callback(memkv_service *memkv)
@@ -52,11 +332,66 @@ struct memkv_apply_callback : raft::apply_callback
 	memkv_service *memkv_service_;
 };
 
+//memkv log decoded
+struct memkv_log_entry : raft::recover_callback::entry
+{
+	memkv_log_entry()
+		:flag_(0),
+		 expire_at_(0),
+		 cas_(false),
+		 expected_(0),
+		 done_(false),
+		 version_(0)
+	{
+	}
+	char flag_;
+	std::string key_;
+	std::string value_;
+	//writes of batch log
+	memkv_store::write_batch_t batch_;
+	//expire time of setex log, or time of expire log
+	unsigned long long expire_at_;
+	//write only if version of key is expected_
+	bool cas_;
+	unsigned long long expected_;
+
+	//result of apply.done_ is false if version not match
+	bool done_;
+	//version of key after cas
+	unsigned long long version_;
+};
+
+struct memkv_recover_callback : raft::recover_callback
+{
+	explicit memkv_recover_callback(memkv_service *memkv)
+		:memkv_service_(memkv)
+	{
+
+	}
+	virtual entry *parse(const std::string &data, const raft::version &)
+	{
+		return memkv_service::parse(data);
+	}
+	virtual bool apply(entry *parsed, const raft::version &ver)
+	{
+		return memkv_service_->apply(
+			*static_cast<memkv_log_entry *>(parsed), ver);
+	}
+	memkv_service *memkv_service_;
+};
+
+/**
+ * wait for log entry replicated.
+ * leader apply the entry when it is committed, in order of log index,
+ * so result of conditional write is the same as on followers.
+ */
 class replicate_future : public raft::replicate_callback
 {
 public:
-	replicate_future()
-		:done_(false)
+	replicate_future(memkv_service *memkv, memkv_log_entry &entry)
+		:memkv_service_(memkv),
+		 entry_(entry),
+		 done_(false)
 	{
 		acl_assert(acl_pthread_cond_init(&cond_, NULL) == 0);
 		acl_assert(acl_pthread_mutex_init(&mutex_, NULL) == 0);
@@ -69,6 +404,9 @@ public:
 	}
 	bool operator()(status_t status, raft::version ver)
 	{
+		if (status == E_OK)
+			memkv_service_->apply(entry_, ver);
+
         acl_pthread_mutex_lock(&mutex_);
 		done_ = true;
 		status_ = status;
@@ -100,64 +438,219 @@ public:
 		return status_;
 	}
 private:
+	memkv_service *memkv_service_;
+	memkv_log_entry &entry_;
 	acl_pthread_mutex_t mutex_;
 	acl_pthread_cond_t cond_;
 	status_t status_;
 	raft::version ver_;
 	bool done_;
 };
-static inline std::string to_string(const acl::string &data)
+#define	DEL_REQ  'd'
+#define	SET_REQ  's'
+#define	BATCH_REQ  'b'
+#define	SETEX_REQ  'x'
+#define	EXPIRE_REQ 'e'
+#define	CAS_REQ    'c'
+
+/*
+ * binary log of memkv: version, flag, key and value.
+ * key and value are prefixed with varint length.
+ * setex log has varint expire time after value.
+ * cas log is flag, varint expected version, and then a set, setex
+ * or delete log without version.
+ * old log is json of req with flag at the end, it starts with '{'
+ */
+#define MEMKV_LOG_V1 0x01
+
+//items of a scan page
+#ifndef __MEMKV_SCAN_LIMIT__
+#define __MEMKV_SCAN_LIMIT__ 100
+#endif
+
+#ifndef __MEMKV_MAX_SCAN_LIMIT__
+#define __MEMKV_MAX_SCAN_LIMIT__ 10000
+#endif
+
+//interval of leader checking expired keys (milliseconds)
+#ifndef __MEMKV_EXPIRE_INTERVAL__
+#define __MEMKV_EXPIRE_INTERVAL__ 1000
+#endif
+
+//milliseconds since epoch
+static unsigned long long now_millis()
 {
-	return std::string(data.c_str(), data.size());
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (unsigned long long) now.tv_sec * 1000 + now.tv_usec / 1000;
 }
 
-#define	DEL_REQ  'd'
-#define	SET_REQ  's'
+static void encode_bytes(const std::string &bytes, std::string &data)
+{
+	raft::put_varint(data, bytes.size());
+	data.append(bytes);
+}
+/*
+ * batch log: varint count of writes, and then
+ * flag, key and value (no value for delete) of each write
+ */
+static void encode_batch(const memkv_store::write_batch_t &batch,
+						 std::string &data)
+{
+	raft::put_varint(data, batch.size());
 
-char get_req_flag(...)
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		const memkv_store::write_op &op = batch[i];
+
+		data.push_back(op.deleted ? DEL_REQ : SET_REQ);
+		encode_bytes(op.key, data);
+		if (!op.deleted)
+			encode_bytes(op.value, data);
+	}
+}
+/*
+ * expire log is varint time.keys expire at or before time are
+ * deleted when it is applied, so all nodes delete the same keys
+ * at the same index.
+ */
+static void encode_log(const memkv_log_entry &entry, std::string &data)
+{
+	data.reserve(entry.key_.size() + entry.value_.size() + 32);
+	data.push_back(MEMKV_LOG_V1);
+
+	if (entry.cas_)
+	{
+		data.push_back(CAS_REQ);
+		raft::put_varint(data, entry.expected_);
+	}
+	data.push_back(entry.flag_);
+
+	switch (entry.flag_)
+	{
+	case SET_REQ:
+	case SETEX_REQ:
+		encode_bytes(entry.key_, data);
+		encode_bytes(entry.value_, data);
+		if (entry.flag_ == SETEX_REQ)
+			raft::put_varint(data, entry.expire_at_);
+		break;
+	case DEL_REQ:
+		encode_bytes(entry.key_, data);
+		break;
+	case BATCH_REQ:
+		encode_batch(entry.batch_, data);
+		break;
+	case EXPIRE_REQ:
+		raft::put_varint(data, entry.expire_at_);
+		break;
+	}
+}
+//get varint length prefixed bytes
+static bool decode_bytes(unsigned char *&ptr,
+						 const unsigned char *end,
+						 std::string &bytes)
 {
-	logger_error("not error req type");
-	return '.';
+	unsigned long long len = 0;
+	if (!raft::get_varint(ptr, end, len) || len > (size_t)(end - ptr))
+		return false;
+	bytes.assign((const char *) ptr, (size_t) len);
+	ptr += len;
+	return true;
 }
-char get_req_flag(const set_req &)
+
+static bool decode_batch(unsigned char *&ptr,
+						 const unsigned char *end,
+						 memkv_store::write_batch_t &batch)
 {
-	return SET_REQ;
+	unsigned long long count = 0;
+
+	//a write is 2 bytes at least
+	if (!raft::get_varint(ptr, end, count) ||
+		count > (size_t)(end - ptr) / 2)
+		return false;
+
+	batch.resize((size_t) count);
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		memkv_store::write_op &op = batch[i];
+		if (ptr == end)
+			return false;
+
+		char flag = (char) *ptr++;
+		if (flag != SET_REQ && flag != DEL_REQ)
+			return false;
+		op.deleted = flag == DEL_REQ;
+
+		if (!decode_bytes(ptr, end, op.key))
+			return false;
+		if (!op.deleted && !decode_bytes(ptr, end, op.value))
+			return false;
+	}
+	return true;
 }
-char get_req_flag(const del_req &)
+
+static bool decode_log(unsigned char *&ptr,
+					   const unsigned char *end,
+					   memkv_log_entry &entry)
 {
-	return DEL_REQ;
+	if (ptr == end)
+		return false;
+	entry.flag_ = (char) *ptr++;
+
+	if (entry.flag_ == CAS_REQ)
+	{
+		entry.cas_ = true;
+		if (!raft::get_varint(ptr, end, entry.expected_) || ptr == end)
+			return false;
+		entry.flag_ = (char) *ptr++;
+	}
+
+	switch (entry.flag_)
+	{
+	case SET_REQ:
+		return decode_bytes(ptr, end, entry.key_) &&
+			decode_bytes(ptr, end, entry.value_);
+	case SETEX_REQ:
+		return decode_bytes(ptr, end, entry.key_) &&
+			decode_bytes(ptr, end, entry.value_) &&
+			raft::get_varint(ptr, end, entry.expire_at_);
+	case DEL_REQ:
+		return decode_bytes(ptr, end, entry.key_);
+	case BATCH_REQ:
+		return !entry.cas_ && decode_batch(ptr, end, entry.batch_);
+	case EXPIRE_REQ:
+		return !entry.cas_ && raft::get_varint(ptr, end, entry.expire_at_);
+	}
+	return false;
 }
-//do replicate req. and set RESP::status
+//replicate log of entry and wait it applied. and set status
 //return true if replicate ok.otherwise return false
-template<class REQ, class RESP>
-bool replicate(const REQ& req,
-	           RESP &resp,
-	           raft::node *node,
-	           raft::version &version)
-{
-	std::string data = to_string(acl::gson(req));
-	data.push_back(get_req_flag(req));
-	replicate_future future;
-	if (!node->replicate(data, &future))
-	{
-		resp.status = "error";
+bool memkv_service::replicate(memkv_log_entry &entry, std::string &status)
+{
+	std::string data;
+	encode_log(entry, data);
+
+	replicate_future future(this, entry);
+	if (!node_->replicate(data, &future))
+	{
+		status = "error";
 		return false;
 	}
 	future.wait();
 	//maybe node lost leadership.
-	replicate_status_t status = future.status();
-	if (status == raft::replicate_callback::E_NO_LEADER)
+	replicate_status_t replicate_status = future.status();
+	if (replicate_status == raft::replicate_callback::E_NO_LEADER)
 	{
-		resp.status = "no leader";
+		status = "no leader";
 		return false;
 	}
-	else if (status == raft::replicate_callback::E_ERROR)
+	else if (replicate_status == raft::replicate_callback::E_ERROR)
 	{
-		resp.status = "error";
+		status = "error";
 		return false;
 	}
-	resp.status = "ok";
-	version = future.version();
+	status = "ok";
 	return true;
 }
 
@@ -168,6 +661,7 @@ memkv_service::memkv_service(acl::http_rpc_server &server)
 
 	load_snapshot_callback_ = new memkv_load_snapshot_callback(this);
 	make_snapshot_callback_ = new memkv_make_snapshot_callback(this);
+	snapshot_sink_ = new memkv_snapshot_sink(this);
 	apply_callback_ = new memkv_apply_callback(this);
 	node_ = new raft::node;
 	cfg_file_path_ = var_cfg_raft_config;
@@ -177,18 +671,30 @@ memkv_service::memkv_service(acl::http_rpc_server &server)
     print_status_->is_stop_ = false;
     print_status_->memkv_service_ = this;
     print_status_->start();
+    //it is started by init
+    expire_keys_ = new expire_keys;
+    expire_keys_->is_stop_ = true;
+    expire_keys_->interval_ = __MEMKV_EXPIRE_INTERVAL__;
+    expire_keys_->memkv_service_ = this;
 }
 
 memkv_service::~memkv_service()
 {
     print_status_->is_stop_ = true;
     print_status_->wait();
+    if (!expire_keys_->is_stop_)
+    {
+        expire_keys_->is_stop_ = true;
+        expire_keys_->wait();
+    }
 
 	delete node_;
 	delete load_snapshot_callback_;
 	delete make_snapshot_callback_;
+	delete snapshot_sink_;
 	delete apply_callback_;
     delete print_status_;
+    delete expire_keys_;
 }
 
 void memkv_service::init()
@@ -200,6 +706,9 @@ void memkv_service::init()
     reload();
     //start node
     node_->start();
+    //leader replicate expire log for expired keys
+    expire_keys_->is_stop_ = false;
+    expire_keys_->start();
 }
 void memkv_service::load_config()
 {
@@ -233,9 +742,45 @@ void memkv_service::init_raft_node()
 	node_->set_log_path(cfg_.log_path);
 	node_->set_max_log_size((size_t) cfg_.max_log_size);
 	node_->set_max_log_count((size_t) cfg_.max_log_count);
+	if (cfg_.max_log_bytes > 0)
+		node_->set_max_log_bytes((size_t) cfg_.max_log_bytes);
+	if (cfg_.compaction_keep_entries >= 0)
+		node_->set_compaction_keep_entries(
+			(raft::log_index_t) cfg_.compaction_keep_entries);
+	if (cfg_.compaction_peer_lag >= 0)
+		node_->set_compaction_peer_lag(
+			(raft::log_index_t) cfg_.compaction_peer_lag);
+	if (cfg_.max_replay_entries > 0)
+		node_->set_max_replay_entries(
+			(raft::log_index_t) cfg_.max_replay_entries);
+	if (cfg_.expire_interval > 0)
+		expire_keys_->interval_ = (unsigned int) cfg_.expire_interval;
 	node_->set_metadata_path(cfg_.metadata_path);
 	node_->set_snapshot_path(cfg_.snapshot_path);
 
+	//election and heartbeat timing
+	if (cfg_.election_timeout > 0)
+		node_->set_election_timeout((unsigned int) cfg_.election_timeout);
+	if (cfg_.heartbeat_interval > 0)
+		node_->set_heartbeat_interval((unsigned int) cfg_.heartbeat_interval);
+	if (cfg_.min_election_timeout > 0)
+		node_->set_min_election_timeout(
+			(unsigned int) cfg_.min_election_timeout);
+	node_->set_adaptive_timing(cfg_.adaptive_timing);
+
+	if (cfg_.snapshot_chunk_size > 0)
+		node_->set_snapshot_chunk_size((size_t) cfg_.snapshot_chunk_size);
+	if (cfg_.snapshot_inflight > 0)
+		node_->set_snapshot_inflight(cfg_.snapshot_inflight);
+	if (cfg_.snapshot_rate > 0)
+		node_->set_snapshot_rate((unsigned long long) cfg_.snapshot_rate);
+	if (cfg_.max_snapshot_transfers > 0)
+		node_->set_max_snapshot_transfers(cfg_.max_snapshot_transfers);
+	//0 disable delta snapshot
+	if (cfg_.max_delta_chain >= 0)
+		node_->set_max_delta_chain((size_t) cfg_.max_delta_chain);
+	node_->set_compress_snapshot_transfer(cfg_.compress_snapshot_transfer);
+
 	std::vector<raft::peer_info> peer_infos;
 	for (size_t i = 0; i < cfg_.peer_addrs.size(); i++)
 	{
@@ -251,6 +796,8 @@ void memkv_service::init_raft_node()
 	node_->set_load_snapshot_callback(load_snapshot_callback_);
 	//make snapshot 
 	node_->set_make_snapshot_callback(make_snapshot_callback_);
+	//build store while receiving snapshot
+	node_->set_snapshot_sink(snapshot_sink_);
 	//apply callback
 	node_->set_apply_callback(apply_callback_);
 }
@@ -274,6 +821,37 @@ void memkv_service::regist_service()
 	service_path.format("/memkv%s/store/exist",id);
 	server_.on_json(service_path, this, &memkv_service::exist);
 
+	//protobuf services of store
+	service_path.format("/memkv%s/store/pb/get", id);
+	server_.on_pb(service_path, this, &memkv_service::pb_get);
+
+	service_path.format("/memkv%s/store/pb/set", id);
+	server_.on_pb(service_path, this, &memkv_service::pb_set);
+
+	service_path.format("/memkv%s/store/pb/del", id);
+	server_.on_pb(service_path, this, &memkv_service::pb_del);
+
+	service_path.format("/memkv%s/store/pb/exist", id);
+	server_.on_pb(service_path, this, &memkv_service::pb_exist);
+
+	service_path.format("/memkv%s/store/pb/cas", id);
+	server_.on_pb(service_path, this, &memkv_service::pb_cas);
+
+	service_path.format("/memkv%s/store/pb/mget", id);
+	server_.on_pb(service_path, this, &memkv_service::pb_mget);
+
+	service_path.format("/memkv%s/store/pb/mset", id);
+	server_.on_pb(service_path, this, &memkv_service::pb_mset);
+
+	service_path.format("/memkv%s/store/pb/mdel", id);
+	server_.on_pb(service_path, this, &memkv_service::pb_mdel);
+
+	service_path.format("/memkv%s/store/pb/scan", id);
+	server_.on_pb(service_path, this, &memkv_service::pb_scan);
+
+	service_path.format("/memkv%s/store/pb/prefix", id);
+	server_.on_pb(service_path, this, &memkv_service::pb_prefix);
+
 	//regist service for raft peer
 
     //election req
@@ -281,6 +859,11 @@ void memkv_service::regist_service()
     server_.on_pb(service_path, node_,
                   &raft::node::handle_vote_request);
 
+    //pre-vote req
+    service_path.format("/memkv%s/raft/pre_vote_req", id);
+    server_.on_pb(service_path, node_,
+                  &raft::node::handle_pre_vote_request);
+
 	//replicate req
 	service_path.format("/memkv%s/raft/replicate_log_req", id);
 	server_.on_pb(service_path, node_,
@@ -291,14 +874,20 @@ void memkv_service::regist_service()
 	server_.on_pb(service_path, node_,
                   &raft::node::handle_install_snapshot_request);
 
+	//leadership transfer req
+	service_path.format("/memkv%s/raft/timeout_now_req", id);
+	server_.on_pb(service_path, node_,
+                  &raft::node::handle_timeout_now_request);
+
 }
 void memkv_service::reload()
 {
     node_->reload();
-    std::string file_path = node_->get_snapshot();
-    if(file_path.size())
+    //full snapshot and its delta snapshots
+    std::vector<std::string> chain = node_->get_snapshot_chain();
+    for (size_t i = 0; i < chain.size(); i++)
     {
-        if(!load_snapshot(file_path))
+        if(!load_snapshot(chain[i]))
             logger_fatal("load_snapshot error");
     }
     raft::log_index_t committed_index = node_->committed_index();
@@ -307,31 +896,18 @@ void memkv_service::reload()
                              "committed_index(%llu)",
                      curr_ver_.index_,
                      committed_index );
-    do
+
+    //read logs in batch, parse in threads and apply in order
+    memkv_recover_callback callback(this);
+    if (!node_->recover(callback, curr_ver_.index_))
     {
-        if(curr_ver_.index_ == committed_index)
-        {
-            logger("------reload ok! --------");
-            logger("---kv_store size(%lu)----",store_.size());
-            break;
-        }
-
-        std::string data;
-		raft::log_index_t next_index = curr_ver_.index_+1;
-        if(!node_->read(next_index , data, curr_ver_))
-        {
-            logger_fatal("read log failed!!!!!!!!!");
-            return;
-        }
-		acl_assert(curr_ver_.index_ == next_index);
-
-		//apply the log data to store
-        apply(data, curr_ver_);
-
-		//apply done .must update applied index.
-		node_->set_applied_index(next_index);
-
-    }while(true);
+        logger_fatal("recover logs failed!!!!!!!!!");
+        return;
+    }
+    acl_assert(curr_ver_.index_ == committed_index);
+
+    logger("------reload ok! --------");
+    logger("---kv_store size(%lu)----",store_.size());
 }
 //raft from raft framework
 bool memkv_service::load_snapshot(const std::string &file_path)
@@ -342,56 +918,213 @@ bool memkv_service::load_snapshot(const std::string &file_path)
 		logger_error("open_read file error");
 		return false;
 	}
-	raft::version ver;
-	if (!raft::read(file, ver))
+	raft::snapshot_info info;
+	if (!raft::read(file, info))
 	{
 		logger_error("read version failed");
 		return false;
 	}
+	raft::version ver(info.last_snapshot_index(),
+					  info.last_included_term());
+	raft::version base(info.base_snapshot_index(),
+					   info.base_included_term());
+
+	//items are in zip blocks after head
+	raft::zip_istream in(file, info.compressed());
+	if (base.index_)
+		return load_delta(in, ver, base);
+
 	if (ver < curr_ver_)
 	{
 		logger_fatal("rust version.");
 		return false;
 	}
 	unsigned int items = 0;
-	if (!raft::read(file, items))
+	if (!raft::read(in, items))
 	{
 		logger_error("read snapshot items.error");
 		return true;
 	}
-	acl::lock_guard lg(mem_store_locker_);
-
-	//clear old data.
-	store_.clear();
-	while (!file.eof())
+	bool has_meta = items == MEMKV_META_FORMAT;
+	if (has_meta && !raft::read(in, items))
+	{
+		logger_error("read snapshot items.error");
+		return false;
+	}
+	memkv_store::items_t store;
+	while (!in.eof())
 	{
 		std::string key;
 		std::string value;
-		if (raft::read(file, key) && 
-			raft::read(file, value))
+		std::string data;
+		memkv_meta meta;
+		if (raft::read(in, key) && 
+			raft::read(in, value) &&
+			(!has_meta || raft::read(in, data)))
 		{
-			store_.insert(std::make_pair(key, value));
+			if (!memkv_store::decode_meta(data, meta))
+			{
+				logger_error("snapshot meta error");
+				return false;
+			}
+			store.set(key, value, meta);
 		}
 	}
-	if (store_.size() != items)
+	if (in.error() || store.size() != items)
 	{
 		logger_error("snapshot not finished");
 		return false;
 	}
 	file.close();
 
+	if (!has_meta)
+		memkv_store::fold_legacy_items(store);
+
+	acl::lock_guard lg(mem_store_locker_);
+
+	//replace old data.
+	store_.reset(store);
     curr_ver_ = ver;
+    set_dirty_base(ver);
 	logger("load_snapshot %s done.items:%u",
 		    file_path.c_str(),
 		    items);
 
 	return true;
 }
+bool memkv_service::load_delta(raft::zip_istream &in,
+							   const raft::version &ver,
+							   const raft::version &base)
+{
+	//delta is changes after base
+	if (base.index_ != curr_ver_.index_ || base.term_ != curr_ver_.term_)
+	{
+		logger_error("delta base(%llu.%llu) not match "
+					 "curr_ver_(%llu.%llu)",
+					 base.index_,
+					 base.term_,
+					 curr_ver_.index_,
+					 curr_ver_.term_);
+		return false;
+	}
+	unsigned int items = 0;
+	if (!raft::read(in, items))
+	{
+		logger_error("read delta items.error");
+		return false;
+	}
+	bool has_meta = items == MEMKV_META_FORMAT;
+	if (has_meta && !raft::read(in, items))
+	{
+		logger_error("read delta items.error");
+		return false;
+	}
+	memkv_store::items_t sets;
+	memkv_store::keys_t dels;
+	for (unsigned int i = 0; i < items; i++)
+	{
+		unsigned int flag = 0;
+		std::string key;
+		std::string value;
+		std::string data;
+		memkv_meta meta;
+
+		if (!raft::read(in, flag) || !raft::read(in, key))
+		{
+			logger_error("delta not finished");
+			return false;
+		}
+		if (!flag)
+		{
+			dels.insert(key);
+			continue;
+		}
+		if (!raft::read(in, value) ||
+			(has_meta && !raft::read(in, data)))
+		{
+			logger_error("delta not finished");
+			return false;
+		}
+		if (!memkv_store::decode_meta(data, meta))
+		{
+			logger_error("delta meta error");
+			return false;
+		}
+		sets.set(key, value, meta);
+	}
+	if (!has_meta)
+		memkv_store::fold_legacy_items(sets);
+
+	acl::lock_guard lg(mem_store_locker_);
+
+	store_.patch(sets, dels);
+	curr_ver_ = ver;
+	set_dirty_base(ver);
+	logger("load_delta done.items:%u", items);
+
+	return true;
+}
+bool memkv_service::load_snapshot(memkv_store::items_t &store,
+	                              const raft::version &ver)
+{
+	if (ver < curr_ver_)
+	{
+		logger_fatal("rust version.");
+		return false;
+	}
+	acl::lock_guard lg(mem_store_locker_);
+
+	store_.reset(store);
+	curr_ver_ = ver;
+	set_dirty_base(ver);
+
+	logger("load_snapshot from sink done.items:%zu", store_.size());
+	return true;
+}
+raft::snapshot_view *memkv_service::capture_snapshot()
+{
+	//version must match the frozen items
+	acl::lock_guard lg(mem_store_locker_);
+
+	const memkv_store::items_t *items = store_.freeze();
+	if (!items)
+	{
+		logger_error("store is frozen by other snapshot");
+		return NULL;
+	}
+	acl::lock_guard dirty_lg(dirty_base_locker_);
+	return new memkv_snapshot_view(this, items, curr_ver_, dirty_base_);
+}
+void memkv_service::set_dirty_base(const raft::version &ver)
+{
+	acl::lock_guard lg(dirty_base_locker_);
+	dirty_base_ = ver;
+}
 bool memkv_service::make_snapshot(const std::string &path,
 	                              std::string &file_path)
 {
-	acl::lock_guard lg(mem_store_locker_);
-	
+	raft::snapshot_view *view = capture_snapshot();
+	if (!view)
+		return false;
+
+	bool ok = view->write(path, file_path);
+	delete view;
+	return ok;
+}
+//write bytes of arena in the format of raft::write(zip_ostream, string)
+static bool write_bytes(raft::zip_ostream &out, const memkv_bytes &bytes)
+{
+	if (!raft::write(out, (unsigned int) bytes.size))
+		return false;
+	if (!bytes.size)
+		return true;
+	return out.write(bytes.data, bytes.size) == (int) bytes.size;
+}
+bool memkv_service::write_snapshot(const std::string &path,
+								   const memkv_store::items_t &items,
+								   const raft::version &ver,
+								   std::string &file_path)
+{
 	acl::string snapshot_path;
 	snapshot_path += path.c_str();
 	/**
@@ -402,8 +1135,8 @@ bool memkv_service::make_snapshot(const std::string &path,
 		".snapshot" mean good snapshot file.
 	*/
 	snapshot_path.format_append("%llu.%llu.temp_snapshot",
-				                curr_ver_.index_, 
-				                curr_ver_.term_);
+				                ver.index_, 
+				                ver.term_);
 
     logger("snapshot file_path(%s)", 
 		   snapshot_path.c_str());
@@ -418,29 +1151,52 @@ bool memkv_service::make_snapshot(const std::string &path,
 	}
 
 
-	//write raft::version .and store item count
-	if (!raft::write(file, curr_ver_) ||
-        !raft::write(file, (unsigned int)store_.size()))
+	raft::snapshot_info info;
+	info.set_last_snapshot_index(ver.index_);
+	info.set_last_included_term(ver.term_);
+	info.set_compressed(cfg_.snapshot_compress);
+
+	//items are written in zip blocks after head
+	raft::zip_ostream out(file, info.compressed());
+
+	//write snapshot head .and store item count after meta mark
+	if (!raft::write(file, info) ||
+		!raft::write(out, (unsigned int) MEMKV_META_FORMAT) ||
+        !raft::write(out, (unsigned int) items.size()))
 	{
         logger_error("write snapshot head error");
 		goto failed;
 	}
 
-	for (memkv_store_t::const_iterator it = store_.begin();
-		it != store_.end(); it++)
+	for (size_t i = 0; i < items.shards(); i++)
 	{
-		//write store key, and value
-		if (!raft::write(file, it->first))
+		const memkv_hash &shard = items.shard(i);
+		for (memkv_hash::const_iterator it = shard.begin();
+			it != shard.end(); ++it)
 		{
-            logger_error("write snapshot data error");
-			goto failed;
-		}
-		if (!raft::write(file, it->second))
-		{
-			logger_error("write snapshot data error");
-			goto failed;
+			//write store key, value and meta
+			if (!write_bytes(out, it.key()))
+			{
+				logger_error("write snapshot data error");
+				goto failed;
+			}
+			if (!write_bytes(out, it.value()))
+			{
+				logger_error("write snapshot data error");
+				goto failed;
+			}
+			if (!raft::write(out, memkv_store::encode_meta(it.meta())))
+			{
+				logger_error("write snapshot data error");
+				goto failed;
+			}
 		}
 	}
+	if (!out.flush())
+	{
+		logger_error("write snapshot data error");
+		goto failed;
+	}
 
 	file.close();
 	file_path = snapshot_path;
@@ -452,6 +1208,82 @@ failed:
 	remove(snapshot_path.c_str());
 	return false;
 }
+bool memkv_service::write_delta(const std::string &path,
+								const memkv_store::items_t &items,
+								const raft::version &ver,
+								const raft::version &base,
+								std::string &file_path)
+{
+	size_t dirty_size = store_.frozen_dirty_size();
+
+	acl::string snapshot_path;
+	snapshot_path += path.c_str();
+	snapshot_path.format_append("%llu.%llu.temp_delta",
+				                ver.index_,
+				                ver.term_);
+
+	logger("delta file_path(%s) keys(%zu)",
+		   snapshot_path.c_str(),
+		   dirty_size);
+
+	acl::ofstream file;
+	if (!file.open_trunc(snapshot_path.c_str()))
+	{
+		logger_error("open_trunc file error.%s",
+                     snapshot_path.c_str());
+		return false;
+	}
+
+	raft::snapshot_info info;
+	info.set_last_snapshot_index(ver.index_);
+	info.set_last_included_term(ver.term_);
+	info.set_base_snapshot_index(base.index_);
+	info.set_base_included_term(base.term_);
+	info.set_compressed(cfg_.snapshot_compress);
+
+	raft::zip_ostream out(file, info.compressed());
+
+	//write head with base .and dirty key count after meta mark
+	bool ok = raft::write(file, info) &&
+		raft::write(out, (unsigned int) MEMKV_META_FORMAT) &&
+		raft::write(out, (unsigned int) dirty_size);
+
+	for (size_t i = 0; ok && i < items.shards(); i++)
+	{
+		const memkv_store::keys_t &dirty = store_.frozen_dirty(i);
+		const memkv_hash &shard = items.shard(i);
+
+		for (memkv_store::keys_t::const_iterator it = dirty.begin();
+			ok && it != dirty.end(); ++it)
+		{
+			//key not in items is deleted
+			std::string value;
+			memkv_meta meta;
+			if (!shard.find(*it, &value, &meta))
+			{
+				ok = raft::write(out, (unsigned int) 0) &&
+					raft::write(out, *it);
+				continue;
+			}
+			ok = raft::write(out, (unsigned int) 1) &&
+				raft::write(out, *it) &&
+				raft::write(out, value) &&
+				raft::write(out, memkv_store::encode_meta(meta));
+		}
+	}
+	ok = ok && out.flush();
+	file.close();
+
+	if (!ok)
+	{
+		logger_error("write delta file error.%s",
+					 snapshot_path.c_str());
+		remove(snapshot_path.c_str());
+		return false;
+	}
+	file_path = snapshot_path;
+	return true;
+}
 /*
 	apply invoke from raft framework.it mean leader replicate
 	data to this node, and data has be committed.
@@ -459,45 +1291,121 @@ failed:
 bool memkv_service::apply(const std::string& data,
 	const raft::version& ver)
 {
-	acl::lock_guard lg(mem_store_locker_);
-	if (data.empty())
+	memkv_log_entry *entry = parse(data);
+	if (!entry)
 		return false;
 
+	bool ret = apply(*entry, ver);
+	delete entry;
+	return ret;
+}
+
+memkv_log_entry *memkv_service::parse(const std::string &data)
+{
+	if (data.empty())
+		return NULL;
+
+	if (data[0] != MEMKV_LOG_V1)
+		return parse_json(data);
+
+	if (data.size() < 2)
+	{
+		logger_error("memkv log error.size:%zu", data.size());
+		return NULL;
+	}
+
+	unsigned char *ptr = (unsigned char *) data.data() + 1;
+	const unsigned char *end = (unsigned char *) data.data() + data.size();
+	memkv_log_entry *entry = new memkv_log_entry;
+
+	if (!decode_log(ptr, end, *entry) || ptr != end)
+	{
+		logger_error("memkv log error.flag:%d size:%zu",
+					 (int) data[1],
+					 data.size());
+		delete entry;
+		return NULL;
+	}
+	return entry;
+}
+
+memkv_log_entry *memkv_service::parse_json(const std::string &data)
+{
 	char flag = data[data.size() - 1];
 	std::pair<bool, std::string> status;
+	memkv_log_entry *entry = new memkv_log_entry;
+	entry->flag_ = flag;
+
 	if (flag == SET_REQ)
 	{
 		set_req req;
 		status = acl::gson(data.c_str(), req);
-		if (!status.first)
-		{
-			logger_error("req gson error,%s",
-				         status.second.c_str());
-
-
-			return false;
-		}
-		store_[req.key] = req.value;
-        curr_ver_ = ver;
-		return true;
+		entry->key_.swap(req.key);
+		entry->value_.swap(req.value);
 	}
 	else if (flag == DEL_REQ)
 	{
 		del_req req;
 		status = acl::gson(data.c_str(), req);
-		if (!status.first)
-		{
-			logger_error("req gson error,%s", 
-				         status.second.c_str());
+		entry->key_.swap(req.key);
+	}
+	else
+	{
+		logger_error("error req cmd");
+		delete entry;
+		return NULL;
+	}
 
-			return false;
-		}
-		store_.erase(req.key);
-        curr_ver_ = ver;
-		return true;
+	if (!status.first)
+	{
+		logger_error("req gson error,%s",
+			         status.second.c_str());
+		delete entry;
+		return NULL;
 	}
-	logger_error("error req cmd");
-	return false;
+	return entry;
+}
+
+bool memkv_service::apply(memkv_log_entry &entry, const raft::version &ver)
+{
+	acl::lock_guard lg(mem_store_locker_);
+
+	//version of key is log index of the entry
+	entry.done_ = true;
+	if (entry.cas_)
+	{
+		memkv_store::write_op op;
+		op.deleted = entry.flag_ == DEL_REQ;
+		op.key.swap(entry.key_);
+		op.value.swap(entry.value_);
+		op.expire_at = entry.expire_at_;
+		op.version = ver.index_;
+
+		entry.done_ = store_.cas(op, entry.expected_, entry.version_);
+		writes_++;
+	}
+	else if (entry.flag_ == SET_REQ || entry.flag_ == SETEX_REQ)
+	{
+		store_.set(entry.key_, entry.value_, entry.expire_at_, ver.index_);
+		writes_++;
+	}
+	else if (entry.flag_ == BATCH_REQ)
+	{
+		for (size_t i = 0; i < entry.batch_.size(); i++)
+			entry.batch_[i].version = ver.index_;
+		store_.write(entry.batch_);
+		writes_ += entry.batch_.size();
+	}
+	else if (entry.flag_ == EXPIRE_REQ)
+	{
+		store_.expire(entry.expire_at_);
+	}
+	else
+	{
+		store_.del(entry.key_);
+	}
+	curr_ver_ = ver;
+	return true;
 }
 //end
 
@@ -508,95 +1416,363 @@ bool memkv_service::check_leader()const
 }
 
 //memkv services
-bool memkv_service::get(const get_req &req, get_resp &resp)
+void memkv_service::do_get(const std::string &key,
+						   std::string &value,
+						   std::string &status,
+						   unsigned long long *version)
 {
 	if (!check_leader())
 	{
-		resp.status = "no leader";
-		return true;
+		status = "no leader";
+		return;
 	}
+	status = store_.get(key, value, version) ? "ok" : "not found";
+}
 
-	
-	acl::lock_guard lg(mem_store_locker_);
-	memkv_store_t::iterator it = store_.find(req.key);
-	if (it != store_.end())
+void memkv_service::do_exist(const std::string &key, std::string &status)
+{
+	if (!check_leader())
 	{
-		resp.status = "ok";
-		resp.value = it->second;
-		return true;
+		status = "no leader";
+		return;
 	}
-	resp.status = "not found";
-	return true;
+	status = store_.exist(key) ? "yes" : "no";
 }
 
-bool memkv_service::exist(const exist_req &req, exist_resp& resp)
+void memkv_service::do_set(const std::string &key,
+						   const std::string &value,
+						   unsigned int ttl,
+						   std::string &status)
 {
 	if (!check_leader())
 	{
-		resp.status = "no leader";
-		return true;
+		status = "no leader";
+		return;
 	}
-	acl::lock_guard lg(mem_store_locker_);
-	memkv_store_t::iterator it = store_.find(req.key);
-	if (it != store_.end())
+
+	memkv_log_entry entry;
+	entry.flag_ = ttl ? SETEX_REQ : SET_REQ;
+	entry.key_ = key;
+	entry.value_ = value;
+	//expire time is decided by leader, followers use it in log
+	entry.expire_at_ = ttl ? now_millis() + ttl : 0;
+
+	if (!replicate(entry, status))
+		logger("set failed");
+}
+
+void memkv_service::do_del(const std::string &key, std::string &status)
+{
+	if (!check_leader())
 	{
-		resp.status = "yes";
-		return true;
+		status = "no leader";
+		return;
 	}
-	resp.status = "no";
+
+	memkv_log_entry entry;
+	entry.flag_ = DEL_REQ;
+	entry.key_ = key;
+
+	if (!replicate(entry, status))
+		logger("del failed");
+}
+
+void memkv_service::do_cas(const std::string &key,
+						   const std::string &value,
+						   bool deleted,
+						   unsigned long long expected,
+						   unsigned int ttl,
+						   std::string &status,
+						   unsigned long long &version)
+{
+	if (!check_leader())
+	{
+		status = "no leader";
+		return;
+	}
+
+	memkv_log_entry entry;
+	entry.cas_ = true;
+	entry.expected_ = expected;
+	entry.key_ = key;
+	if (deleted)
+	{
+		entry.flag_ = DEL_REQ;
+	}
+	else
+	{
+		entry.flag_ = ttl ? SETEX_REQ : SET_REQ;
+		entry.value_ = value;
+		entry.expire_at_ = ttl ? now_millis() + ttl : 0;
+	}
+
+	//version is checked when entry is applied
+	if (!replicate(entry, status))
+	{
+		logger("cas failed");
+		return;
+	}
+	if (!entry.done_)
+		status = "version mismatch";
+	version = entry.version_;
+}
+
+void memkv_service::do_write(memkv_store::write_batch_t &batch,
+							 std::string &status)
+{
+	if (!check_leader())
+	{
+		status = "no leader";
+		return;
+	}
+	if (batch.empty())
+	{
+		status = "ok";
+		return;
+	}
+
+	memkv_log_entry entry;
+	entry.flag_ = BATCH_REQ;
+	entry.batch_.swap(batch);
+
+	if (!replicate(entry, status))
+		logger("write batch failed");
+}
+
+void memkv_service::do_expire()
+{
+	if (!check_leader())
+		return;
+
+	unsigned long long now = now_millis();
+	unsigned long long next = store_.next_expire();
+	if (!next || next > now)
+		return;
+
+	//one log entry deletes all keys expired before now
+	memkv_log_entry entry;
+	entry.flag_ = EXPIRE_REQ;
+	entry.expire_at_ = now;
+
+	std::string status;
+	if (!replicate(entry, status))
+		logger("expire failed.%s", status.c_str());
+}
+
+bool memkv_service::get(const get_req &req, get_resp &resp)
+{
+	do_get(req.key, resp.value, resp.status);
 	return true;
 }
 
+bool memkv_service::exist(const exist_req &req, exist_resp& resp)
+{
+	do_exist(req.key, resp.status);
+	return true;
+}
 
 bool memkv_service::set(const set_req &req, set_resp &resp)
+{
+	do_set(req.key,
+		   req.value,
+		   req.ttl > 0 ? (unsigned int) req.ttl : 0,
+		   resp.status);
+	return true;
+}
+
+bool memkv_service::del(const del_req &req, del_resp &resp)
+{
+	do_del(req.key, resp.status);
+	return true;
+}
+
+//tell client which node is leader
+template<class RESP>
+static void set_leader_hint(raft::node *node, RESP &resp)
+{
+	if (resp.status() == "no leader")
+		resp.set_leader(node->leader_id());
+}
+
+bool memkv_service::pb_get(const memkv_pb::get_req &req,
+						   memkv_pb::get_resp &resp)
+{
+	unsigned long long version = 0;
+
+	do_get(req.key(),
+		   *resp.mutable_value(),
+		   *resp.mutable_status(),
+		   &version);
+	resp.set_version(version);
+	set_leader_hint(node_, resp);
+	return true;
+}
+
+bool memkv_service::pb_exist(const memkv_pb::exist_req &req,
+							 memkv_pb::exist_resp &resp)
+{
+	do_exist(req.key(), *resp.mutable_status());
+	set_leader_hint(node_, resp);
+	return true;
+}
+
+bool memkv_service::pb_set(const memkv_pb::set_req &req,
+						   memkv_pb::set_resp &resp)
+{
+	do_set(req.key(), req.value(), req.ttl(), *resp.mutable_status());
+	set_leader_hint(node_, resp);
+	return true;
+}
+
+bool memkv_service::pb_del(const memkv_pb::del_req &req,
+						   memkv_pb::del_resp &resp)
+{
+	do_del(req.key(), *resp.mutable_status());
+	set_leader_hint(node_, resp);
+	return true;
+}
+
+bool memkv_service::pb_cas(const memkv_pb::cas_req &req,
+						   memkv_pb::cas_resp &resp)
+{
+	unsigned long long version = 0;
+
+	do_cas(req.key(),
+		   req.value(),
+		   req.deleted(),
+		   req.version(),
+		   req.ttl(),
+		   *resp.mutable_status(),
+		   version);
+	resp.set_version(version);
+	set_leader_hint(node_, resp);
+	return true;
+}
+
+bool memkv_service::pb_mget(const memkv_pb::mget_req &req,
+							memkv_pb::mget_resp &resp)
 {
 	if (!check_leader())
 	{
-		resp.status = "no leader";
+		resp.set_status("no leader");
+		set_leader_hint(node_, resp);
 		return true;
 	}
 
-	raft::version ver;
-	if (!replicate(req, resp, node_, ver))
+	std::string value;
+	for (int i = 0; i < req.keys_size(); i++)
 	{
-		logger("set failed");
-		return true;
-	}
-	// status ok .set key to store
-	acl::lock_guard lg(mem_store_locker_);
-    writes_ ++;
-	store_[req.key] = store_[req.value];
-	curr_ver_ = ver;
+		if (!store_.get(req.keys(i), value))
+			continue;
 
+		memkv_pb::kv *item = resp.add_items();
+		item->set_key(req.keys(i));
+		item->mutable_value()->swap(value);
+	}
+	resp.set_status("ok");
 	return true;
 }
 
-void memkv_service::do_print_status()
+bool memkv_service::pb_mset(const memkv_pb::mset_req &req,
+							memkv_pb::mset_resp &resp)
 {
-    size_t diff = writes_ - last_writes_;
-    logger("writes/second (%lu)", diff);
-    last_writes_ = writes_;
+	memkv_store::write_batch_t batch(req.items_size());
+
+	for (int i = 0; i < req.items_size(); i++)
+	{
+		batch[i].key = req.items(i).key();
+		batch[i].value = req.items(i).value();
+	}
+	do_write(batch, *resp.mutable_status());
+	set_leader_hint(node_, resp);
+	return true;
 }
-bool memkv_service::del(const del_req &req, del_resp &resp)
+
+bool memkv_service::pb_mdel(const memkv_pb::mdel_req &req,
+							memkv_pb::mdel_resp &resp)
 {
+	memkv_store::write_batch_t batch(req.keys_size());
+
+	for (int i = 0; i < req.keys_size(); i++)
+	{
+		batch[i].deleted = true;
+		batch[i].key = req.keys(i);
+	}
+	do_write(batch, *resp.mutable_status());
+	set_leader_hint(node_, resp);
+	return true;
+}
 
+void memkv_service::do_scan(const std::string &start,
+							const std::string &end,
+							unsigned int limit,
+							memkv_pb::scan_resp &resp)
+{
 	if (!check_leader())
 	{
-		resp.status = "no leader";
-		return true;
+		resp.set_status("no leader");
+		set_leader_hint(node_, resp);
+		return;
 	}
+	if (!limit)
+		limit = __MEMKV_SCAN_LIMIT__;
+	limit = std::min(limit, (unsigned int) __MEMKV_MAX_SCAN_LIMIT__);
+
+	memkv_store::scan_items_t items;
+	std::string next;
+	bool more = store_.scan(start, end, limit, items, &next);
 
-	raft::version ver;
-	if (!replicate(req, resp, node_, ver))
+	for (size_t i = 0; i < items.size(); i++)
 	{
-		logger("set failed");
-		return true;
+		memkv_pb::kv *item = resp.add_items();
+		item->mutable_key()->swap(items[i].first);
+		item->mutable_value()->swap(items[i].second);
 	}
 
-	// status ok .del value from store
-	acl::lock_guard lg(mem_store_locker_);
-	store_.erase(req.key);
-	curr_ver_ = ver;
+	//next page start at the first key after this page
+	resp.set_more(more);
+	if (more)
+		resp.set_next(next);
+	resp.set_status("ok");
+}
 
+bool memkv_service::pb_scan(const memkv_pb::scan_req &req,
+							memkv_pb::scan_resp &resp)
+{
+	do_scan(req.start(), req.end(), req.limit(), resp);
 	return true;
 }
+
+bool memkv_service::pb_prefix(const memkv_pb::prefix_req &req,
+							  memkv_pb::scan_resp &resp)
+{
+	const std::string &start =
+		req.start() > req.prefix() ? req.start() : req.prefix();
+
+	do_scan(start,
+			memkv_store::prefix_end(req.prefix()),
+			req.limit(),
+			resp);
+	return true;
+}
+
+void memkv_service::do_print_status()
+{
+    size_t diff = writes_ - last_writes_;
+    logger("writes/second (%lu)", diff);
+    last_writes_ = writes_;
+
+    memkv_store::memory_stats stats;
+    store_.memory(stats);
+
+    size_t bytes = stats.table_bytes + stats.arena_bytes +
+        stats.index_bytes;
+    logger("keys(%zu) items(%zu) bytes(%zu) bytes/key(%.1f) "
+           "fragmentation(%.1f%%)",
+           stats.keys,
+           stats.items,
+           bytes,
+           stats.keys ? (double) bytes / stats.keys : 0.0,
+           stats.arena_bytes ?
+           stats.garbage_bytes * 100.0 / stats.arena_bytes : 0.0);
+}
@@ -0,0 +1,1332 @@
+#include "acl_cpp/lib_acl.hpp"
+#include "lib_acl.h"
+#include <pthread.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+#include "memkv_store.h"
+
+//meta items of key in legacy files: "\0" + tag + key
+#define META_KEY_HEAD_SIZE 2
+//expire time of key
+#define EXPIRE_TAG 't'
+//version of key
+#define VERSION_TAG 'v'
+
+static bool is_meta_key(const std::string &key)
+{
+	return key.size() >= META_KEY_HEAD_SIZE && key[0] == '\0' &&
+		(key[1] == EXPIRE_TAG || key[1] == VERSION_TAG);
+}
+
+//8 bytes big endian
+static std::string encode_time(unsigned long long time)
+{
+	std::string data(8, '\0');
+	for (int i = 7; i >= 0; i--, time >>= 8)
+		data[i] = (char)(time & 0xff);
+	return data;
+}
+
+static unsigned long long decode_time(const std::string &data)
+{
+	unsigned long long time = 0;
+	for (size_t i = 0; i < data.size() && i < 8; i++)
+		time = (time << 8) | (unsigned char) data[i];
+	return time;
+}
+
+//color and links of a node of std::set and std::map
+#define TREE_NODE_HEAD_SIZE (sizeof(void *) * 4)
+//longest string kept in std::string itself
+#define STRING_LOCAL_SIZE 15
+
+//estimated bytes of a key in std::set<std::string>
+static size_t key_node_bytes(const std::string &key)
+{
+	size_t bytes = TREE_NODE_HEAD_SIZE + sizeof(std::string);
+	if (key.size() > STRING_LOCAL_SIZE)
+		bytes += key.size() + 1;
+	return bytes;
+}
+
+//keys expire in the same second are in a bucket
+static unsigned long long expire_bucket(unsigned long long time)
+{
+	return time / 1000;
+}
+
+static size_t varint_size(unsigned long long value)
+{
+	size_t size = 1;
+	while (value >= 0x80)
+	{
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+static void put_varint(char *&ptr, unsigned long long value)
+{
+	while (value >= 0x80)
+	{
+		*ptr++ = (char)(value | 0x80);
+		value >>= 7;
+	}
+	*ptr++ = (char) value;
+}
+
+//varint of arena is written by put_varint, it is not checked
+static unsigned long long get_varint(const char *&ptr)
+{
+	unsigned long long value = 0;
+	int shift = 0;
+	while ((unsigned char) *ptr & 0x80)
+	{
+		value |= (unsigned long long)((unsigned char) *ptr++ & 0x7f) << shift;
+		shift += 7;
+	}
+	value |= (unsigned long long)(unsigned char) *ptr++ << shift;
+	return value;
+}
+
+static size_t meta_size(const memkv_meta &meta)
+{
+	return varint_size(meta.version) + varint_size(meta.expire_at);
+}
+
+static size_t record_size(size_t key_size,
+						  size_t value_size,
+						  const memkv_meta &meta)
+{
+	return varint_size(key_size) + varint_size(value_size) +
+		meta_size(meta) + key_size + value_size;
+}
+
+memkv_arena::memkv_arena()
+	:tail_(0),
+	 bytes_(0),
+	 used_(0),
+	 garbage_(0)
+{
+}
+
+char *memkv_arena::alloc(size_t size, ref &_ref)
+{
+	if (chunks_.empty() || chunks_.back().size() - tail_ < size)
+	{
+		//chunk grows with arena, and record bigger than it has its own
+		size_t chunk = std::max(bytes_, (size_t) __MEMKV_ARENA_MIN_CHUNK__);
+		chunk = std::min(chunk, (size_t) __MEMKV_ARENA_CHUNK__);
+		chunk = std::max(chunk, size);
+
+		if (chunks_.size())
+			garbage_ += chunks_.back().size() - tail_;
+		chunks_.push_back(std::vector<char>());
+		chunks_.back().resize(chunk);
+		bytes_ += chunk;
+		tail_ = 0;
+	}
+	_ref.chunk = (unsigned int)(chunks_.size() - 1);
+	_ref.offset = (unsigned int) tail_;
+
+	char *ptr = &chunks_.back()[tail_];
+	tail_ += size;
+	used_ += size;
+	return ptr;
+}
+
+memkv_arena::ref memkv_arena::add(const std::string &key,
+								  const std::string &value,
+								  const memkv_meta &meta)
+{
+	memkv_bytes _key;
+	memkv_bytes _value;
+
+	_key.data = key.data();
+	_key.size = key.size();
+	_value.data = value.data();
+	_value.size = value.size();
+	return add(_key, _value, meta);
+}
+
+memkv_arena::ref memkv_arena::add(const memkv_bytes &key,
+								  const memkv_bytes &value,
+								  const memkv_meta &meta)
+{
+	ref _ref;
+	char *ptr = alloc(record_size(key.size, value.size, meta), _ref);
+
+	put_varint(ptr, key.size);
+	put_varint(ptr, value.size);
+	put_varint(ptr, meta.version);
+	put_varint(ptr, meta.expire_at);
+	if (key.size)
+		memcpy(ptr, key.data, key.size);
+	if (value.size)
+		memcpy(ptr + key.size, value.data, value.size);
+	return _ref;
+}
+
+void memkv_arena::get(const ref &_ref,
+					  memkv_bytes &key,
+					  memkv_bytes &value,
+					  memkv_meta *meta) const
+{
+	const char *ptr = &chunks_[_ref.chunk][_ref.offset];
+
+	key.size = (size_t) get_varint(ptr);
+	value.size = (size_t) get_varint(ptr);
+	unsigned long long version = get_varint(ptr);
+	unsigned long long expire_at = get_varint(ptr);
+	if (meta)
+	{
+		meta->version = version;
+		meta->expire_at = expire_at;
+	}
+	key.data = ptr;
+	value.data = ptr + key.size;
+}
+
+bool memkv_arena::replace(const ref &_ref,
+						  const std::string &value,
+						  const memkv_meta &meta)
+{
+	memkv_bytes key;
+	memkv_bytes old;
+	memkv_meta old_meta;
+
+	get(_ref, key, old, &old_meta);
+	if (old.size != value.size() ||
+		varint_size(old_meta.version) != varint_size(meta.version) ||
+		varint_size(old_meta.expire_at) != varint_size(meta.expire_at))
+		return false;
+
+	//meta is right before key
+	char *ptr = (char *) key.data - meta_size(meta);
+	put_varint(ptr, meta.version);
+	put_varint(ptr, meta.expire_at);
+	if (value.size())
+		memcpy((char *) old.data, value.data(), value.size());
+	return true;
+}
+
+void memkv_arena::release(const ref &_ref)
+{
+	memkv_bytes key;
+	memkv_bytes value;
+	memkv_meta meta;
+
+	get(_ref, key, value, &meta);
+
+	size_t size = record_size(key.size, value.size, meta);
+	used_ -= size;
+	garbage_ += size;
+}
+
+size_t memkv_arena::bytes() const
+{
+	return bytes_;
+}
+
+size_t memkv_arena::used() const
+{
+	return used_;
+}
+
+size_t memkv_arena::garbage() const
+{
+	return garbage_;
+}
+
+void memkv_arena::clear()
+{
+	std::vector<std::vector<char> >().swap(chunks_);
+	tail_ = 0;
+	bytes_ = 0;
+	used_ = 0;
+	garbage_ = 0;
+}
+
+void memkv_arena::swap(memkv_arena &other)
+{
+	chunks_.swap(other.chunks_);
+	std::swap(tail_, other.tail_);
+	std::swap(bytes_, other.bytes_);
+	std::swap(used_, other.used_);
+	std::swap(garbage_, other.garbage_);
+}
+
+memkv_hash::const_iterator::const_iterator()
+	:hash_(NULL),
+	 pos_(0)
+{
+}
+
+memkv_hash::const_iterator::const_iterator(const memkv_hash *hash,
+										   size_t pos)
+	:hash_(hash),
+	 pos_(pos)
+{
+	skip();
+}
+
+void memkv_hash::const_iterator::skip()
+{
+	while (pos_ < hash_->slots_.size() && !hash_->slots_[pos_].used())
+		pos_++;
+}
+
+memkv_bytes memkv_hash::const_iterator::key() const
+{
+	memkv_bytes key;
+	memkv_bytes value;
+
+	hash_->arena_.get(hash_->slots_[pos_].ref, key, value);
+	return key;
+}
+
+memkv_bytes memkv_hash::const_iterator::value() const
+{
+	memkv_bytes key;
+	memkv_bytes value;
+
+	hash_->arena_.get(hash_->slots_[pos_].ref, key, value);
+	return value;
+}
+
+memkv_meta memkv_hash::const_iterator::meta() const
+{
+	memkv_bytes key;
+	memkv_bytes value;
+	memkv_meta meta;
+
+	hash_->arena_.get(hash_->slots_[pos_].ref, key, value, &meta);
+	return meta;
+}
+
+memkv_hash::const_iterator &memkv_hash::const_iterator::operator++()
+{
+	pos_++;
+	skip();
+	return *this;
+}
+
+bool memkv_hash::const_iterator::operator==(
+	const const_iterator &other) const
+{
+	return hash_ == other.hash_ && pos_ == other.pos_;
+}
+
+bool memkv_hash::const_iterator::operator!=(
+	const const_iterator &other) const
+{
+	return !(*this == other);
+}
+
+memkv_hash::memkv_hash()
+	:size_(0),
+	 used_(0)
+{
+}
+
+unsigned int memkv_hash::hash(const std::string &key)
+{
+	return hash(key.data(), key.size());
+}
+
+unsigned int memkv_hash::hash(const char *data, size_t len)
+{
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char) data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+size_t memkv_hash::lookup(const std::string &key,
+						  unsigned int hash,
+						  bool &found) const
+{
+	size_t mask = slots_.size() - 1;
+	size_t pos = hash & mask;
+	size_t deleted = slots_.size();
+
+	//there is empty slot always.table is 3/4 full at most
+	while (true)
+	{
+		const slot &_slot = slots_[pos];
+		if (_slot.ref.chunk == e_empty)
+		{
+			found = false;
+			return deleted < slots_.size() ? deleted : pos;
+		}
+		if (_slot.used())
+		{
+			if (_slot.hash == hash)
+			{
+				memkv_bytes _key;
+				memkv_bytes value;
+
+				arena_.get(_slot.ref, _key, value);
+				if (_key.size == key.size() &&
+					!memcmp(_key.data, key.data(), _key.size))
+				{
+					found = true;
+					return pos;
+				}
+			}
+		}
+		else if (deleted == slots_.size())
+		{
+			deleted = pos;
+		}
+		pos = (pos + 1) & mask;
+	}
+}
+
+void memkv_hash::grow()
+{
+	size_t capacity = 16;
+	while (capacity * 3 < (size_ + 1) * 8)
+		capacity <<= 1;
+
+	std::vector<slot> slots(capacity);
+	slots_.swap(slots);
+	used_ = size_;
+
+	size_t mask = capacity - 1;
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		if (!slots[i].used())
+			continue;
+
+		size_t pos = slots[i].hash & mask;
+		while (slots_[pos].ref.chunk != e_empty)
+			pos = (pos + 1) & mask;
+
+		slots_[pos] = slots[i];
+	}
+}
+
+void memkv_hash::compact()
+{
+	memkv_arena arena;
+
+	for (size_t i = 0; i < slots_.size(); i++)
+	{
+		if (!slots_[i].used())
+			continue;
+
+		memkv_bytes key;
+		memkv_bytes value;
+		memkv_meta meta;
+
+		arena_.get(slots_[i].ref, key, value, &meta);
+		slots_[i].ref = arena.add(key, value, meta);
+	}
+	arena_.swap(arena);
+}
+
+bool memkv_hash::find(const std::string &key,
+					  std::string *value,
+					  memkv_meta *meta) const
+{
+	if (!size_)
+		return false;
+
+	bool found = false;
+	size_t pos = lookup(key, hash(key), found);
+	if (!found)
+		return false;
+
+	if (value || meta)
+	{
+		memkv_bytes _key;
+		memkv_bytes _value;
+
+		arena_.get(slots_[pos].ref, _key, _value, meta);
+		if (value)
+			value->assign(_value.data, _value.size);
+	}
+	return true;
+}
+
+bool memkv_hash::set(const std::string &key,
+					 const std::string &value,
+					 const memkv_meta &meta)
+{
+	if ((used_ + 1) * 4 > slots_.size() * 3)
+		grow();
+
+	unsigned int _hash = hash(key);
+	bool found = false;
+	size_t pos = lookup(key, _hash, found);
+
+	slot &_slot = slots_[pos];
+	if (found)
+	{
+		//value of the same size is written in place
+		if (arena_.replace(_slot.ref, value, meta))
+			return false;
+		arena_.release(_slot.ref);
+	}
+	else
+	{
+		if (_slot.ref.chunk == e_empty)
+			used_++;
+		_slot.hash = _hash;
+		size_++;
+	}
+	_slot.ref = arena_.add(key, value, meta);
+
+	//memory of released records is reclaimed
+	if (arena_.garbage() > arena_.used() &&
+		arena_.garbage() > __MEMKV_ARENA_MIN_CHUNK__)
+		compact();
+	return !found;
+}
+
+bool memkv_hash::erase(const std::string &key)
+{
+	if (!size_)
+		return false;
+
+	bool found = false;
+	size_t pos = lookup(key, hash(key), found);
+	if (!found)
+		return false;
+
+	slot &_slot = slots_[pos];
+	arena_.release(_slot.ref);
+	_slot.ref.chunk = e_deleted;
+	size_--;
+
+	if (!size_)
+		clear();
+	else if (arena_.garbage() > arena_.used() &&
+			 arena_.garbage() > __MEMKV_ARENA_MIN_CHUNK__)
+		compact();
+	return true;
+}
+
+size_t memkv_hash::size() const
+{
+	return size_;
+}
+
+size_t memkv_hash::table_bytes() const
+{
+	return slots_.size() * sizeof(slot);
+}
+
+const memkv_arena &memkv_hash::arena() const
+{
+	return arena_;
+}
+
+void memkv_hash::clear()
+{
+	std::vector<slot>().swap(slots_);
+	size_ = 0;
+	used_ = 0;
+	arena_.clear();
+}
+
+void memkv_hash::swap(memkv_hash &other)
+{
+	slots_.swap(other.slots_);
+	std::swap(size_, other.size_);
+	std::swap(used_, other.used_);
+	arena_.swap(other.arena_);
+}
+
+memkv_hash::const_iterator memkv_hash::begin() const
+{
+	return const_iterator(this, 0);
+}
+
+memkv_hash::const_iterator memkv_hash::end() const
+{
+	return const_iterator(this, slots_.size());
+}
+
+memkv_items::memkv_items(size_t shards)
+	:shards_(shards ? shards : 1)
+{
+}
+
+size_t memkv_items::shards() const
+{
+	return shards_.size();
+}
+
+size_t memkv_items::shard_index(const std::string &key) const
+{
+	unsigned int hash = memkv_hash::hash(key);
+
+	/*
+	 * low bits are used by slot of memkv_hash.pick shard by the
+	 * high bits, so they do not overlap until a shard has more
+	 * than 2^32 / shards slots
+	 */
+	return (size_t) (((unsigned long long) hash * shards_.size()) >> 32);
+}
+
+memkv_hash &memkv_items::shard(size_t index)
+{
+	return shards_[index];
+}
+
+const memkv_hash &memkv_items::shard(size_t index) const
+{
+	return shards_[index];
+}
+
+bool memkv_items::find(const std::string &key,
+					   std::string *value,
+					   memkv_meta *meta) const
+{
+	return shards_[shard_index(key)].find(key, value, meta);
+}
+
+bool memkv_items::set(const std::string &key,
+					  const std::string &value,
+					  const memkv_meta &meta)
+{
+	return shards_[shard_index(key)].set(key, value, meta);
+}
+
+bool memkv_items::erase(const std::string &key)
+{
+	return shards_[shard_index(key)].erase(key);
+}
+
+size_t memkv_items::size() const
+{
+	size_t size = 0;
+	for (size_t i = 0; i < shards_.size(); i++)
+		size += shards_[i].size();
+	return size;
+}
+
+void memkv_items::clear()
+{
+	for (size_t i = 0; i < shards_.size(); i++)
+		shards_[i].clear();
+}
+
+void memkv_items::swap(memkv_items &other)
+{
+	shards_.swap(other.shards_);
+}
+
+struct memkv_store::shard
+{
+	struct delta_item
+	{
+		bool deleted;
+		std::string value;
+		memkv_meta meta;
+	};
+	typedef std::map<std::string, delta_item> delta_t;
+
+	shard()
+		:frozen(false),
+		 size(0),
+		 keys_bytes(0)
+	{
+		pthread_rwlock_init(&rwlock, NULL);
+	}
+	~shard()
+	{
+		pthread_rwlock_destroy(&rwlock);
+	}
+
+	pthread_rwlock_t rwlock;
+	//ordered keys of user for scan
+	keys_t  keys;
+	delta_t delta;
+	keys_t  dirty;
+	keys_t  frozen_dirty;
+	bool    frozen;
+	size_t  size;
+	//estimated bytes of keys
+	size_t  keys_bytes;
+};
+
+struct read_guard
+{
+	explicit read_guard(pthread_rwlock_t &rwlock)
+		:rwlock_(rwlock)
+	{
+		pthread_rwlock_rdlock(&rwlock_);
+	}
+	~read_guard()
+	{
+		pthread_rwlock_unlock(&rwlock_);
+	}
+	pthread_rwlock_t &rwlock_;
+};
+
+struct write_guard
+{
+	explicit write_guard(pthread_rwlock_t &rwlock)
+		:rwlock_(rwlock)
+	{
+		pthread_rwlock_wrlock(&rwlock_);
+	}
+	~write_guard()
+	{
+		pthread_rwlock_unlock(&rwlock_);
+	}
+	pthread_rwlock_t &rwlock_;
+};
+
+struct memkv_store::expiry
+{
+	typedef std::map<unsigned long long, keys_t> buckets_t;
+
+	expiry()
+		:bytes(0)
+	{
+	}
+	void add(unsigned long long time, const std::string &key)
+	{
+		acl::lock_guard lg(locker);
+		insert(time, key);
+	}
+	//locker is held
+	void insert(unsigned long long time, const std::string &key)
+	{
+		unsigned long long bucket = expire_bucket(time);
+		buckets_t::iterator it = buckets.find(bucket);
+		if (it == buckets.end())
+		{
+			it = buckets.insert(std::make_pair(bucket, keys_t())).first;
+			bytes += TREE_NODE_HEAD_SIZE + sizeof(buckets_t::value_type);
+		}
+		if (it->second.insert(key).second)
+			bytes += key_node_bytes(key);
+	}
+	void remove(unsigned long long time, const std::string &key)
+	{
+		acl::lock_guard lg(locker);
+		buckets_t::iterator it = buckets.find(expire_bucket(time));
+		if (it == buckets.end())
+			return;
+		if (it->second.erase(key))
+			bytes -= key_node_bytes(key);
+		if (it->second.empty())
+		{
+			buckets.erase(it);
+			bytes -= TREE_NODE_HEAD_SIZE + sizeof(buckets_t::value_type);
+		}
+	}
+
+	acl::locker locker;
+	buckets_t buckets;
+	//estimated bytes of buckets
+	size_t bytes;
+};
+
+memkv_store::memkv_store()
+	:expiry_(new expiry)
+{
+	for (size_t i = 0; i < items_.shards(); i++)
+		shards_.push_back(new shard);
+}
+
+memkv_store::~memkv_store()
+{
+	for (size_t i = 0; i < shards_.size(); i++)
+		delete shards_[i];
+	delete expiry_;
+}
+
+bool memkv_store::find(shard &_shard,
+					   size_t index,
+					   const std::string &key,
+					   std::string *value,
+					   memkv_meta *meta)
+{
+	if (_shard.frozen)
+	{
+		shard::delta_t::iterator it = _shard.delta.find(key);
+		if (it != _shard.delta.end())
+		{
+			if (it->second.deleted)
+				return false;
+			if (value)
+				*value = it->second.value;
+			if (meta)
+				*meta = it->second.meta;
+			return true;
+		}
+	}
+	return items_.shard(index).find(key, value, meta);
+}
+
+void memkv_store::lock_all()
+{
+	for (size_t i = 0; i < shards_.size(); i++)
+		pthread_rwlock_wrlock(&shards_[i]->rwlock);
+}
+
+void memkv_store::unlock_all()
+{
+	for (size_t i = 0; i < shards_.size(); i++)
+		pthread_rwlock_unlock(&shards_[i]->rwlock);
+}
+
+bool memkv_store::get(const std::string &key,
+					  std::string &value,
+					  unsigned long long *version)
+{
+	size_t index = items_.shard_index(key);
+	shard &_shard = *shards_[index];
+	memkv_meta meta;
+
+	read_guard lg(_shard.rwlock);
+	if (!find(_shard, index, key, &value, &meta))
+		return false;
+
+	//key loaded from snapshot written before versions
+	if (version)
+		*version = meta.version ? meta.version : 1;
+	return true;
+}
+
+unsigned long long memkv_store::version(const std::string &key)
+{
+	size_t index = items_.shard_index(key);
+	shard &_shard = *shards_[index];
+
+	read_guard lg(_shard.rwlock);
+	return get_version(_shard, index, key);
+}
+
+unsigned long long memkv_store::get_version(shard &_shard,
+											size_t index,
+											const std::string &key)
+{
+	memkv_meta meta;
+
+	if (!find(_shard, index, key, NULL, &meta))
+		return 0;
+
+	//key loaded from snapshot written before versions
+	return meta.version ? meta.version : 1;
+}
+
+std::string memkv_store::encode_meta(const memkv_meta &meta)
+{
+	if (!meta.version && !meta.expire_at)
+		return std::string();
+	return encode_time(meta.version) + encode_time(meta.expire_at);
+}
+
+bool memkv_store::decode_meta(const std::string &data, memkv_meta &meta)
+{
+	meta = memkv_meta();
+	if (data.empty())
+		return true;
+	if (data.size() != 16)
+		return false;
+
+	meta.version = decode_time(data.substr(0, 8));
+	meta.expire_at = decode_time(data.substr(8));
+	return true;
+}
+
+void memkv_store::fold_legacy_items(items_t &items)
+{
+	std::vector<memkv_hash::item_t> metas;
+
+	for (size_t i = 0; i < items.shards(); i++)
+	{
+		const memkv_hash &_shard = items.shard(i);
+		for (memkv_hash::const_iterator it = _shard.begin();
+			 it != _shard.end(); ++it)
+		{
+			std::string key = it.key().str();
+			if (is_meta_key(key))
+				metas.push_back(memkv_hash::item_t(key, it.value().str()));
+		}
+	}
+
+	for (size_t i = 0; i < metas.size(); i++)
+	{
+		std::string key = metas[i].first.substr(META_KEY_HEAD_SIZE);
+		std::string value;
+		memkv_meta meta;
+
+		items.erase(metas[i].first);
+		if (!items.find(key, &value, &meta))
+			continue;
+
+		if (metas[i].first[1] == VERSION_TAG)
+			meta.version = decode_time(metas[i].second);
+		else
+			meta.expire_at = decode_time(metas[i].second);
+		items.set(key, value, meta);
+	}
+}
+
+bool memkv_store::exist(const std::string &key)
+{
+	size_t index = items_.shard_index(key);
+	shard &_shard = *shards_[index];
+
+	read_guard lg(_shard.rwlock);
+	return find(_shard, index, key, NULL);
+}
+
+void memkv_store::put(shard &_shard,
+					  size_t index,
+					  const std::string &key,
+					  const std::string &value,
+					  const memkv_meta &meta)
+{
+	_shard.dirty.insert(key);
+
+	if (!_shard.frozen)
+	{
+		items_.shard(index).set(key, value, meta);
+		return;
+	}
+	shard::delta_item &item = _shard.delta[key];
+	item.deleted = false;
+	item.value = value;
+	item.meta = meta;
+}
+
+void memkv_store::remove(shard &_shard, size_t index, const std::string &key)
+{
+	_shard.dirty.insert(key);
+
+	if (!_shard.frozen)
+	{
+		items_.shard(index).erase(key);
+		return;
+	}
+	shard::delta_item &item = _shard.delta[key];
+	item.deleted = true;
+	item.value.clear();
+	item.meta = memkv_meta();
+}
+
+void memkv_store::set(shard &_shard,
+					  size_t index,
+					  const std::string &key,
+					  const std::string &value,
+					  unsigned long long expire_at,
+					  unsigned long long version)
+{
+	memkv_meta meta;
+
+	if (!find(_shard, index, key, NULL, &meta))
+	{
+		_shard.size++;
+		_shard.keys.insert(key);
+		_shard.keys_bytes += key_node_bytes(key);
+	}
+	else if (meta.expire_at)
+	{
+		expiry_->remove(meta.expire_at, key);
+	}
+
+	//set without expire time make key persistent
+	meta.version = version;
+	meta.expire_at = expire_at;
+	put(_shard, index, key, value, meta);
+	if (expire_at)
+		expiry_->add(expire_at, key);
+}
+
+void memkv_store::del(shard &_shard, size_t index, const std::string &key)
+{
+	memkv_meta meta;
+
+	if (!find(_shard, index, key, NULL, &meta))
+		return;
+	_shard.size--;
+	_shard.keys.erase(key);
+	_shard.keys_bytes -= key_node_bytes(key);
+	remove(_shard, index, key);
+
+	if (meta.expire_at)
+		expiry_->remove(meta.expire_at, key);
+}
+
+void memkv_store::write(shard &_shard, size_t index, const write_op &op)
+{
+	if (op.deleted)
+		del(_shard, index, op.key);
+	else
+		set(_shard, index, op.key, op.value, op.expire_at, op.version);
+}
+
+void memkv_store::set(const std::string &key,
+					  const std::string &value,
+					  unsigned long long expire_at,
+					  unsigned long long version)
+{
+	size_t index = items_.shard_index(key);
+	shard &_shard = *shards_[index];
+
+	write_guard lg(_shard.rwlock);
+	set(_shard, index, key, value, expire_at, version);
+}
+
+void memkv_store::del(const std::string &key)
+{
+	size_t index = items_.shard_index(key);
+	shard &_shard = *shards_[index];
+
+	write_guard lg(_shard.rwlock);
+	del(_shard, index, key);
+}
+
+bool memkv_store::cas(const write_op &op,
+					  unsigned long long expected,
+					  unsigned long long &current)
+{
+	size_t index = items_.shard_index(op.key);
+	shard &_shard = *shards_[index];
+
+	write_guard lg(_shard.rwlock);
+	current = get_version(_shard, index, op.key);
+	if (current != expected)
+		return false;
+
+	write(_shard, index, op);
+	current = op.deleted ? 0 : op.version;
+	return true;
+}
+
+size_t memkv_store::expire(unsigned long long time)
+{
+	std::vector<std::string> keys;
+	{
+		acl::lock_guard lg(expiry_->locker);
+
+		expiry::buckets_t::iterator it = expiry_->buckets.begin();
+		for (; it != expiry_->buckets.end() &&
+			 it->first <= expire_bucket(time); ++it)
+		{
+			keys.insert(keys.end(), it->second.begin(), it->second.end());
+		}
+	}
+
+	//keys of the last bucket may expire after time
+	size_t count = 0;
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		size_t index = items_.shard_index(keys[i]);
+		shard &_shard = *shards_[index];
+		memkv_meta meta;
+
+		write_guard lg(_shard.rwlock);
+		if (find(_shard, index, keys[i], NULL, &meta) &&
+			meta.expire_at && meta.expire_at <= time)
+		{
+			del(_shard, index, keys[i]);
+			count++;
+		}
+	}
+	return count;
+}
+
+unsigned long long memkv_store::next_expire()
+{
+	acl::lock_guard lg(expiry_->locker);
+
+	if (expiry_->buckets.empty())
+		return 0;
+	return expiry_->buckets.begin()->first * 1000;
+}
+
+void memkv_store::write(const write_batch_t &batch)
+{
+	std::vector<size_t> indexs;
+	std::set<size_t> locks;
+
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		indexs.push_back(items_.shard_index(batch[i].key));
+		locks.insert(indexs.back());
+	}
+
+	//lock in order of shard index
+	for (std::set<size_t>::iterator it = locks.begin();
+		 it != locks.end(); ++it)
+	{
+		pthread_rwlock_wrlock(&shards_[*it]->rwlock);
+	}
+
+	for (size_t i = 0; i < batch.size(); i++)
+		write(*shards_[indexs[i]], indexs[i], batch[i]);
+
+	for (std::set<size_t>::iterator it = locks.begin();
+		 it != locks.end(); ++it)
+	{
+		pthread_rwlock_unlock(&shards_[*it]->rwlock);
+	}
+}
+
+bool memkv_store::scan(const std::string &start,
+					   const std::string &end,
+					   size_t limit,
+					   scan_items_t &items,
+					   std::string *next)
+{
+	//the smallest key of a shard not taken yet, and the shard
+	typedef std::pair<std::string, size_t> head_t;
+	std::priority_queue<head_t,
+						std::vector<head_t>,
+						std::greater<head_t> > heads;
+
+	for (size_t i = 0; i < shards_.size(); i++)
+	{
+		shard &_shard = *shards_[i];
+
+		read_guard lg(_shard.rwlock);
+		keys_t::const_iterator it = _shard.keys.lower_bound(start);
+		if (it != _shard.keys.end() && (end.empty() || *it < end))
+			heads.push(head_t(*it, i));
+	}
+
+	/*
+	 * take the smallest head, and the shard gives its next key
+	 * after it, so no more than limit keys are read from shards.
+	 * key deleted after it is read as head is skipped
+	 */
+	while (!heads.empty() && items.size() < limit)
+	{
+		head_t head = heads.top();
+		heads.pop();
+
+		shard &_shard = *shards_[head.second];
+		std::string value;
+
+		read_guard lg(_shard.rwlock);
+		keys_t::const_iterator it = _shard.keys.upper_bound(head.first);
+		if (it != _shard.keys.end() && (end.empty() || *it < end))
+			heads.push(head_t(*it, head.second));
+
+		if (find(_shard, head.second, head.first, &value))
+		{
+			items.push_back(memkv_hash::item_t());
+			items.back().first.swap(head.first);
+			items.back().second.swap(value);
+		}
+	}
+	if (heads.empty())
+		return false;
+
+	if (next)
+		*next = heads.top().first;
+	return true;
+}
+
+std::string memkv_store::prefix_end(const std::string &prefix)
+{
+	std::string end = prefix;
+
+	while (end.size())
+	{
+		unsigned char last = (unsigned char) end[end.size() - 1];
+		if (last != 0xff)
+		{
+			end[end.size() - 1] = (char)(last + 1);
+			return end;
+		}
+		end.erase(end.size() - 1);
+	}
+	return end;
+}
+
+void memkv_store::rebuild_index()
+{
+	acl::lock_guard expiry_lg(expiry_->locker);
+
+	expiry_->buckets.clear();
+	expiry_->bytes = 0;
+
+	for (size_t i = 0; i < items_.shards(); i++)
+	{
+		const memkv_hash &_shard = items_.shard(i);
+
+		shards_[i]->keys.clear();
+		shards_[i]->keys_bytes = 0;
+		shards_[i]->size = 0;
+		for (memkv_hash::const_iterator it = _shard.begin();
+			 it != _shard.end(); ++it)
+		{
+			std::string key = it.key().str();
+			unsigned long long expire_at = it.meta().expire_at;
+
+			if (expire_at)
+				expiry_->insert(expire_at, key);
+			shards_[i]->keys_bytes += key_node_bytes(key);
+			shards_[i]->keys.insert(key);
+			shards_[i]->size++;
+		}
+	}
+}
+
+void memkv_store::memory(memory_stats &stats)
+{
+	for (size_t i = 0; i < shards_.size(); i++)
+	{
+		read_guard lg(shards_[i]->rwlock);
+		const memkv_hash &items = items_.shard(i);
+
+		stats.keys += shards_[i]->size;
+		stats.items += items.size();
+		stats.table_bytes += items.table_bytes();
+		stats.arena_bytes += items.arena().bytes();
+		stats.garbage_bytes += items.arena().garbage();
+		stats.index_bytes += shards_[i]->keys_bytes;
+	}
+
+	acl::lock_guard lg(expiry_->locker);
+	stats.index_bytes += expiry_->bytes;
+}
+
+size_t memkv_store::size()
+{
+	size_t size = 0;
+	for (size_t i = 0; i < shards_.size(); i++)
+	{
+		read_guard lg(shards_[i]->rwlock);
+		size += shards_[i]->size;
+	}
+	return size;
+}
+
+void memkv_store::reset(items_t &items)
+{
+	acl::lock_guard freeze_lg(freeze_locker_);
+	lock_all();
+
+	acl_assert(items.shards() == items_.shards());
+	items_.swap(items);
+	for (size_t i = 0; i < shards_.size(); i++)
+	{
+		shards_[i]->delta.clear();
+		shards_[i]->dirty.clear();
+	}
+	rebuild_index();
+	unlock_all();
+}
+
+void memkv_store::patch(items_t &sets, const keys_t &dels)
+{
+	acl::lock_guard freeze_lg(freeze_locker_);
+	lock_all();
+
+	for (keys_t::const_iterator it = dels.begin();
+		 it != dels.end(); ++it)
+	{
+		items_.erase(*it);
+	}
+	for (size_t i = 0; i < sets.shards(); i++)
+	{
+		const memkv_hash &_shard = sets.shard(i);
+		for (memkv_hash::const_iterator it = _shard.begin();
+			 it != _shard.end(); ++it)
+		{
+			items_.set(it.key().str(), it.value().str(), it.meta());
+		}
+	}
+	for (size_t i = 0; i < shards_.size(); i++)
+		shards_[i]->dirty.clear();
+	rebuild_index();
+	unlock_all();
+}
+
+const memkv_store::items_t *memkv_store::freeze()
+{
+	//snapshot is being made by other thread
+	if (!freeze_locker_.try_lock())
+		return NULL;
+
+	//all shards are frozen at the same time
+	lock_all();
+	for (size_t i = 0; i < shards_.size(); i++)
+	{
+		shards_[i]->frozen = true;
+		shards_[i]->frozen_dirty.swap(shards_[i]->dirty);
+	}
+	unlock_all();
+	return &items_;
+}
+
+const memkv_store::keys_t &memkv_store::frozen_dirty(size_t shard) const
+{
+	return shards_[shard]->frozen_dirty;
+}
+
+size_t memkv_store::frozen_dirty_size() const
+{
+	size_t size = 0;
+	for (size_t i = 0; i < shards_.size(); i++)
+		size += shards_[i]->frozen_dirty.size();
+	return size;
+}
+
+void memkv_store::restore_dirty()
+{
+	for (size_t i = 0; i < shards_.size(); i++)
+	{
+		shard &_shard = *shards_[i];
+
+		write_guard lg(_shard.rwlock);
+		_shard.dirty.insert(_shard.frozen_dirty.begin(),
+							_shard.frozen_dirty.end());
+		_shard.frozen_dirty.clear();
+	}
+}
+
+void memkv_store::unfreeze()
+{
+	bool frozen = false;
+
+	//shards are merged one by one
+	for (size_t i = 0; i < shards_.size(); i++)
+	{
+		shard &_shard = *shards_[i];
+		memkv_hash &items = items_.shard(i);
+
+		write_guard lg(_shard.rwlock);
+		if (!_shard.frozen)
+			continue;
+		frozen = true;
+
+		for (shard::delta_t::iterator it = _shard.delta.begin();
+			 it != _shard.delta.end(); ++it)
+		{
+			if (it->second.deleted)
+				items.erase(it->first);
+			else
+				items.set(it->first,
+						  it->second.value,
+						  it->second.meta);
+		}
+		_shard.delta.clear();
+		_shard.frozen_dirty.clear();
+		_shard.frozen = false;
+	}
+	if (frozen)
+		freeze_locker_.unlock();
+}
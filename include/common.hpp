@@ -98,6 +98,33 @@ namespace raft
 		buffer_ += sizeof(value);
 		return value;
 	}
+	//varint.7 bits each byte, low bits first, high bit for more bytes
+	inline void put_varint(std::string &buffer_, unsigned long long value)
+	{
+		while (value >= 0x80)
+		{
+			buffer_.push_back((char)((value & 0x7f) | 0x80));
+			value >>= 7;
+		}
+		buffer_.push_back((char) value);
+	}
+
+	//return false if varint is broken or beyond end
+	inline bool get_varint(unsigned char *&buffer_,
+						   const unsigned char *end,
+						   unsigned long long &value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64 && buffer_ < end; shift += 7)
+		{
+			unsigned char byte = *buffer_++;
+			value |= ((unsigned long long)(byte & 0x7f)) << shift;
+			if (!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+
 	inline void put_string(unsigned char *&buffer_, const std::string &str)
 	{
 		put_uint32(buffer_, (unsigned int)str.size());
@@ -250,6 +277,46 @@ namespace raft
 #endif
         return data;
     }
+    //mmap file read only.it will not change file size
+    inline void *open_mmap_read(ACL_FILE_HANDLE fd, size_t len)
+    {
+        void *data = NULL;
+
+#ifdef ACL_UNIX
+        data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            logger_error("mmap error: %s", acl_last_serror());
+            return NULL;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(data, len, MADV_SEQUENTIAL);
+#endif
+
+#elif defined(_WIN32) || defined(_WIN64)
+        (void)len;
+
+        ACL_FILE_HANDLE hmap =
+			CreateFileMapping(fd, NULL, PAGE_READONLY, 0, 0, NULL);
+
+		if (!hmap)
+		{
+			logger_error("CreateFileMapping: %s", acl_last_serror());
+			return NULL;
+		}
+
+		data = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+		if (!data)
+			logger_error("MapViewOfFile error: %s",
+				acl_last_serror());
+
+		acl_assert(CloseHandle(hmap));
+#else
+		logger_error("%s: not supported yet!", __FUNCTION__);
+#endif
+        return data;
+    }
+
 	//close mmap file;
     inline void close_mmap(void *map, size_t map_size)
     {
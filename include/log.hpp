@@ -98,6 +98,18 @@ namespace raft
 		 */
 		virtual bool empty() = 0;
 
+		/**
+		 * \brief get bytes of log entries written to log
+		 * \return bytes of log data
+		 */
+		virtual size_t data_size() = 0;
+
+		/**
+		 * \brief hint log will be read from start to end soon.
+		 * log may load data into memory before reading
+		 */
+		virtual void read_ahead() {}
+
 		/**
 		 * \brief set log file auto delete file from disk
 		 * when log obj is delete and it will delete file 
@@ -27,6 +27,12 @@ namespace raft
 		void truncate(log_index_t index);
 
 		size_t log_count();
+
+		/**
+		 * \brief bytes of log entries in all logs.it is counted
+		 * when logs are written, truncated and discarded
+		 */
+		size_t log_bytes();
 		
 		log_index_t start_index();
 		
@@ -43,6 +49,11 @@ namespace raft
 
 		int discard_log(log_index_t log_start_index);
 
+		/**
+		 * \brief hint log has the index will be read to its end
+		 */
+		void read_ahead(log_index_t index);
+
 		void set_log_size(size_t log_size);
 
 		void set_last_index(log_index_t index);
@@ -58,6 +69,8 @@ namespace raft
 		size_t			log_size_;
 		log_index_t		last_index_;
 		term_t			last_term_;
+		//sum of data_size() of logs_
+		size_t			log_bytes_;
 		acl::locker		locker_;
 		log				*last_log_;
 		std::map<log_index_t, log*> logs_;
@@ -31,6 +31,10 @@ namespace raft
 
 		virtual bool empty();
 
+		virtual size_t data_size();
+
+		virtual void read_ahead();
+
 		virtual log_index_t last_index();
 
         virtual term_t last_term();
@@ -44,6 +44,30 @@ namespace raft
 	 */
 	bool read(acl::istream &file, version &ver);
 
+	/**
+	 * \brief write head of delta snapshot.
+	 * \param file file stream
+	 * \param ver version of the delta snapshot
+	 * \param base version of the snapshot which the delta
+	 * snapshot based on.
+	 * \return return true if write ok
+	 */
+	bool write(acl::ostream &file, const version &ver, const version &base);
+
+	/**
+	 * \brief read version from snapshot or delta snapshot file
+	 * \param file file to read
+	 * \param ver version of snapshot
+	 * \param base base version of delta snapshot.
+	 * base.index_ is 0 for full snapshot
+	 * \return return true if read ok
+	 */
+	bool read(acl::istream &file, version &ver, version &base);
+
+	bool write(acl::ostream &file, const snapshot_info &info);
+
+	bool read(acl::istream &file, snapshot_info &info);
+
 
 
 	bool operator <(const version& left, const version& right);
@@ -67,6 +91,42 @@ namespace raft
 	};
 
 
+	/**
+	 * \brief replay committed log entries to state machine when
+	 * node restart.parse() is invoked by worker threads in parallel,
+	 * and apply() is invoked in log order
+	 */
+	struct recover_callback
+	{
+		/**
+		 * \brief log data parsed by state machine
+		 */
+		struct entry
+		{
+			virtual ~entry() {}
+		};
+
+		virtual ~recover_callback() {}
+
+		/**
+		 * \brief parse log data.it must not change state machine
+		 * \param data log data
+		 * \param ver version of the log
+		 * \return parsed entry, return NULL if data is broken
+		 */
+		virtual entry *parse(const std::string &data,
+							 const version &ver) = 0;
+
+		/**
+		 * \brief apply parsed entry to state machine
+		 * \param parsed entry returned by parse(). node delete it
+		 * after apply
+		 * \param ver version of the log
+		 * \return return false to stop recovering
+		 */
+		virtual bool apply(entry *parsed, const version &ver) = 0;
+	};
+
     /**
      * replicate_callback is handle to node when replicate data.
      * if replicate done or error.it's operator() function will be invoked.
@@ -107,11 +167,64 @@ namespace raft
 		virtual bool operator()(const std::string &filepath) = 0;
 	};
 
-	
+
+	/**
+	 * \brief point-in-time view of state machine captured by
+	 * make_snapshot_callback::capture().node write it to snapshot
+	 * file in compaction thread, and delete it when done.
+	 * state machine keeps serving requests meanwhile.
+	 */
+	struct snapshot_view
+	{
+		virtual ~snapshot_view() {}
+
+		/**
+		 * \brief write the view to snapshot file. it is the same
+		 * to make_snapshot_callback::operator()
+		 * \param path snapshot path
+		 * \param filepath snapshot file path.it's ext name
+		 * must not be ".snapshot"
+		 * \return return true if write ok
+		 */
+		virtual bool write(const std::string &path,
+						   std::string &filepath) = 0;
+
+		/**
+		 * \brief write changes since base to a delta snapshot file.
+		 * the file begin with write(file, ver, base).node load
+		 * delta snapshots after their base by load_snapshot_callback.
+		 * \param path snapshot path
+		 * \param base version of current snapshot
+		 * \param filepath delta snapshot file path.it's ext name
+		 * must not be ".snapshot" or ".delta"
+		 * \return return false if not supported or changes since
+		 * base is unknown.node will invoke write() then
+		 */
+		virtual bool write_delta(const std::string &path,
+								 const version &base,
+								 std::string &filepath)
+		{
+			(void) path;
+			(void) base;
+			(void) filepath;
+			return false;
+		}
+	};
+
 	struct make_snapshot_callback
 	{
 		virtual ~make_snapshot_callback() {}
 
+		/**
+		 * \brief capture a view of state machine for snapshot.
+		 * it should be cheap (eg: freeze state and write changes
+		 * to a delta), because state machine can't change while
+		 * capturing.node use it before operator()
+		 * \return return NULL if not supported,and node will
+		 * invoke operator() to make snapshot
+		 */
+		virtual snapshot_view *capture() { return NULL; }
+
 		/**
 		 * \brief node make snapshot to compact log.and this functor 
 		 * is make snapshot callnack handle.user must give this handle
@@ -130,6 +243,49 @@ namespace raft
 		virtual bool operator()(const std::string &path, std::string &filepath) = 0;
 	};
 
+	/**
+	 * \brief snapshot_sink receive snapshot bytes while leader
+	 * is sending snapshot to this node, so that state machine can
+	 * build its state as chunks arrive instead of reading the file
+	 * again after it is written.the snapshot file is written
+	 * as before.
+	 * bytes are the snapshot file as it is.wire compression of
+	 * chunks is undone before, but a compressed snapshot file
+	 * is not: data after its version header is in zip blocks.
+	 */
+	struct snapshot_sink
+	{
+		virtual ~snapshot_sink() {}
+
+		/**
+		 * \brief a new snapshot begin to receive.
+		 * \param ver version of the snapshot
+		 * \param compressed true if data after version header is
+		 * zip blocks, they can be decoded by zip_decoder
+		 * \return return false to refuse it. node will load the
+		 * snapshot file by load_snapshot_callback when it is done
+		 */
+		virtual bool open(const version &ver, bool compressed) = 0;
+
+		/**
+		 * \brief bytes of snapshot file in order.the first bytes
+		 * is the beginning of the file (version header)
+		 * \return return false if error.node will load the
+		 * snapshot file by load_snapshot_callback when it is done
+		 */
+		virtual bool write(const char *data, size_t len) = 0;
+
+		/**
+		 * \brief snapshot end.
+		 * \param done true if all bytes of snapshot are written
+		 * and node is going to use it.false if snapshot aborted.
+		 * \return when done is true, return true if state machine is
+		 * reset to the snapshot. otherwise node will load the
+		 * snapshot file by load_snapshot_callback.
+		 */
+		virtual bool close(bool done) = 0;
+	};
+
     class metadata;
     /**
 	 * \brief raft node
@@ -176,6 +332,21 @@ namespace raft
          */
         std::string get_snapshot() const;
 
+        /**
+         * get snapshot chain. it is a full snapshot file and
+         * delta snapshot files based on it in order.
+         * state machine should load them one by one.
+         * @return snapshot file paths, empty if no snapshot
+         */
+        std::vector<std::string> get_snapshot_chain() const;
+
+        /**
+         * set max delta snapshots based on a full snapshot.
+         * node make a full snapshot when chain is full.
+         * @param count 0 for no delta snapshot. default is 4
+         */
+        void set_max_delta_chain(size_t count);
+
 
 		/**
 		* \brief return committed log index.
@@ -227,12 +398,39 @@ namespace raft
          */
         bool reload();
 
+        /**
+         * \brief replay committed log entries after index to state
+         * machine.entries are read in batches, parsed by threads,
+         * and applied in order. applied index is updated too.
+         * invoke it after reload() and loading snapshot, before start()
+         * \param callback state machine callback
+         * \param index last index applied to state machine
+         * \param threads count of parse threads
+         * \return return true if applied to committed index.when
+         * false, applied index is the last entry applied ok
+         */
+        bool recover(recover_callback &callback,
+                     log_index_t index,
+                     int threads = 4);
+
         /**
          * start raft node.before invoke start.
          * U need to set node config done.
          */
         void start();
 
+		/**
+		 * \brief transfer leadership to peer. node stop accepting
+		 * replicate request, bring the peer's log up to date, and then
+		 * send TimeoutNow to the peer to start election immediately.
+		 * if transfer not done in election timeout, node will accept
+		 * replicate request again.
+		 * \param peer_id id of peer to be new leader
+		 * \return return false if this node is not leader, peer not
+		 * exist,or another transfer is in progress.otherwise return true
+		 */
+		bool transfer_leadership(const std::string &peer_id);
+
         ///raft config interface
     public:
 
@@ -269,6 +467,13 @@ namespace raft
 		 */
 		void set_make_snapshot_callback(make_snapshot_callback* callback);
 
+		/**
+		 * \brief set snapshot sink. it is optional. if it is set,
+		 * snapshot from leader is streamed to it while receiving.
+		 * \param sink snapshot_sink obj
+		 */
+		void set_snapshot_sink(snapshot_sink *sink);
+
 		/**
 		 * \brief bind replicate_callback handle to this node.
 		 * when node is not leader,it will receive data from leader
@@ -320,11 +525,126 @@ namespace raft
 		 */
 		void set_max_log_count(size_t count);
 
+		/**
+		 * \brief set max bytes of log entries. when logs are
+		 * larger than it, node will do log compaction to delete
+		 * half of them
+		 * \param bytes 0 for no limit, default is 0
+		 */
+		void set_max_log_bytes(size_t bytes);
+
+		/**
+		 * \brief set count of log entries kept before the
+		 * snapshot index when doing log compaction
+		 * \param count default is 10000
+		 */
+		void set_compaction_keep_entries(log_index_t count);
+
+		/**
+		 * \brief leader keep log entries for peers behind less
+		 * than count entries, so they catch up by log replication
+		 * instead of installing snapshot
+		 * \param count 0 for not waiting peers, default is 100000
+		 */
+		void set_compaction_peer_lag(log_index_t count);
+
+		/**
+		 * \brief make a snapshot when applied entries after the
+		 * latest snapshot are more than count, even if logs are
+		 * not to be compacted.it bounds entries replayed when
+		 * node restarts
+		 * \param count 0 for no checkpoint, default is 0
+		 */
+		void set_max_replay_entries(log_index_t count);
+
         /**
          * set node id.
          * @param id node id.unique in the cluster
          */
         void set_node_id(const std::string &id);
+
+		/**
+		 * \brief set election timeout. follower wait a random time in
+		 * [timeout, timeout * 2.5) before election.when adaptive timing
+		 * is on, it is the max election timeout.
+		 * \param milliseconds default is 3000
+		 */
+		void set_election_timeout(unsigned int milliseconds);
+
+		/**
+		 * \brief set interval of leader sending heartbeat to peers.
+		 * it will be limited to 1/3 of election timeout, so a few
+		 * heartbeats can be lost before followers start election.
+		 * \param milliseconds default is 1000
+		 */
+		void set_heartbeat_interval(unsigned int milliseconds);
+
+		/**
+		 * \brief set adaptive timing. leader measure RPC RTT to peers
+		 * and derive election timeout from it, and then send it to
+		 * followers with replicate request.heartbeat interval is
+		 * derived from election timeout too.
+		 * \param enable true to enable adaptive timing.default false
+		 */
+		void set_adaptive_timing(bool enable);
+
+		/**
+		 * \brief set min election timeout for adaptive timing.
+		 * \param milliseconds default is 150
+		 */
+		void set_min_election_timeout(unsigned int milliseconds);
+
+		/**
+		 * \brief set chunk size of install snapshot request
+		 * \param bytes default is 1MB
+		 */
+		void set_snapshot_chunk_size(size_t bytes);
+
+		/**
+		 * \brief set max install snapshot requests in flight
+		 * to one peer
+		 * \param count default is 4
+		 */
+		void set_snapshot_inflight(int count);
+
+		/**
+		 * \brief set bandwidth of snapshot data this node send
+		 * to all peers.replicate requests are not limited
+		 * \param bytes_per_sec 0 for no limit, default is 0
+		 */
+		void set_snapshot_rate(unsigned long long bytes_per_sec);
+
+		/**
+		 * \brief set max peers this node send snapshot to at
+		 * the same time.others wait for next heartbeat to retry
+		 * \param count 0 for no limit, default is 2
+		 */
+		void set_max_snapshot_transfers(int count);
+
+		/**
+		 * \brief compress snapshot chunks sent to peers.
+		 * snapshot file compressed already is sent as it is
+		 * \param enable default is false
+		 */
+		void set_compress_snapshot_transfer(bool enable);
+
+		size_t snapshot_chunk_size();
+
+		int snapshot_inflight();
+
+		bool compress_snapshot_transfer();
+
+		/**
+		 * \brief get current election timeout
+		 * \return milliseconds
+		 */
+		unsigned int election_timeout();
+
+		/**
+		 * \brief get current heartbeat interval
+		 * \return milliseconds
+		 */
+		unsigned int heartbeat_interval();
 		///raft rpc interface///
 	public:
 		/**
@@ -337,6 +657,19 @@ namespace raft
 		bool handle_vote_request(const vote_request &req,
                                  vote_response &resp);
 
+		/**
+		* \brief this interface should regist to server to process
+		* pre-vote request from other pre-candidate. pre-vote is granted
+		* if this node has not heard from leader in election timeout,
+		* and candidate's log is at least as up-to-date as this node's.
+		* it will not change this node's term or vote.
+		* \param req vote_request req, req.term is candidate's term + 1
+		* \param resp vote_response resp
+		* \return return true
+		*/
+		bool handle_pre_vote_request(const vote_request &req,
+                                     vote_response &resp);
+
 		/**
 		* \brief this interface should regist to server to process 
 		* leader replicate data request .
@@ -366,12 +699,26 @@ namespace raft
 				const install_snapshot_request &req,
 				install_snapshot_response &resp);
 
+		/**
+		* \brief this interface should regist to server to process
+		* timeout_now_request. leader send it to the peer that it
+		* transfer leadership to, and the peer start election
+		* immediately without waiting election timeout.
+		* \param req timeout_now_request send from leader
+		* \param resp timeout_now_response to send back to leader
+		* \return return true
+		*/
+		bool handle_timeout_now_request(
+				const timeout_now_request &req,
+				timeout_now_response &resp);
+
     protected:
 		enum role_t
 		{
 			E_LEADER,//leader
 			E_FOLLOWER,//follower
-			E_CANDIDATE//candidate
+			E_CANDIDATE,//candidate
+			E_PRE_CANDIDATE//pre-candidate, doing pre-vote
 		};
 
 		friend class peer;
@@ -387,6 +734,8 @@ namespace raft
 		 */
 		bool is_candidate();
 
+		bool is_pre_candidate();
+
 		log_index_t last_log_index() const;
 
         term_t last_log_term()const;
@@ -413,6 +762,12 @@ namespace raft
 
 		void set_role(int _role);
 
+		/**
+		 * \brief set role to _role only if current role is expect.
+		 * \return true if role was changed by this call
+		 */
+		bool compare_and_set_role(int expect, int _role);
+
 		std::string vote_for();
 
 		void set_vote_for(const std::string &vote_for);
@@ -426,27 +781,118 @@ namespace raft
 			log_index_t index,
 			int entry_size = 0);
 
+		/**
+		 * \brief build a replicate request with no entries.
+		 * prev_log_index is the peer's match_index, so a follower
+		 * whose log does not start at 1 still accepts leader_commit.
+		 * it keeps leadership and commit index flowing to peer while
+		 * snapshot is being sent to it.
+		 */
+		void build_heartbeat_request(
+			replicate_log_entries_request &request,
+			log_index_t match_index);
+
 		std::vector<log_index_t> get_peers_match_index();
 
 		void replicate_log_callback();
 
 		void build_vote_request(vote_request &req);
 
+		void build_pre_vote_request(vote_request &req);
+
+		bool is_log_up_to_date(log_index_t index, term_t term);
+
+		bool leader_alive();
+
+		void update_leader_contact_time();
+
+		bool adaptive_timing();
+
+		//leader derive election timeout from RTT of peers
+		void update_election_timeout();
+
+		void set_adaptive_election_timeout(unsigned int milliseconds);
+
 		void clear_vote_response();
 
 		void vote_response_callback(const std::string &peer_id, 
 			const vote_response &response);
 
+		void pre_vote_response_callback(const std::string &peer_id,
+			const vote_response &response);
+
 		int peers_count();
 
 		void handle_new_term(term_t term);
 
+		struct snapshot_file
+		{
+			std::string path_;
+			version ver_;
+			//base version of delta snapshot
+			version base_;
+		};
+		typedef std::map<log_index_t, snapshot_file> snapshot_files_t;
+
 		/**
    		 * 
-		 * \brief scan snapshot path,and find snapshot files
-		 * \return a map,first is snapshot last index, send is filepath
+		 * \brief scan snapshot path,and find snapshot and delta
+		 * snapshot files
+		 * \param known files known already.their head is not read
+		 * \return a map,first is snapshot last index, send is file
 		 */
-		std::map<log_index_t, std::string> scan_snapshots() const;
+		snapshot_files_t scan_snapshots(const snapshot_files_t &known) const;
+
+		/**
+		 * \brief load snapshot catalog from manifest, and check it
+		 * with files in snapshot path.files not in manifest are
+		 * added, and missing files are dropped
+		 */
+		void load_snapshot_catalog();
+
+		bool read_snapshot_manifest(snapshot_files_t &files) const;
+
+		/**
+		 * \brief write catalog to manifest file, and rename it
+		 * to replace the old one.invoke with catalog locker held
+		 */
+		bool save_snapshot_catalog() const;
+
+		/**
+		 * \brief add snapshot file to catalog and save manifest
+		 */
+		void add_snapshot_file(const snapshot_file &file) const;
+
+		bool add_snapshot_file(const std::string &file_path) const;
+
+		/**
+		 * \brief rebuild chain of the latest snapshot from catalog.
+		 * invoke with catalog locker held
+		 */
+		void update_snapshot_chain() const;
+
+		/**
+		 * \brief get version of the latest snapshot from catalog
+		 * \param chain get snapshot chain of the version if not NULL
+		 * \return false if no snapshot
+		 */
+		bool get_snapshot_version(version &ver,
+								  std::vector<std::string> *chain = NULL) const;
+
+		/**
+		 * \brief get snapshot file to send to peer.if snapshot
+		 * chain has delta snapshots, they are packed in a chain file
+		 * \return file path, empty if no snapshot
+		 */
+		std::string get_install_snapshot();
+
+		/**
+		 * \brief split received chain file to snapshot files
+		 * \param count count of files in the chain
+		 * \param files snapshot files in order
+		 */
+		bool split_snapshot_chain(unsigned int count,
+								  std::vector<std::string> &files);
 
 		/**
 		 * \brief check should do log compaction now.
@@ -454,6 +900,48 @@ namespace raft
 		 * otherwise return false
 		 */
 		bool should_compact_log();
+
+		/**
+		 * \brief check applied entries after the latest snapshot
+		 * are more than max_replay_entries.snapshot catalog is
+		 * looked up only when applied index reaches the index it
+		 * could be true at
+		 */
+		bool should_checkpoint();
+
+		/**
+		 * \brief do not check checkpoint again until another
+		 * max_replay_entries entries are applied
+		 */
+		void checkpoint_backoff();
+
+		/**
+		 * \brief check logs are compacted enough
+		 */
+		bool log_compacted();
+
+		/**
+		 * \brief get last index of logs can be discarded.
+		 * it keeps trailing entries and entries peers need
+		 * \param snapshot_index logs after snapshot are kept
+		 */
+		log_index_t get_compaction_index(log_index_t snapshot_index);
+
+		/**
+		 * \brief discard old logs until logs are compacted
+		 * \param index logs after index are kept
+		 * \return count of log files discarded
+		 */
+		int discard_logs(log_index_t index);
+
+		/**
+		 * \brief read a batch of log entries for recover
+		 * \param index the first index to read
+		 * \param to the last index to read
+		 */
+		bool read_recover_batch(log_index_t index,
+								log_index_t to,
+								std::vector<log_entry *> &entries);
 		
 		void async_compaction_log();
 
@@ -461,7 +949,7 @@ namespace raft
 
 		bool make_snapshot() const;
 
-		void do_compaction_log() const;
+		void do_compaction_log();
 		//
 
 		void become_leader();
@@ -472,6 +960,17 @@ namespace raft
 
 		void election_timer_callback();
 
+		void start_election();
+
+		void set_check_quorum_timer();
+
+		void check_quorum();
+
+		bool is_transferring();
+
+		void transfer_leadership_callback(const std::string &peer_id,
+										  bool ok);
+
 
 		log_index_t start_log_index()const;
 
@@ -480,6 +979,8 @@ namespace raft
 
 		void notify_peers_to_election();
 
+		void notify_peers_to_pre_vote();
+
 		void update_peers_next_index(log_index_t index);
 		//end
 
@@ -491,6 +992,37 @@ namespace raft
 
 		void close_snapshot();
 
+		/**
+		 * \brief remove snapshot temp files and their progress
+		 * files except the one of file_path
+		 */
+		void remove_snapshot_tmps(const std::string &file_path);
+
+		bool load_snapshot_progress();
+
+		void save_snapshot_progress();
+
+		/**
+		 * \brief read bytes [from, to) of snapshot temp file
+		 * \param crc update crc with the bytes if not NULL
+		 * \param to_sink write the bytes to snapshot sink
+		 */
+		bool read_snapshot_tmp(unsigned long long from,
+							   unsigned long long to,
+							   unsigned int *crc,
+							   bool to_sink);
+
+		void open_snapshot_sink(const snapshot_info &info);
+
+		void write_snapshot_sink(const char *data, size_t len);
+
+		bool close_snapshot_sink(bool done);
+
+		/**
+		 * \brief read log entry of index and apply it by apply_callback
+		 */
+		bool apply_log_entry(log_index_t index);
+
 		void invoke_apply_callbacks();
 
 		void invoke_replicate_callback(replicate_callback::status_t status);
@@ -571,6 +1103,11 @@ namespace raft
 		log_manager *log_manager_;
 
 		unsigned int election_timeout_;
+		unsigned int heartbeat_interval_;
+		unsigned int min_election_timeout_;
+		//election timeout derived from RTT, 0 if not measured
+		unsigned int adaptive_election_timeout_;
+		bool         adaptive_timing_;
 
 		int		role_;
 
@@ -582,6 +1119,13 @@ namespace raft
         std::vector<peer_info> peer_infos_;
 		acl::locker	metadata_locker_;
 
+		//leadership transfer target, empty if not transferring
+		std::string transfer_to_;
+		timeval     transfer_start_;
+
+		//last time receive request from leader
+		timeval     leader_contact_time_;
+
 
 		replicate_callbacks_t replicate_callbacks_;
 		acl::locker replicate_callbacks_locker_;
@@ -593,10 +1137,24 @@ namespace raft
 
 		load_snapshot_callback	*load_snapshot_callback_;
 		make_snapshot_callback  *make_snapshot_callback_;
+		snapshot_sink			*snapshot_sink_;
+		bool					snapshot_sink_open_;
 		std::string			    snapshot_path_;
 		snapshot_info		    *snapshot_info_;
 		acl::fstream		    *snapshot_tmp_;
 		acl::locker			    snapshot_locker_;
+		//bytes of snapshot_tmp_ received without hole
+		unsigned long long	    snapshot_received_;
+		unsigned long long	    snapshot_size_;
+		//crc32 of snapshot_received_ bytes
+		unsigned int		    snapshot_crc_;
+		//out of order chunks. offset -> end
+		std::map<unsigned long long,
+			unsigned long long>	    snapshot_chunks_;
+		size_t				    snapshot_chunk_size_;
+		int					    snapshot_inflight_;
+		bool				    compress_snapshot_transfer_;
+		snapshot_scheduler	    snapshot_scheduler_;
 		log_index_t			    last_snapshot_index_;
 		term_t				    last_snapshot_term_;
 
@@ -606,10 +1164,29 @@ namespace raft
 		size_t max_log_size_;
 		size_t max_log_count_;
         size_t mini_log_count_;
+        size_t max_log_bytes_;
+        log_index_t compaction_keep_entries_;
+        log_index_t compaction_peer_lag_;
+        log_index_t max_replay_entries_;
+        //applied index to check checkpoint again
+        log_index_t checkpoint_check_index_;
+        acl::locker checkpoint_locker_;
         size_t max_snapshot_size_;
+        size_t max_delta_chain_;
+
+		/*
+		 * snapshot files and chain of the latest snapshot.
+		 * lookup snapshot without scanning snapshot path.
+		 * they are changed by const make_snapshot too
+		 */
+		mutable snapshot_files_t         snapshot_catalog_;
+		mutable std::vector<std::string> snapshot_chain_;
+		mutable acl::locker              snapshot_catalog_locker_;
 
 
 		vote_responses_t vote_responses_;
+		//pre-vote round, not counted as votes of election
+		vote_responses_t pre_vote_responses_;
 		acl::locker		 vote_responses_locker_;
 
 		election_timer     election_timer_;
@@ -1,105 +1,221 @@
-#pragma once
-namespace raft
-{
-	class node;
-
-	/**
-	 * \brief peer mean other node in the cluster
-	 * one peer connect to one node, and it has one thread
-	 * to do replicate data,election,install snapshot request
-	 * node control peer to talk to other node
-	 * match_index of the peer mean that the node has recevie
-	 * the index of log entry. 
-	 * next_index mean next index to replicate to the node
-	 * normal next_index = match_index + 1
-	 */
-	class peer :private acl::thread
-	{
-	public:
-        /**
-         *
-         * @param _node node object ref
-         * @param peer_id node id of peer
-         * @param addr address of peer
-         */
-		peer(node &_node,
-             const std::string &peer_id,
-             const std::string &addr);
-
-		~peer();
-
-		/**
-		 * \brief notify peer thread to replicate leader's logs to 
-		 * peer node.
-		 */
-		void notify_replicate();
-		
-		/**
-		 * \brief notify peer thread to 
-		 * send delection request to peer 
-		 */
-		void notify_election();
-
-		/**
-		 * \brief get peer match index.
-		 * match log mean that,peer log index reach the index.
-		 * \return return index of log
-		 */
-		log_index_t match_index();
-
-		/**
-		 * \brief 
-		 * \param index 
-		 */
-		void set_next_index(log_index_t index);
-
-		/**
-		 * \brief 
-		 * \param index 
-		 */
-		void set_match_index(log_index_t index);
-
-        void start();
-	private:
-		void notify_stop();
-
-		void do_replicate();
-
-		bool do_install_snapshot();
-
-		void do_election();
-
-		bool wait_event(int &event);
-
-		/**
-		 * \brief thread routine
-		 * \return 
-		 */
-		virtual void* run();
-
-	private:
-		node		&node_;
-		std::string peer_id_;
-		acl::locker locker_;
-
-		log_index_t match_index_;
-		log_index_t next_index_;
-
-		int event_;
-
-		acl_pthread_cond_t cond_;
-		acl_pthread_mutex_t mutex_;
-		
-		timeval last_heartbeat_time_;
-		long long heart_inter_;
-		
-		acl::string replicate_service_path_;
-		acl::string election_service_path_;
-		acl::string install_snapshot_service_path_;
-
-		acl::http_rpc_client &rpc_client_;
-		size_t rpc_fails_;
-		size_t req_id_;
-		
-	};
+#pragma once
+namespace raft
+{
+	class node;
+
+	/**
+	 * \brief peer mean other node in the cluster
+	 * one peer connect to one node, and it has one thread
+	 * to do replicate data,election request and another thread
+	 * to send snapshot
+	 * node control peer to talk to other node
+	 * match_index of the peer mean that the node has recevie
+	 * the index of log entry. 
+	 * next_index mean next index to replicate to the node
+	 * normal next_index = match_index + 1
+	 */
+	class peer :private acl::thread
+	{
+	public:
+        /**
+         *
+         * @param _node node object ref
+         * @param peer_id node id of peer
+         * @param addr address of peer
+         */
+		peer(node &_node,
+             const std::string &peer_id,
+             const std::string &addr);
+
+		~peer();
+
+		/**
+		 * \brief notify peer thread to replicate leader's logs to 
+		 * peer node.
+		 */
+		void notify_replicate();
+		
+		/**
+		 * \brief notify peer thread to 
+		 * send delection request to peer 
+		 */
+		void notify_election();
+
+		/**
+		 * \brief notify peer thread to bring the peer's log up to
+		 * date and send timeout_now request to it.
+		 */
+		void notify_transfer_leadership();
+
+		/**
+		 * \brief notify peer thread to send pre-vote
+		 * request to peer
+		 */
+		void notify_pre_vote();
+
+		/**
+		 * \brief check if peer response to this node recently.
+		 * leader use it to check quorum
+		 * \param timeout milliseconds
+		 * \return return true if peer response in timeout
+		 */
+		bool is_active(long long timeout);
+
+		/**
+		 * \brief get RPC round trip time to peer.
+		 * it is smoothed RTT plus 4 times RTT variation
+		 * \return milliseconds, 0 if not measured yet
+		 */
+		long long rtt();
+
+		/**
+		 * \brief get peer match index.
+		 * match log mean that,peer log index reach the index.
+		 * \return return index of log
+		 */
+		log_index_t match_index();
+
+		/**
+		 * \brief 
+		 * \param index 
+		 */
+		void set_next_index(log_index_t index);
+
+		/**
+		 * \brief 
+		 * \param index 
+		 */
+		void set_match_index(log_index_t index);
+
+        void start();
+	private:
+		/**
+		 * \brief snapshot sender thread of the peer. snapshot is
+		 * streamed to peer in this thread, so that the peer thread
+		 * can go on sending heartbeat while it is being sent.
+		 */
+		class snapshot_sender : private acl::thread
+		{
+		public:
+			explicit snapshot_sender(peer &_peer);
+
+			~snapshot_sender();
+
+			void start();
+
+			/**
+			 * \brief notify thread to send snapshot to peer.
+			 * do nothing if it is sending now.
+			 */
+			void notify_send();
+
+			/**
+			 * \brief check if snapshot is being sent to peer
+			 */
+			bool is_sending();
+		private:
+			virtual void *run();
+
+			peer &peer_;
+			bool sending_;
+			bool stop_;
+			acl_pthread_mutex_t mutex_;
+			acl_pthread_cond_t cond_;
+		};
+
+		//snapshot file mapped in memory and send cursor
+		struct snapshot_stream;
+
+		//thread to send snapshot chunks concurrently
+		class snapshot_worker;
+
+		void notify_stop();
+
+		void do_replicate();
+
+		void do_heartbeat();
+
+		bool do_install_snapshot();
+
+		/**
+		 * \brief send an empty chunk to get bytes peer stored
+		 * already, and move cursor of stream to it.
+		 * \param stream snapshot stream to send
+		 * \param conn connection to peer
+		 */
+		void probe_snapshot(snapshot_stream &stream,
+							acl::http_request &conn);
+
+		/**
+		 * \brief send chunks of snapshot stream to peer until
+		 * the stream is done or failed.
+		 * \param stream snapshot stream shared by workers
+		 * \param conn connection to peer, one for each worker
+		 */
+		void send_snapshot_chunks(snapshot_stream &stream,
+								  acl::http_request &conn);
+
+		//post install snapshot request on conn
+		bool snapshot_call(acl::http_request &conn,
+						   const install_snapshot_request &req,
+						   install_snapshot_response &resp,
+						   std::string &buffer);
+
+		//update stream by response.return false if stream stop
+		bool snapshot_reply(snapshot_stream &stream,
+							const install_snapshot_response &resp);
+
+		void do_election();
+
+		void do_transfer_leadership();
+
+		void do_pre_vote();
+
+		void update_response_time();
+
+		void update_rtt(const timeval &start);
+
+		bool wait_event(int &event);
+
+		/**
+		 * \brief thread routine
+		 * \return 
+		 */
+		virtual void* run();
+
+	private:
+		node		&node_;
+		std::string peer_id_;
+		//address of peer, snapshot workers connect to it
+		std::string addr_;
+		acl::locker locker_;
+
+		log_index_t match_index_;
+		log_index_t next_index_;
+
+		int event_;
+
+		acl_pthread_cond_t cond_;
+		acl_pthread_mutex_t mutex_;
+		
+		timeval last_heartbeat_time_;
+		timeval last_response_time_;
+
+		//smoothed RTT and RTT variation in microseconds
+		long long srtt_;
+		long long rttvar_;
+		
+		acl::string replicate_service_path_;
+		acl::string election_service_path_;
+		acl::string install_snapshot_service_path_;
+		acl::string timeout_now_service_path_;
+		acl::string pre_vote_service_path_;
+
+		acl::http_rpc_client &rpc_client_;
+		size_t rpc_fails_;
+		size_t req_id_;
+
+		//keep it last.it stops before other members destroyed
+		snapshot_sender snapshot_sender_;
+	};
 }
\ No newline at end of file
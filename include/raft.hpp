@@ -9,6 +9,9 @@
 #include "log.hpp"
 #include "log_manager.h"
 #include "mmap_log.hpp"
+#include "rate_limiter.h"
+#include "snapshot_scheduler.h"
+#include "zip_stream.h"
 #include "peer.h"
 #include "node.h"
 #include "metadata.h"
@@ -0,0 +1,41 @@
+#pragma once
+namespace raft
+{
+	/**
+	 * \brief token bucket rate limiter.
+	 * tokens are bytes.bucket refill at rate bytes per second,
+	 * and it can hold one second of tokens at most.
+	 */
+	class rate_limiter
+	{
+	public:
+		/**
+		 * \param rate bytes per second. 0 for no limit
+		 */
+		rate_limiter(unsigned long long rate = 0);
+
+		/**
+		 * \brief set bytes per second
+		 * \param rate 0 for no limit
+		 */
+		void set_rate(unsigned long long rate);
+
+		unsigned long long rate();
+
+		/**
+		 * \brief take bytes from bucket.block until bucket has
+		 * enough tokens.bytes greater than bucket size is allowed,
+		 * later callers will wait for the debt
+		 * \param bytes bytes to take
+		 */
+		void acquire(size_t bytes);
+	private:
+		void refill();
+
+		acl::locker locker_;
+		unsigned long long rate_;
+		//may be negative when bucket in debt
+		long long tokens_;
+		timeval last_time_;
+	};
+}
@@ -0,0 +1,69 @@
+#pragma once
+namespace raft
+{
+	/**
+	 * \brief schedule snapshot transfers of node.
+	 * it limit the count of concurrent snapshot transfers and
+	 * the bandwidth of snapshot data, and it let replicate
+	 * requests go first.
+	 */
+	class snapshot_scheduler
+	{
+	public:
+		snapshot_scheduler();
+
+		~snapshot_scheduler();
+
+		/**
+		 * \brief set bandwidth of all snapshot transfers
+		 * \param bytes_per_sec 0 for no limit
+		 */
+		void set_rate(unsigned long long bytes_per_sec);
+
+		/**
+		 * \brief set max concurrent snapshot transfers
+		 * \param count 0 for no limit
+		 */
+		void set_max_transfers(int count);
+
+		/**
+		 * \brief take a transfer slot
+		 * \return return false if no slot free
+		 */
+		bool start_transfer();
+
+		/**
+		 * \brief give back transfer slot
+		 */
+		void end_transfer();
+
+		/**
+		 * \brief replicate request begin to send.
+		 * snapshot data wait for it
+		 */
+		void replicate_begin();
+
+		/**
+		 * \brief replicate request done
+		 */
+		void replicate_end();
+
+		/**
+		 * \brief wait before sending bytes of snapshot data.
+		 * it wait until no replicate request in flight (max_wait
+		 * milliseconds at most), and then wait for bandwidth
+		 * \param bytes bytes to send
+		 * \param max_wait milliseconds
+		 */
+		void acquire(size_t bytes, unsigned int max_wait);
+	private:
+		rate_limiter limiter_;
+
+		int max_transfers_;
+		int transfers_;
+		int replicating_;
+
+		acl_pthread_mutex_t mutex_;
+		acl_pthread_cond_t cond_;
+	};
+}
@@ -0,0 +1,154 @@
+#pragma once
+namespace raft
+{
+	/**
+	 * \brief compress data as one block and append it to out.
+	 * block: raw size, zipped size, crc32 of raw data and zipped data.
+	 * zipped size equal to raw size means data is stored without
+	 * compress, because it can not be compressed smaller.
+	 * \param level zlib compress level.-1 for zlib default
+	 * \return false if compress failed
+	 */
+	bool zip_block(const char *data,
+				   size_t len,
+				   std::string &out,
+				   int level = -1);
+
+	/**
+	 * \brief decode whole blocks, and append raw data to out.
+	 * \return false if block is broken or data ends in a block
+	 */
+	bool unzip_blocks(const char *data, size_t len, std::string &out);
+
+	/**
+	 * \brief write data to stream in compressed blocks.
+	 * when compress is false, data is written to stream directly,
+	 * so one code path write both formats
+	 */
+	class zip_ostream
+	{
+	public:
+		/**
+		 * \param stream output stream
+		 * \param compress write compressed blocks or not
+		 * \param block_size raw bytes of each block
+		 */
+		zip_ostream(acl::ostream &stream,
+					bool compress = true,
+					size_t block_size = 64 * 1024);
+
+		~zip_ostream();
+
+		/**
+		 * \return len if written.otherwise -1
+		 */
+		int write(const void *data, size_t len);
+
+		/**
+		 * \brief write buffered data as a block.it must be invoked
+		 * before closing the stream.
+		 */
+		bool flush();
+	private:
+		acl::ostream &stream_;
+		bool compress_;
+		size_t block_size_;
+		std::string buffer_;
+		std::string block_;
+	};
+
+	/**
+	 * \brief read data from stream written by zip_ostream.
+	 * block is checked by crc32 after decompress
+	 */
+	class zip_istream
+	{
+	public:
+		zip_istream(acl::istream &stream, bool compress = true);
+
+		/**
+		 * \return bytes read.less than len if eof or error
+		 */
+		int read(void *data, size_t len, bool loop = true);
+
+		bool eof() const;
+
+		//block broken
+		bool error() const;
+	private:
+		bool read_block();
+
+		acl::istream &stream_;
+		bool compress_;
+		bool error_;
+		bool eof_;
+		std::string buffer_;
+		size_t offset_;
+		std::string zipped_;
+	};
+
+	/**
+	 * \brief decode blocks from data pushed in any size.
+	 * it is used to decompress snapshot while receiving it.
+	 */
+	class zip_decoder
+	{
+	public:
+		/**
+		 * \brief push data and append raw data of whole blocks
+		 * to out.part of block is kept for next update
+		 * \return false if block is broken
+		 */
+		bool update(const char *data, size_t len, std::string &out);
+
+		/**
+		 * \return true if no part of block is left
+		 */
+		bool finished() const;
+
+		void reset();
+	private:
+		std::string buffer_;
+	};
+
+	inline bool write(zip_ostream &_stream, unsigned int value)
+	{
+		unsigned char len[sizeof(int)];
+		unsigned char *plen = len;
+
+		put_uint32(plen, value);
+		return _stream.write(len, sizeof(int)) == sizeof(int);
+	}
+
+	inline bool write(zip_ostream &_stream, const std::string &data)
+	{
+		if (!write(_stream, (unsigned int) data.size()))
+			return false;
+		if (data.empty())
+			return true;
+		return _stream.write(data.data(), data.size()) ==
+			static_cast<int>(data.size());
+	}
+
+	inline bool read(zip_istream &_stream, unsigned int &value)
+	{
+		unsigned char len[sizeof(int)];
+		unsigned char *plen = len;
+
+		if (_stream.read(len, sizeof(int)) != sizeof(int))
+			return false;
+		value = get_uint32(plen);
+		return true;
+	}
+
+	inline bool read(zip_istream &_stream, std::string &buffer)
+	{
+		unsigned int size = 0;
+		if (!read(_stream, size))
+			return false;
+		buffer.resize(size);
+		if (size == 0)
+			return true;
+		return _stream.read((char *) buffer.data(), size) == (int) size;
+	}
+}
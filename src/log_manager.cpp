@@ -25,6 +25,7 @@ namespace raft
 		last_index_ = 0;
 		last_log_	= NULL;
 		last_term_	= 0;
+		log_bytes_	= 0;
 	}
 
 	log_manager::~log_manager()
@@ -44,7 +45,12 @@ namespace raft
 
 		acl::lock_guard lg(locker_);
 
-		if (!last_log_ || (index = last_log_->write(entry)) == 0)
+		size_t bytes = last_log_ ? last_log_->data_size() : 0;
+		if (last_log_ && (index = last_log_->write(entry)) != 0)
+		{
+			log_bytes_ += last_log_->data_size() - bytes;
+		}
+		else
 		{
 			if (last_log_)
 				acl_assert(last_log_->eof());
@@ -71,6 +77,7 @@ namespace raft
 			}
 			log_index_t start_index = last_log_->start_index();
 			logs_.insert(std::make_pair(start_index, last_log_));
+			log_bytes_ += last_log_->data_size();
 		}
 		//update begin ,term. 
 		last_index_ = index;
@@ -106,14 +113,17 @@ namespace raft
 		for(;it != logs_.end();)
 		{
 			log* _log = it->second;
+			size_t bytes = _log->data_size();
 			if(_log->last_index() <= index)
 			{
+				log_bytes_ -= bytes;
 				_log->auto_delete(true);
 				_log->dec_ref();
 				logs_.erase(it++);
 				continue;
 			}
 			_log->truncate(index);
+			log_bytes_ -= bytes - _log->data_size();
 			return;
 		}
 	}
@@ -170,6 +180,12 @@ namespace raft
 		return logs_.size();
 	}
 
+	size_t log_manager::log_bytes()
+	{
+		acl::lock_guard lg(locker_);
+		return log_bytes_;
+	}
+
 	raft::log_index_t log_manager::start_index()
 	{
 		acl::lock_guard lg(locker_);
@@ -218,11 +234,15 @@ namespace raft
 		int del_count_ = 0;
 		iterator_t it = logs_.begin();
 
-		for(; it!= logs_.end(); ++it)
+		while (it != logs_.end())
 		{
 			if (it->second->last_index() <= last_index)
 			{
 				std::string file_path = it->second->file_path();
+				//next write create a new log
+				if (it->second == last_log_)
+					last_log_ = NULL;
+				log_bytes_ -= it->second->data_size();
 				it->second->auto_delete(true);
 				it->second->dec_ref();
 				logs_.erase(it++);
@@ -237,6 +257,16 @@ namespace raft
 		return del_count_;
 	}
 
+	void log_manager::read_ahead(log_index_t index)
+	{
+		log *log_ = find_log(index);
+		if (!log_)
+			return;
+
+		log_->read_ahead();
+		log_->dec_ref();
+	}
+
 	void log_manager::set_log_size(size_t log_size)
 	{
 		log_size_ = log_size;
@@ -305,6 +335,7 @@ namespace raft
             log_index_t index = _log->start_index();
             acl_assert(logs_.insert(
                     std::make_pair(index, _log)).second);
+            log_bytes_ += _log->data_size();
         }
 		if(logs_.size())
 		{
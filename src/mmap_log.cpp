@@ -376,6 +376,27 @@ namespace raft
         return data_wbuf_ == data_buf_;
     }
 
+    size_t mmap_log::data_size()
+    {
+        acl::lock_guard lg(write_locker_);
+        return (size_t) (data_wbuf_ - data_buf_);
+    }
+
+    void mmap_log::read_ahead()
+    {
+#if defined(MADV_SEQUENTIAL) && defined(MADV_WILLNEED)
+        acl::lock_guard lg(write_locker_);
+
+        size_t len = (size_t) (data_wbuf_ - data_buf_);
+        if (!data_buf_ || !len)
+            return;
+
+        //data_buf_ is page aligned by mmap
+        madvise(data_buf_, len, MADV_SEQUENTIAL);
+        madvise(data_buf_, len, MADV_WILLNEED);
+#endif
+    }
+
     raft::log_index_t mmap_log::last_index()
     {
         return last_index_;
@@ -1,5 +1,11 @@
 #include "raft.hpp"
 #include <iostream>
+#include <algorithm>
+#include <zlib.h>
+
+#ifndef __1MB__
+#define __1MB__ (1024 * 1024)
+#endif
 
 #ifndef __10MB__ 
 #define __10MB__ 10*1024*1024
@@ -13,6 +19,35 @@
 #define __SNAPSHOT_EXT__ ".snapshot"
 #endif
 
+#ifndef __DELTA_EXT__
+#define __DELTA_EXT__ ".delta"
+#endif
+
+#ifndef __CHAIN_EXT__
+#define __CHAIN_EXT__ ".chain"
+#endif
+
+#ifndef __SNAPSHOT_MANIFEST__
+#define __SNAPSHOT_MANIFEST__ "snapshot.manifest"
+#define __SNAPSHOT_MANIFEST_MAGIC__ "raft-snapshot-manifest"
+#endif
+
+#ifndef __SNAPSHOT_TMP_EXT__
+#define __SNAPSHOT_TMP_EXT__ ".snapshot_tmp"
+#endif
+
+#ifndef __SNAPSHOT_PROGRESS_EXT__
+#define __SNAPSHOT_PROGRESS_EXT__ ".snapshot_progress"
+#endif
+
+#ifndef __RTT_ELECTION_FACTOR__
+#define __RTT_ELECTION_FACTOR__ 10
+#endif
+
+#ifndef __RECOVER_BATCH_BYTES__
+#define __RECOVER_BATCH_BYTES__ (4 * __1MB__)
+#endif
+
 #define NODE_SECTION 11
 #define ELECTION_SECTION 12
 
@@ -48,27 +83,41 @@ namespace raft
         return true;
     }
 
-    bool write(acl::ostream &stream, const version &ver)
+    bool write(acl::ostream &stream, const snapshot_info &info)
     {
         snapshot_head head;
 
         head.magic_string_ = g_magic_string;
-        head.info_.set_last_included_term(ver.term_);
-        head.info_.set_last_snapshot_index(ver.index_);
+        head.info_ = info;
 
         if (!write(stream, head.magic_string_))
             return false;
 
         std::string buffer = head.info_.SerializeAsString();
         return write(stream, buffer);
+    }
 
+    bool write(acl::ostream &stream, const version &ver)
+    {
+        return write(stream, ver, version());
     }
 
-    bool read(acl::istream &file, version &ver)
+    bool write(acl::ostream &stream, const version &ver, const version &base)
+    {
+        snapshot_info info;
+
+        info.set_last_included_term(ver.term_);
+        info.set_last_snapshot_index(ver.index_);
+        info.set_base_snapshot_index(base.index_);
+        info.set_base_included_term(base.term_);
+
+        return write(stream, info);
+    }
+
+    bool read(acl::istream &file, snapshot_info &info)
     {
         std::string magic_string;
         std::string buffer;
-        snapshot_info info;
 
         if (!read(file, magic_string) || magic_string != g_magic_string)
         {
@@ -82,12 +131,45 @@ namespace raft
             logger_error("read snapshot error");
             return false;
         }
+        return true;
+    }
+
+    bool read(acl::istream &file, version &ver, version &base)
+    {
+        snapshot_info info;
+
+        if (!read(file, info))
+            return false;
 
         ver.index_ = info.last_snapshot_index();
         ver.term_ = info.last_included_term();
+        base.index_ = info.base_snapshot_index();
+        base.term_ = info.base_included_term();
         return true;
     }
 
+    bool read(acl::istream &file, version &ver)
+    {
+        version base;
+        return read(file, ver, base);
+    }
+
+    static bool read_snapshot_version(const std::string &file_path,
+                                      version &ver,
+                                      version &base)
+    {
+        acl::ifstream file;
+
+        if (!file.open_read(file_path.c_str()))
+        {
+            logger_error("open file error.%s %s",
+                         file_path.c_str(),
+                         acl::last_serror());
+            return false;
+        }
+        return read(file, ver, base);
+    }
+
     bool operator<(const version &left, const version &right)
     {
         return left.index_ < right.index_ ||
@@ -97,19 +179,38 @@ namespace raft
     node::node()
      : log_manager_(NULL),
        election_timeout_(3000),
+       //it was 3000, same as election timeout.one late heartbeat made election
+       heartbeat_interval_(1000),
+       min_election_timeout_(150),
+       adaptive_election_timeout_(0),
+       adaptive_timing_(false),
        role_(E_FOLLOWER),
        start_(false),
        log_ok_(false),
        load_snapshot_callback_(NULL),
        make_snapshot_callback_(NULL),
+       snapshot_sink_(NULL),
+       snapshot_sink_open_(false),
        snapshot_info_(NULL),
        snapshot_tmp_(NULL),
+       snapshot_received_(0),
+       snapshot_size_(0),
+       snapshot_crc_(0),
+       snapshot_chunk_size_(__1MB__),
+       snapshot_inflight_(4),
+       compress_snapshot_transfer_(false),
        last_snapshot_index_(0),
        last_snapshot_term_(0),
        max_log_size_(1024 * 1024 * 1024),//1G
        max_log_count_(5),
        mini_log_count_(max_log_count_ / 2),
+       max_log_bytes_(0),
+       compaction_keep_entries_(__10000__),
+       compaction_peer_lag_(__10000__ * 10),
+       max_replay_entries_(0),
+       checkpoint_check_index_(0),
        max_snapshot_size_(2),
+       max_delta_chain_(4),
        election_timer_(*this),
        log_compaction_worker_(*this),
        apply_callback_(NULL),
@@ -119,6 +220,9 @@ namespace raft
         metadata_path_ = "metadata/";
         log_path_ = "log/";
         snapshot_path_ = "snapshot_path/";
+
+        leader_contact_time_.tv_sec = 0;
+        leader_contact_time_.tv_usec = 0;
     }
 
     node::~node()
@@ -145,6 +249,12 @@ namespace raft
 
             return false;
         }
+        if (is_transferring())
+        {
+            logger("leadership is transferring. "
+                   "reject replicate request");
+            return false;
+        }
         if (!write_log(data, index, term))
         {
             logger_error("write_log error.%s",
@@ -186,6 +296,232 @@ namespace raft
         return true;
     }
 
+    /*
+     * parse log entries of a batch.worker i parse entry i,
+     * i + step, i + step * 2 ...
+     */
+    class recover_worker : public acl::thread
+    {
+    public:
+        typedef std::vector<recover_callback::entry *> parsed_t;
+
+        recover_worker(recover_callback &callback,
+                       const std::vector<log_entry *> &entries,
+                       parsed_t &parsed,
+                       size_t begin,
+                       size_t step)
+            :callback_(callback),
+             entries_(entries),
+             parsed_(parsed),
+             begin_(begin),
+             step_(step)
+        {
+        }
+    private:
+        virtual void *run()
+        {
+            for (size_t i = begin_; i < entries_.size(); i += step_)
+            {
+                const log_entry *entry = entries_[i];
+                parsed_[i] = callback_.parse(entry->log_data(),
+                                             version(entry->index(),
+                                                     entry->term()));
+            }
+            return NULL;
+        }
+
+        recover_callback &callback_;
+        const std::vector<log_entry *> &entries_;
+        parsed_t &parsed_;
+        size_t begin_;
+        size_t step_;
+    };
+
+    static void start_recover_workers(recover_callback &callback,
+                                      const std::vector<log_entry *> &entries,
+                                      recover_worker::parsed_t &parsed,
+                                      std::vector<recover_worker *> &workers,
+                                      int threads)
+    {
+        parsed.assign(entries.size(), NULL);
+        for (int i = 0; i < threads && (size_t) i < entries.size(); i++)
+        {
+            recover_worker *worker = new recover_worker(callback,
+                                                        entries,
+                                                        parsed,
+                                                        (size_t) i,
+                                                        (size_t) threads);
+            worker->start();
+            workers.push_back(worker);
+        }
+    }
+
+    static void wait_recover_workers(std::vector<recover_worker *> &workers)
+    {
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i]->wait();
+            delete workers[i];
+        }
+        workers.clear();
+    }
+
+    static void free_recover_batch(std::vector<log_entry *> &entries,
+                                   recover_worker::parsed_t &parsed)
+    {
+        for (size_t i = 0; i < entries.size(); i++)
+            delete entries[i];
+        for (size_t i = 0; i < parsed.size(); i++)
+            delete parsed[i];
+        entries.clear();
+        parsed.clear();
+    }
+
+    bool node::read_recover_batch(log_index_t index,
+                                  log_index_t to,
+                                  std::vector<log_entry *> &entries)
+    {
+        if (index > to)
+            return true;
+
+        if (!log_manager_->read(index,
+                                __RECOVER_BATCH_BYTES__,
+                                __10000__,
+                                entries))
+        {
+            logger_error("log_manager read error.index(%llu)", index);
+            return false;
+        }
+
+        //not committed
+        while (entries.size() && entries.back()->index() > to)
+        {
+            delete entries.back();
+            entries.pop_back();
+        }
+        if (entries.empty() || entries.front()->index() != index)
+        {
+            logger_error("log_manager read error.index(%llu)", index);
+            return false;
+        }
+        return true;
+    }
+
+    bool node::recover(recover_callback &callback,
+                       log_index_t index,
+                       int threads)
+    {
+        log_index_t to = committed_index();
+
+        if (index > to)
+        {
+            logger_error("index(%llu) > committed_index(%llu)", index, to);
+            return false;
+        }
+        if (threads < 1)
+            threads = 1;
+
+        logger("recover from %llu to %llu.threads:%d", index, to, threads);
+
+        /*
+         * two batches with stable storage.workers parse one batch
+         * by reference while the other one is applied, so batches
+         * are never swapped or moved under running workers
+         */
+        std::vector<log_entry *> entries[2];
+        recover_worker::parsed_t parsed[2];
+        std::vector<recover_worker *> workers;
+        log_index_t ahead = 0;
+        int cur = 0;
+        bool ok = true;
+
+        log_manager_->read_ahead(index + 1);
+        if (!read_recover_batch(index + 1, to, entries[cur]))
+            return false;
+        start_recover_workers(callback,
+                              entries[cur],
+                              parsed[cur],
+                              workers,
+                              threads);
+
+        while (entries[cur].size())
+        {
+            int next = !cur;
+            bool read_ok = true;
+            log_index_t applied = 0;
+
+            wait_recover_workers(workers);
+
+            /*
+             * read next batch and parse it, while entries of
+             * this batch are applied
+             */
+            log_index_t last = entries[cur].back()->index();
+            if (last > ahead)
+            {
+                log_infos_t log_infos = log_manager_->logs_info();
+                log_infos_iter_t it = log_infos.upper_bound(last + 1);
+                if (it != log_infos.begin())
+                {
+                    --it;
+                    if (it->second > last)
+                    {
+                        log_manager_->read_ahead(last + 1);
+                        ahead = it->second;
+                    }
+                }
+            }
+            if (!read_recover_batch(last + 1, to, entries[next]))
+            {
+                read_ok = false;
+            }
+            else
+            {
+                start_recover_workers(callback,
+                                      entries[next],
+                                      parsed[next],
+                                      workers,
+                                      threads);
+            }
+
+            for (size_t i = 0; ok && i < entries[cur].size(); i++)
+            {
+                version ver(entries[cur][i]->index(),
+                            entries[cur][i]->term());
+
+                if (!parsed[cur][i] ||
+                    !callback.apply(parsed[cur][i], ver))
+                {
+                    logger_error("recover apply error.index(%llu)",
+                                 ver.index_);
+                    ok = false;
+                    break;
+                }
+                applied = ver.index_;
+            }
+            free_recover_batch(entries[cur], parsed[cur]);
+
+            /*
+             * update applied index once a batch.if apply failed in
+             * the batch, entries before it are applied still
+             */
+            if (applied)
+                set_applied_index(applied);
+
+            if (!ok || !read_ok)
+            {
+                wait_recover_workers(workers);
+                free_recover_batch(entries[next], parsed[next]);
+                return false;
+            }
+
+            cur = next;
+        }
+
+        logger("recover done.applied_index(%llu)", applied_index());
+        return applied_index() == to;
+    }
+
     bool node::is_leader()
     {
         acl::lock_guard lg(metadata_locker_);
@@ -198,6 +534,11 @@ namespace raft
         load_snapshot_callback_ = callback;
     }
 
+    void node::set_snapshot_sink(snapshot_sink *sink)
+    {
+        snapshot_sink_ = sink;
+    }
+
     void node::set_apply_callback(apply_callback *callback)
     {
         apply_callback_ = callback;
@@ -208,6 +549,7 @@ namespace raft
         acl::lock_guard lg(metadata_locker_);
         snapshot_path_ = path;
         append_slash(snapshot_path_);
+        load_snapshot_catalog();
         load_last_snapshot_info();
     }
 
@@ -238,26 +580,32 @@ namespace raft
         acl_assert(mini_log_count_);
     }
 
+    void node::set_max_log_bytes(size_t bytes)
+    {
+        max_log_bytes_ = bytes;
+    }
+
+    void node::set_compaction_keep_entries(log_index_t count)
+    {
+        compaction_keep_entries_ = count;
+    }
+
+    void node::set_compaction_peer_lag(log_index_t count)
+    {
+        compaction_peer_lag_ = count;
+    }
+
+    void node::set_max_replay_entries(log_index_t count)
+    {
+        max_replay_entries_ = count;
+    }
+
     void node::load_last_snapshot_info()
     {
-        std::string file_path = get_snapshot();
+        version ver;
 
-        if (!file_path.empty())
+        if (get_snapshot_version(ver))
         {
-            version ver;
-            acl::ifstream file;
-            if (!file.open_read(file_path.c_str()))
-            {
-                logger_fatal("open_read error."
-                             "file path%s",
-                             file_path.c_str());
-                return;
-            }
-            if (!raft::read(file, ver))
-            {
-                logger_fatal("read version error");
-                return;
-            }
             set_last_snapshot_index(ver.index_);
             set_last_snapshot_term(ver.term_);
         }
@@ -273,12 +621,158 @@ namespace raft
         return node_id_;
     }
 
+    void node::set_election_timeout(unsigned int milliseconds)
+    {
+        acl::lock_guard lg(metadata_locker_);
+        election_timeout_ = milliseconds;
+    }
+
+    void node::set_heartbeat_interval(unsigned int milliseconds)
+    {
+        acl::lock_guard lg(metadata_locker_);
+        heartbeat_interval_ = milliseconds;
+    }
+
+    void node::set_adaptive_timing(bool enable)
+    {
+        acl::lock_guard lg(metadata_locker_);
+        adaptive_timing_ = enable;
+    }
+
+    bool node::adaptive_timing()
+    {
+        acl::lock_guard lg(metadata_locker_);
+        return adaptive_timing_;
+    }
+
+    void node::set_min_election_timeout(unsigned int milliseconds)
+    {
+        acl::lock_guard lg(metadata_locker_);
+        min_election_timeout_ = milliseconds;
+    }
+
+    void node::set_snapshot_chunk_size(size_t bytes)
+    {
+        acl::lock_guard lg(metadata_locker_);
+        snapshot_chunk_size_ = bytes;
+    }
+
+    void node::set_snapshot_inflight(int count)
+    {
+        acl::lock_guard lg(metadata_locker_);
+        snapshot_inflight_ = count;
+    }
+
+    void node::set_snapshot_rate(unsigned long long bytes_per_sec)
+    {
+        snapshot_scheduler_.set_rate(bytes_per_sec);
+    }
+
+    void node::set_max_snapshot_transfers(int count)
+    {
+        snapshot_scheduler_.set_max_transfers(count);
+    }
+
+    void node::set_compress_snapshot_transfer(bool enable)
+    {
+        acl::lock_guard lg(metadata_locker_);
+        compress_snapshot_transfer_ = enable;
+    }
+
+    size_t node::snapshot_chunk_size()
+    {
+        acl::lock_guard lg(metadata_locker_);
+        return snapshot_chunk_size_ ? snapshot_chunk_size_ : __1MB__;
+    }
+
+    int node::snapshot_inflight()
+    {
+        acl::lock_guard lg(metadata_locker_);
+        return snapshot_inflight_ > 0 ? snapshot_inflight_ : 1;
+    }
+
+    bool node::compress_snapshot_transfer()
+    {
+        acl::lock_guard lg(metadata_locker_);
+        return compress_snapshot_transfer_;
+    }
+
+    unsigned int node::election_timeout()
+    {
+        acl::lock_guard lg(metadata_locker_);
+        if (adaptive_timing_ && adaptive_election_timeout_)
+            return adaptive_election_timeout_;
+        return election_timeout_;
+    }
+
+    unsigned int node::heartbeat_interval()
+    {
+        unsigned int interval = election_timeout() / 3;
+
+        acl::lock_guard lg(metadata_locker_);
+        if (heartbeat_interval_ && heartbeat_interval_ < interval)
+            interval = heartbeat_interval_;
+
+        return interval ? interval : 1;
+    }
+
+    void node::set_adaptive_election_timeout(unsigned int milliseconds)
+    {
+        acl::lock_guard lg(metadata_locker_);
+        if (!adaptive_timing_)
+            return;
+
+        if (milliseconds < min_election_timeout_)
+            milliseconds = min_election_timeout_;
+        if (milliseconds > election_timeout_)
+            milliseconds = election_timeout_;
+
+        if (adaptive_election_timeout_ != milliseconds)
+        {
+            logger_debug(ELECTION_SECTION, 2,
+                         "adaptive election timeout %u",
+                         milliseconds);
+        }
+        adaptive_election_timeout_ = milliseconds;
+    }
+
+    void node::update_election_timeout()
+    {
+        long long max_rtt = 0;
+
+        peers_locker_.lock();
+        std::map<std::string, peer *>::iterator it = peers_.begin();
+        for (; it != peers_.end(); ++it)
+        {
+            long long rtt = it->second->rtt();
+            if (rtt > max_rtt)
+                max_rtt = rtt;
+        }
+        peers_locker_.unlock();
+
+        if (!max_rtt)
+            return;
+
+        /*
+         * election timeout must be far bigger than RTT to the slowest
+         * peer,otherwise heartbeat can't arrive in time.
+         */
+        set_adaptive_election_timeout(
+            static_cast<unsigned int>(max_rtt * __RTT_ELECTION_FACTOR__));
+    }
+
     bool node::is_candidate()
     {
         acl::lock_guard lg(metadata_locker_);
         return role_ == E_CANDIDATE;
     }
 
+    bool node::is_pre_candidate()
+    {
+        acl::lock_guard lg(metadata_locker_);
+        return role_ == E_PRE_CANDIDATE;
+    }
+
     raft::term_t node::current_term()
     {
         return metadata_->get_current_term();
@@ -320,6 +814,12 @@ namespace raft
         leader_id_ = leader_id;
     }
 
+    void node::update_leader_contact_time()
+    {
+        acl::lock_guard lg(metadata_locker_);
+        gettimeofday(&leader_contact_time_, NULL);
+    }
+
     void node::set_current_term(term_t term)
     {
         logger_debug(ELECTION_SECTION, 2, "set term to %llu", term);
@@ -348,6 +848,8 @@ namespace raft
             return "CANDIDATE";
         else if (role() == E_LEADER)
             return "LEADER";
+        else if (role() == E_PRE_CANDIDATE)
+            return "PRE_CANDIDATE";
         return "ERROR role";
     }
 
@@ -375,10 +877,20 @@ namespace raft
     {
         logger_debug(ELECTION_SECTION, 2, "set role to %s",
                      _role == E_CANDIDATE ? "candidate" :
-                     (_role == E_FOLLOWER ? "follower" : "leader"));
+                     (_role == E_FOLLOWER ? "follower" :
+                     (_role == E_LEADER ? "leader" : "pre-candidate")));
+
+        acl::lock_guard lg(metadata_locker_);
+        role_ = _role;
+    }
 
+    bool node::compare_and_set_role(int expect, int _role)
+    {
         acl::lock_guard lg(metadata_locker_);
+        if (role_ != expect)
+            return false;
         role_ = _role;
+        return true;
     }
 
     log_index_t node::applied_index()
@@ -405,6 +917,9 @@ namespace raft
 
         if (!metadata_->set_applied_index(index))
             logger_fatal("metadata set_applied_index");
+
+        if (should_checkpoint())
+            async_compaction_log();
     }
     raft::term_t node::last_log_term()const
     {
@@ -418,14 +933,46 @@ namespace raft
         return log_manager_->last_index();
     }
 
-    bool node::build_replicate_log_request(
+    void node::build_heartbeat_request(
         replicate_log_entries_request &request,
-        log_index_t index,
-        int entry_size)
+        log_index_t match_index)
     {
         request.set_term(current_term());
         request.set_leader_id(node_id());
         request.set_leader_commit(committed_index());
+        request.set_prev_log_index(0);
+        request.set_prev_log_term(0);
+
+        /*
+         * prev log is the entry the peer already matches. if it is
+         * compacted away, the peer is behind the snapshot and
+         * prev log stays 0.
+         */
+        if (match_index && match_index == last_snapshot_index())
+        {
+            request.set_prev_log_index(match_index);
+            request.set_prev_log_term(last_snapshot_term());
+        }
+        else if (match_index && match_index >= start_log_index())
+        {
+            log_entry entry;
+            if (log_manager_->read(match_index, entry))
+            {
+                request.set_prev_log_index(entry.index());
+                request.set_prev_log_term(entry.term());
+            }
+        }
+
+        if (adaptive_timing())
+            request.set_election_timeout(election_timeout());
+    }
+
+    bool node::build_replicate_log_request(
+        replicate_log_entries_request &request,
+        log_index_t index,
+        int entry_size)
+    {
+        build_heartbeat_request(request, 0);
 
         if (!entry_size)
             entry_size = __10000__;
@@ -574,6 +1121,51 @@ namespace raft
         logger_debug(2, 2, "req.term = %lu", req.term());
     }
 
+    void node::build_pre_vote_request(vote_request &req)
+    {
+        build_vote_request(req);
+        /*
+         * pre-vote for the term this node would use in election,
+         * without increasing current term.
+         */
+        req.set_term(current_term() + 1);
+    }
+
+    bool node::is_log_up_to_date(log_index_t index, term_t term)
+    {
+        /*
+         * If the logs have last entries with different terms, then
+         * the log with the later term is more up-to-date. If the logs
+         * end with the same term, then whichever log is longer is
+         * more up-to-date. (5.4.1)
+         */
+        term_t _last_log_term = last_log_term();
+
+        if (term != _last_log_term)
+            return term > _last_log_term;
+
+        return index >= last_log_index();
+    }
+
+    bool node::leader_alive()
+    {
+        if (is_leader())
+            return true;
+
+        acl::lock_guard lg(metadata_locker_);
+        if (leader_id_.empty())
+            return false;
+
+        timeval now;
+        gettimeofday(&now, NULL);
+
+        long long elapsed =
+            (now.tv_sec - leader_contact_time_.tv_sec) * 1000 +
+            (now.tv_usec - leader_contact_time_.tv_usec) / 1000;
+
+        return elapsed < election_timeout();
+    }
+
     int node::peers_count()
     {
         acl::lock_guard lg(peers_locker_);
@@ -584,6 +1176,7 @@ namespace raft
     {
         acl::lock_guard lg(vote_responses_locker_);
         vote_responses_.clear();
+        pre_vote_responses_.clear();
     }
 
     void node::vote_response_callback(
@@ -624,17 +1217,25 @@ namespace raft
             return;
         }
 
-        if (role() != E_CANDIDATE)
-        {
-            logger("handle vote_response, but not candidate");
-            return;
-        }
-
         int nodes = peers_count() + 1;//+1 for myself
         int votes = 1;//myself
 
         vote_responses_locker_.lock();
 
+        /*
+         * check role and term under the lock, clear_vote_response
+         * of a new round can't slip in between and let an old
+         * response be counted in the new round
+         */
+        if (role() != E_CANDIDATE ||
+            response.term() != current_term())
+        {
+            vote_responses_locker_.unlock();
+            logger("handle vote_response, but not candidate "
+                   "of term(%lu)", response.term());
+            return;
+        }
+
         vote_responses_[peer_id] = response;
         std::map<std::string, vote_response>::iterator
                 it = vote_responses_.begin();
@@ -660,11 +1261,88 @@ namespace raft
         }
     }
 
+    void node::pre_vote_response_callback(
+        const std::string &peer_id,
+        const vote_response &response)
+    {
+        logger_debug(NODE_SECTION, 10,
+                     "term(%lu) "
+                     "current_term(%llu) "
+                     "vote_granted:%d ",
+                     response.term(),
+                     current_term(),
+                     response.vote_granted());
+
+        if (response.term() > current_term() &&
+            !response.vote_granted())
+        {
+            logger("pre-vote resp.term(%lu) > current_term(%llu). "
+                   "step_down",
+                   response.term(),
+                   current_term());
+
+            set_current_term(response.term());
+            step_down();
+            return;
+        }
+
+        int nodes = peers_count() + 1;//+1 for myself
+        int votes = 1;//myself
+        bool elect = false;
+
+        vote_responses_locker_.lock();
+
+        /*
+         * pre-votes are kept apart from real votes, so a late
+         * pre-vote grant is never counted in the election
+         */
+        if (role() != E_PRE_CANDIDATE)
+        {
+            vote_responses_locker_.unlock();
+            logger_debug(NODE_SECTION, 10,
+                         "handle pre-vote response, "
+                         "but not pre-candidate");
+            return;
+        }
+
+        pre_vote_responses_[peer_id] = response;
+        vote_responses_t::iterator it = pre_vote_responses_.begin();
+
+        for (; it != pre_vote_responses_.end(); ++it)
+        {
+            if (it->second.vote_granted())
+            {
+                votes++;
+            }
+        }
+
+        /*
+         * majority of nodes would vote for this node.
+         * it is safe to increase term and start real election now.
+         * only the response that moves pre-candidate to candidate
+         * starts the election, so the term is increased once.
+         */
+        if (votes > nodes / 2)
+            elect = compare_and_set_role(E_PRE_CANDIDATE, E_CANDIDATE);
+
+        vote_responses_locker_.unlock();
+
+        logger_debug(ELECTION_SECTION, 2, "pre-votes:%d", votes);
+
+        if (elect)
+        {
+            start_election();
+        }
+    }
+
     void node::become_leader()
     {
         logger_debug(1, 2, "trace");
 
-        cancel_election_timer();
+        /*
+         * leader keep election timer to check quorum
+         */
+        set_check_quorum_timer();
 
         set_role(E_LEADER);
 
@@ -693,69 +1371,605 @@ namespace raft
 
     std::string node::get_snapshot() const
     {
-        std::map<log_index_t, std::string>
-            snapshot_files_ = scan_snapshots();
+        acl::lock_guard lg(snapshot_catalog_locker_);
 
-        if (snapshot_files_.size())
+        if (snapshot_chain_.size())
         {
-            return snapshot_files_.rbegin()->second;
+            return snapshot_chain_.back();
         }
         return std::string();
     }
 
-    std::map<log_index_t, std::string>
-        node::scan_snapshots() const
+    std::vector<std::string> node::get_snapshot_chain() const
+    {
+        acl::lock_guard lg(snapshot_catalog_locker_);
+        return snapshot_chain_;
+    }
+
+    bool node::get_snapshot_version(version &ver,
+                                    std::vector<std::string> *chain) const
+    {
+        acl::lock_guard lg(snapshot_catalog_locker_);
+
+        if (snapshot_chain_.empty())
+            return false;
+
+        if (chain)
+            *chain = snapshot_chain_;
+
+        //head of chain.it is the latest one unless chain is broken
+        for (snapshot_files_t::reverse_iterator
+                     it = snapshot_catalog_.rbegin();
+             it != snapshot_catalog_.rend(); ++it)
+        {
+            if (it->second.path_ == snapshot_chain_.back())
+            {
+                ver = it->second.ver_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void node::update_snapshot_chain() const
+    {
+        snapshot_files_t &files = snapshot_catalog_;
+        std::vector<std::string> &chain = snapshot_chain_;
+
+        /*
+         * walk from the latest snapshot back to its full snapshot.
+         * try older one if the chain is broken
+         */
+        for (snapshot_files_t::reverse_iterator it = files.rbegin();
+             it != files.rend(); ++it)
+        {
+            const snapshot_file *file = &it->second;
+
+            chain.clear();
+            while (file)
+            {
+                chain.push_back(file->path_);
+                if (!file->base_.index_)
+                    break;
+
+                snapshot_files_t::iterator base =
+                    files.find(file->base_.index_);
+
+                if (base == files.end() ||
+                    base->second.ver_.term_ != file->base_.term_ ||
+                    file->base_.index_ >= file->ver_.index_)
+                {
+                    logger_error("snapshot chain broken.%s",
+                                 file->path_.c_str());
+                    file = NULL;
+                    break;
+                }
+                file = &base->second;
+            }
+            if (file)
+            {
+                std::reverse(chain.begin(), chain.end());
+                return;
+            }
+        }
+        chain.clear();
+    }
+
+    void node::set_max_delta_chain(size_t count)
+    {
+        max_delta_chain_ = count;
+    }
+
+    static std::string get_basename(const std::string &file_path)
     {
+        size_t pos = file_path.find_last_of("/\\");
+
+        if (pos == std::string::npos)
+            return file_path;
+        return file_path.substr(pos + 1);
+    }
 
-        std::map<log_index_t, std::string> snapshots;
+    node::snapshot_files_t node::scan_snapshots(
+        const snapshot_files_t &known) const
+    {
+        snapshot_files_t snapshots;
+        std::map<std::string, const snapshot_file *> names;
         std::set<std::string> files =
             list_dir(snapshot_path_, __SNAPSHOT_EXT__);
+        std::set<std::string> deltas =
+            list_dir(snapshot_path_, __DELTA_EXT__);
+
+        files.insert(deltas.begin(), deltas.end());
 
         if (files.empty())
             return snapshots;
 
+        for (snapshot_files_t::const_iterator it = known.begin();
+             it != known.end(); ++it)
+        {
+            names[get_basename(it->second.path_)] = &it->second;
+        }
+
         for (std::set<std::string>::iterator it = files.begin();
              it != files.end(); ++it)
         {
+            snapshot_file file;
+            std::map<std::string, const snapshot_file *>::iterator
+                name = names.find(get_basename(*it));
+
+            if (name != names.end())
+            {
+                file = *name->second;
+                file.path_ = *it;
+            }
+            else
+            {
+                file.path_ = *it;
+                if (!read_snapshot_version(file.path_,
+                                           file.ver_,
+                                           file.base_))
+                {
+                    logger_error("read snapshot version file.%s",
+                                 file.path_.c_str());
+                    continue;
+                }
+            }
 
-            version ver;
-            acl::ifstream file;
-            const char *file_path = it->c_str();
+            //full snapshot win a delta snapshot with the same index
+            snapshot_files_t::iterator exist =
+                snapshots.find(file.ver_.index_);
+            if (exist != snapshots.end() &&
+                !exist->second.base_.index_ &&
+                file.base_.index_)
+                continue;
 
-            if (!file.open_read(file_path))
+            snapshots[file.ver_.index_] = file;
+        }
+        return snapshots;
+    }
+
+    void node::load_snapshot_catalog()
+    {
+        acl::lock_guard lg(snapshot_catalog_locker_);
+
+        snapshot_files_t manifest;
+        if (!read_snapshot_manifest(manifest))
+            logger("snapshot manifest not found. scan snapshot path");
+
+        snapshot_catalog_ = scan_snapshots(manifest);
+        update_snapshot_chain();
+
+        bool changed = manifest.size() != snapshot_catalog_.size();
+        for (snapshot_files_t::iterator it = snapshot_catalog_.begin();
+             !changed && it != snapshot_catalog_.end(); ++it)
+        {
+            snapshot_files_t::iterator file = manifest.find(it->first);
+            changed = file == manifest.end() ||
+                get_basename(file->second.path_) !=
+                get_basename(it->second.path_);
+        }
+        if (changed)
+            save_snapshot_catalog();
+
+        logger("load snapshot catalog.files:%zd chain:%zd",
+               snapshot_catalog_.size(),
+               snapshot_chain_.size());
+    }
+
+    bool node::read_snapshot_manifest(snapshot_files_t &files) const
+    {
+        std::string file_path = snapshot_path_ + __SNAPSHOT_MANIFEST__;
+        acl::ifstream file;
+        std::string magic;
+        unsigned int count = 0;
+
+        if (!file.open_read(file_path.c_str()))
+            return false;
+
+        if (!raft::read(file, magic) ||
+            magic != __SNAPSHOT_MANIFEST_MAGIC__ ||
+            !raft::read(file, count))
+        {
+            logger_error("snapshot manifest error.%s", file_path.c_str());
+            return false;
+        }
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            snapshot_file item;
+            std::string name;
+            std::string buffer;
+            snapshot_info info;
+
+            if (!raft::read(file, name) ||
+                !raft::read(file, buffer) ||
+                !info.ParseFromString(buffer))
             {
-                logger_error("open file error.%s",
+                logger_error("snapshot manifest error.%s",
+                             file_path.c_str());
+                files.clear();
+                return false;
+            }
+            item.path_ = snapshot_path_ + name;
+            item.ver_ = version(info.last_snapshot_index(),
+                                info.last_included_term());
+            item.base_ = version(info.base_snapshot_index(),
+                                 info.base_included_term());
+            files[item.ver_.index_] = item;
+        }
+        return true;
+    }
+
+    bool node::save_snapshot_catalog() const
+    {
+        std::string file_path = snapshot_path_ + __SNAPSHOT_MANIFEST__;
+        std::string tmp_path = file_path + "_tmp";
+        acl::ofstream file;
+
+        if (!file.open_trunc(tmp_path.c_str()))
+        {
+            logger_error("open_trunc %s error.%s",
+                         tmp_path.c_str(),
+                         acl::last_serror());
+            return false;
+        }
+
+        std::string magic = __SNAPSHOT_MANIFEST_MAGIC__;
+        bool ok = raft::write(file, magic) &&
+            raft::write(file, (unsigned int) snapshot_catalog_.size());
+
+        for (snapshot_files_t::const_iterator it = snapshot_catalog_.begin();
+             ok && it != snapshot_catalog_.end(); ++it)
+        {
+            const snapshot_file &item = it->second;
+            snapshot_info info;
+
+            info.set_last_snapshot_index(item.ver_.index_);
+            info.set_last_included_term(item.ver_.term_);
+            info.set_base_snapshot_index(item.base_.index_);
+            info.set_base_included_term(item.base_.term_);
+
+            ok = raft::write(file, get_basename(item.path_)) &&
+                raft::write(file, info.SerializeAsString());
+        }
+        ok = ok && file.fflush();
+        file.close();
+
+        //replace old manifest at once
+        if (!ok || rename(tmp_path.c_str(), file_path.c_str()) != 0)
+        {
+            logger_error("save snapshot manifest error.%s",
+                         acl::last_serror());
+            remove(tmp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void node::add_snapshot_file(const snapshot_file &file) const
+    {
+        acl::lock_guard lg(snapshot_catalog_locker_);
+
+        snapshot_files_t::iterator exist =
+            snapshot_catalog_.find(file.ver_.index_);
+
+        //full snapshot win a delta snapshot with the same index
+        if (exist != snapshot_catalog_.end() &&
+            !exist->second.base_.index_ &&
+            file.base_.index_)
+            return;
+
+        snapshot_catalog_[file.ver_.index_] = file;
+        update_snapshot_chain();
+        save_snapshot_catalog();
+    }
+
+    bool node::add_snapshot_file(const std::string &file_path) const
+    {
+        snapshot_file file;
+
+        file.path_ = file_path;
+        if (!read_snapshot_version(file_path, file.ver_, file.base_))
+        {
+            logger_error("read snapshot version error.%s",
+                         file_path.c_str());
+            return false;
+        }
+        add_snapshot_file(file);
+        return true;
+    }
+
+    std::string node::get_install_snapshot()
+    {
+        std::vector<std::string> chain;
+        version ver;
+
+        if (!get_snapshot_version(ver, &chain))
+            return std::string();
+
+        if (chain.size() == 1)
+            return chain[0];
+
+        acl::string file_path = snapshot_path_.c_str();
+        file_path.format_append("%llu.%llu" __CHAIN_EXT__,
+                                ver.index_,
+                                ver.term_);
+
+        //peers share the chain file
+        acl::lock_guard lg(snapshot_locker_);
+
+        acl::ifstream exist;
+        if (exist.open_read(file_path.c_str()))
+            return file_path.c_str();
+
+        /*
+         * chain file: head of the latest snapshot with count of
+         * files, and then size and data of each file
+         */
+        std::string tmp_path = file_path.c_str();
+        tmp_path += "_tmp";
+
+        acl::ofstream file;
+        if (!file.open_trunc(tmp_path.c_str()))
+        {
+            logger_error("open_trunc %s error.%s",
+                         tmp_path.c_str(),
+                         acl::last_serror());
+            return std::string();
+        }
+
+        snapshot_info info;
+        info.set_last_snapshot_index(ver.index_);
+        info.set_last_included_term(ver.term_);
+        info.set_chain_files((unsigned int) chain.size());
+
+        bool ok = write(file, info);
+        std::string buffer;
+        buffer.resize(__1MB__);
+
+        for (size_t i = 0; ok && i < chain.size(); i++)
+        {
+            acl::ifstream snapshot;
+            if (!snapshot.open_read(chain[i].c_str()))
+            {
+                logger_error("open_read %s error", chain[i].c_str());
+                ok = false;
+                break;
+            }
+
+            unsigned char size[sizeof(long long)];
+            unsigned char *ptr = size;
+            long long remain = snapshot.fsize();
+
+            put_uint64(ptr, (unsigned long long) remain);
+            ok = file.write(size, sizeof(size)) == sizeof(size);
+
+            while (ok && remain > 0)
+            {
+                int len = snapshot.read((char *) buffer.data(),
+                                        buffer.size(),
+                                        false);
+                if (len <= 0 || file.write(buffer.data(), len) != len)
+                {
+                    logger_error("copy %s error.%s",
+                                 chain[i].c_str(),
+                                 acl::last_serror());
+                    ok = false;
+                    break;
+                }
+                remain -= len;
+            }
+        }
+        file.close();
+
+        if (!ok || rename(tmp_path.c_str(), file_path.c_str()) != 0)
+        {
+            logger_error("make snapshot chain file error.%s",
+                         file_path.c_str());
+            remove(tmp_path.c_str());
+            return std::string();
+        }
+        logger("make snapshot chain file %s. files:%zd",
+               file_path.c_str(),
+               chain.size());
+
+        return file_path.c_str();
+    }
+
+    bool node::split_snapshot_chain(unsigned int count,
+                                    std::vector<std::string> &files)
+    {
+        std::string buffer;
+        buffer.resize(__1MB__);
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            unsigned char size[sizeof(long long)];
+            unsigned char *ptr = size;
+
+            if (snapshot_tmp_->read(size, sizeof(size)) != sizeof(size))
+            {
+                logger_error("read snapshot chain error");
+                return false;
+            }
+            long long remain = (long long) get_uint64(ptr);
+
+            std::string tmp_path = snapshot_path_;
+            tmp_path += "chain_part_tmp";
+
+            acl::ofstream file;
+            if (!file.open_trunc(tmp_path.c_str()))
+            {
+                logger_error("open_trunc %s error.%s",
+                             tmp_path.c_str(),
                              acl::last_serror());
-                continue;
+                return false;
             }
-            if (!raft::read(file, ver))
+            while (remain > 0)
             {
-                logger_error("read snapshot version file.%s",
-                             file_path);
-                file.close();
-                continue;
+                size_t len = buffer.size();
+                if (remain < (long long) len)
+                    len = (size_t) remain;
+
+                if (snapshot_tmp_->read((char *) buffer.data(), len) !=
+                    (int) len ||
+                    file.write(buffer.data(), len) != (int) len)
+                {
+                    logger_error("split snapshot chain error.%s",
+                                 acl::last_serror());
+                    file.close();
+                    remove(tmp_path.c_str());
+                    return false;
+                }
+                remain -= len;
             }
             file.close();
-            snapshots[ver.index_] = file_path;
+
+            version ver, base;
+            if (!read_snapshot_version(tmp_path, ver, base))
+            {
+                remove(tmp_path.c_str());
+                return false;
+            }
+
+            acl::string file_path = snapshot_path_.c_str();
+            file_path.format_append("%llu.%llu%s",
+                                    ver.index_,
+                                    ver.term_,
+                                    base.index_ ?
+                                    __DELTA_EXT__ : __SNAPSHOT_EXT__);
+
+            if (rename(tmp_path.c_str(), file_path.c_str()) != 0)
+            {
+                logger_error("rename %s error.%s",
+                             file_path.c_str(),
+                             acl::last_serror());
+                return false;
+            }
+            files.push_back(file_path.c_str());
         }
-        return snapshots;
+        return true;
     }
 
     bool node::should_compact_log()
     {
-        if (log_manager_->log_count() > max_log_count_)
+        size_t count = log_manager_->log_count();
+        if (count > max_log_count_)
         {
             logger_debug(NODE_SECTION, 10,
                          "log count(%lu) "
                          "max_log_size_(%lu)",
-                         log_manager_->log_count(),
+                         count,
                          max_log_count_);
 
             return true;
         }
+        size_t bytes = max_log_bytes_ ? log_manager_->log_bytes() : 0;
+        if (bytes > max_log_bytes_)
+        {
+            logger_debug(NODE_SECTION, 10,
+                         "log bytes(%lu) "
+                         "max_log_bytes_(%lu)",
+                         bytes,
+                         max_log_bytes_);
+
+            return true;
+        }
         return false;
     }
 
+    bool node::should_checkpoint()
+    {
+        if (!max_replay_entries_ || !make_snapshot_callback_)
+            return false;
+
+        log_index_t index = applied_index();
+        {
+            acl::lock_guard lg(checkpoint_locker_);
+            if (index < checkpoint_check_index_)
+                return false;
+        }
+
+        version ver;
+        if (!get_snapshot_version(ver))
+            ver.index_ = 0;
+
+        if (index > ver.index_ + max_replay_entries_)
+            return true;
+
+        /*
+         * snapshot index never goes back. it can't be true
+         * before applied index passes this one
+         */
+        acl::lock_guard lg(checkpoint_locker_);
+        checkpoint_check_index_ = ver.index_ + max_replay_entries_ + 1;
+        return false;
+    }
+
+    void node::checkpoint_backoff()
+    {
+        acl::lock_guard lg(checkpoint_locker_);
+        checkpoint_check_index_ = applied_index() + max_replay_entries_;
+    }
+
+    bool node::log_compacted()
+    {
+        //delete half of logs
+        if (log_manager_->log_count() > mini_log_count_)
+            return false;
+
+        return !max_log_bytes_ ||
+            log_manager_->log_bytes() <= max_log_bytes_ / 2;
+    }
+
+    log_index_t node::get_compaction_index(log_index_t snapshot_index)
+    {
+        log_index_t index = std::min(snapshot_index, applied_index());
+
+        //keep trailing entries
+        if (index > compaction_keep_entries_)
+            index -= compaction_keep_entries_;
+        else
+            index = 0;
+
+        if (!is_leader() || !compaction_peer_lag_)
+            return index;
+
+        /*
+         * peers close behind catch up by log replication.
+         * peers far behind need snapshot anyway
+         */
+        log_index_t last_index = last_log_index();
+        std::vector<log_index_t> match_indexs = get_peers_match_index();
+
+        for (size_t i = 0; i < match_indexs.size(); i++)
+        {
+            log_index_t match_index = match_indexs[i];
+            if (match_index + compaction_peer_lag_ >= last_index &&
+                match_index < index)
+            {
+                index = match_index;
+            }
+        }
+        return index;
+    }
+
+    int node::discard_logs(log_index_t index)
+    {
+        int count = 0;
+        log_infos_t log_infos = log_manager_->logs_info();
+        log_infos_iter_t it = log_infos.begin();
+
+        for (; it != log_infos.end() && !log_compacted(); ++it)
+        {
+            //log has entries not to discard
+            if (it->second > index)
+                break;
+            count += log_manager_->discard_log(it->second);
+        }
+        return count;
+    }
+
     void node::async_compaction_log()
     {
         log_compaction_worker_.do_compact_log();
@@ -763,20 +1977,63 @@ namespace raft
 
     void node::remove_old_snapshot() const
     {
-        std::map<log_index_t, std::string>
-            snapshot_files_ = scan_snapshots();
+        std::vector<std::string> chain;
+        std::set<std::string> removes;
+        size_t snapshots = 0;
 
-        while (snapshot_files_.size() > max_snapshot_size_)
+        snapshot_catalog_locker_.lock();
+        chain = snapshot_chain_;
+        std::set<std::string> keep(chain.begin(), chain.end());
+
+        /*
+         * keep files of current chain and the latest
+         * max_snapshot_size_ full snapshots
+         */
+        for (snapshot_files_t::reverse_iterator
+                     it = snapshot_catalog_.rbegin();
+             it != snapshot_catalog_.rend(); ++it)
+        {
+            const snapshot_file &file = it->second;
+            if (!file.base_.index_ && snapshots < max_snapshot_size_)
+            {
+                snapshots++;
+                continue;
+            }
+            if (!keep.count(file.path_))
+                removes.insert(file.path_);
+        }
+        for (snapshot_files_t::iterator it = snapshot_catalog_.begin();
+             it != snapshot_catalog_.end();)
         {
-            const char *file_path =
-                snapshot_files_.begin()->second.c_str();
+            if (removes.count(it->second.path_))
+                snapshot_catalog_.erase(it++);
+            else
+                ++it;
+        }
+        //manifest is saved before files are removed
+        if (removes.size())
+            save_snapshot_catalog();
+        snapshot_catalog_locker_.unlock();
 
-            if (remove(file_path) != 0)
+        //chain file of current chain only
+        std::string head = chain.size() ? get_filename(chain.back()) : "";
+        std::set<std::string> chains =
+            list_dir(snapshot_path_, __CHAIN_EXT__);
+        for (std::set<std::string>::iterator it = chains.begin();
+             it != chains.end(); ++it)
+        {
+            if (get_filename(*it) != head)
+                removes.insert(*it);
+        }
+
+        for (std::set<std::string>::iterator it = removes.begin();
+             it != removes.end(); ++it)
+        {
+            if (remove(it->c_str()) != 0)
             {
                 logger_warn("delete snapshot file error. "
-                            "file_path(%s)", file_path);
+                            "file_path(%s)", it->c_str());
             }
-            snapshot_files_.erase(snapshot_files_.begin());
         }
     }
     bool node::make_snapshot() const
@@ -788,7 +2045,33 @@ namespace raft
         logger_debug(NODE_SECTION, 10,
                      "start make_snapshot_callback()");
 
-        if (!(*make_snapshot_callback_)(snapshot_path_, file_path))
+        bool ok = false;
+        snapshot_view *view = make_snapshot_callback_->capture();
+        if (view)
+        {
+            /*
+             * write delta snapshot based on the latest snapshot
+             * until chain is full, and then write full snapshot
+             */
+            std::vector<std::string> chain;
+            version head;
+
+            if (max_delta_chain_ &&
+                get_snapshot_version(head, &chain) &&
+                chain.size() <= max_delta_chain_)
+            {
+                ok = view->write_delta(snapshot_path_, head, file_path);
+            }
+            if (!ok)
+                ok = view->write(snapshot_path_, file_path);
+            delete view;
+        }
+        else
+        {
+            ok = (*make_snapshot_callback_)(snapshot_path_, file_path);
+        }
+
+        if (!ok)
         {
             logger_error("make_snapshot error.path:%s",
                          snapshot_path_.c_str());
@@ -798,19 +2081,40 @@ namespace raft
         logger_debug(NODE_SECTION, 10,
                      "make_snapshot_callback() done");
 
-        std::string snapshot_file = file_path;
+        version ver, base;
+        if (!read_snapshot_version(file_path, ver, base))
+        {
+            logger_error("snapshot file error.%s", file_path.c_str());
+            remove(file_path.c_str());
+            return false;
+        }
+
+        //nothing changed since base
+        if (base.index_ && base.index_ >= ver.index_)
+        {
+            logger("delta snapshot is empty.%s", file_path.c_str());
+            remove(file_path.c_str());
+            return true;
+        }
+
+        const char *ext = base.index_ ? __DELTA_EXT__ : __SNAPSHOT_EXT__;
+        snapshot_file snapshot;
+        snapshot.path_ = file_path;
+        snapshot.ver_ = ver;
+        snapshot.base_ = base;
+
         size_t pos = file_path.find_last_of('.');
         if (pos != file_path.npos)
         {
-            snapshot_file = file_path.substr(0, pos);
-            snapshot_file += __SNAPSHOT_EXT__;
+            snapshot.path_ = file_path.substr(0, pos);
+            snapshot.path_ += ext;
         }
         else
         {
-            snapshot_file += __SNAPSHOT_EXT__;
+            snapshot.path_ += ext;
         }
 
-        if (rename(file_path.c_str(), snapshot_file.c_str()) != 0)
+        if (rename(file_path.c_str(), snapshot.path_.c_str()) != 0)
         {
             logger_error("rename failed."
                          "last error:%s",
@@ -820,87 +2124,59 @@ namespace raft
         }
         logger("make_snapshot done."
                "file path:%s",
-               snapshot_file.c_str());
+               snapshot.path_.c_str());
 
+        add_snapshot_file(snapshot);
         remove_old_snapshot();
 
         return true;
     }
-    void node::do_compaction_log() const
+    void node::do_compaction_log()
     {
         logger_debug(NODE_SECTION, 10,
                      "----do compacting log start ---------");
-        std::string snapshot;
 
-    do_again:
-        snapshot = get_snapshot();
-        if (snapshot.empty())
-        {
-            logger_debug(NODE_SECTION, 10,
-                         "snapshot empty");
+        version ver;
+        int count = 0;
 
-            if (make_snapshot())
+        //checkpoint bounds entries replayed at restart
+        if (should_checkpoint())
+        {
+            logger("make checkpoint.applied_index(%llu)", applied_index());
+            if (!make_snapshot())
             {
-                logger_debug(NODE_SECTION, 10,
-                             "make_snapshot ok. "
-                             "do compacting log again");
-                goto do_again;
+                logger_error("make checkpoint error");
+                checkpoint_backoff();
             }
-            else
-            {
-                logger_error("make_snapshot failed.");
+
+            if (!should_compact_log())
                 return;
-            }
         }
 
-        acl::ifstream	file;
-        if (!file.open_read(snapshot.c_str()))
-        {
-            logger_fatal("open file,error,%s",
-                         snapshot.c_str());
-            return;
-        }
+        if (get_snapshot_version(ver))
+            count = discard_logs(get_compaction_index(ver.index_));
 
-        version ver;
-        if (!raft::read(file, ver))
+        /*
+         * snapshot is too old or not exist. make a new one if
+         * it can discard the oldest log.it is made once at most
+         */
+        if (!count && !log_compacted())
         {
-            logger_fatal("read version error");
-            return;
-        }
-
-        int	count = 0;
-        log_infos_t log_infos = log_manager_->logs_info();
-        log_infos_iter_t it = log_infos.begin();
+            log_infos_t log_infos = log_manager_->logs_info();
+            log_index_t index = get_compaction_index(applied_index());
 
-        for (; it != log_infos.end(); ++it)
-        {
-            /**
-             * ver.index is snapshot last_log_index.
-             *
-             */
-            if (it->second < ver.index_)
-            {
-                count += log_manager_->discard_log(it->second);
-            }
-            //delete half of logs
-            if (log_manager_->log_count() <= mini_log_count_)
-            {
-                break;
-            }
-        }
-        if (!count)
-        {
-            if (make_snapshot())
+            if (log_infos.empty() || log_infos.begin()->second > index)
             {
                 logger_debug(NODE_SECTION, 10,
-                             "make_snapshot ok. "
-                             "do compacting log again");
-                goto do_again;
+                             "logs are kept for peers");
+                return;
             }
-            else
+            if (!make_snapshot() || !get_snapshot_version(ver))
             {
                 logger_error("make snapshot error");
+                return;
             }
+            count = discard_logs(get_compaction_index(ver.index_));
         }
         logger("log_compaction discard %d logs", count);
     }
@@ -916,9 +2192,8 @@ namespace raft
 
     void node::set_election_timer()
     {
-        unsigned int timeout = election_timeout_;
+        unsigned int timeout = election_timeout();
 
-        srand(static_cast<unsigned int>(time(NULL) % 0xffffffff));
         timeout += static_cast<unsigned int>((rand() % timeout)*1.5);
 
         election_timer_.set_timer(timeout);
@@ -934,10 +2209,59 @@ namespace raft
         election_timer_.cancel_timer();
     }
 
+    void node::set_check_quorum_timer()
+    {
+        election_timer_.set_timer(election_timeout());
+    }
+
+    void node::check_quorum()
+    {
+        /*
+         * RTT of peers is folded into election timeout here once
+         * a timeout, not on every response
+         */
+        if (adaptive_timing())
+            update_election_timeout();
+
+        int nodes = peers_count() + 1;//+1 for myself
+        int actives = 1;//myself
+        unsigned int timeout = election_timeout();
+
+        peers_locker_.lock();
+        std::map<std::string, peer *>::iterator it = peers_.begin();
+        for (; it != peers_.end(); ++it)
+        {
+            if (it->second->is_active(timeout))
+                actives++;
+        }
+        peers_locker_.unlock();
+
+        /*
+         * CheckQuorum: leader has not heard from majority of nodes
+         * in election timeout. it maybe partitioned from cluster,
+         * step down to let the majority elect a new leader
+         */
+        if (actives <= nodes / 2)
+        {
+            logger("check quorum failed. "
+                   "actives(%d) nodes(%d). step down",
+                   actives,
+                   nodes);
+            set_leader_id("");
+            step_down();
+            return;
+        }
+        set_check_quorum_timer();
+    }
+
     void node::election_timer_callback()
     {
+        if (is_leader())
+        {
+            check_quorum();
+            return;
+        }
 
-        ///logger("election timer callback");
         /**
          * this node lost heartbeat from leader
          * and it has not leader now.so this node
@@ -946,44 +2270,41 @@ namespace raft
         set_leader_id("");
 
         /**
-         * if log not ok. don't increase term.
+         * Rule For Followers:
+         * If election timeout elapses without receiving AppendEntries
+         * RPC from current leader or granting vote to candidate:
+         * convert to candidate
+         *
+         * do pre-vote first.current term is not increased until
+         * majority of nodes grant pre-vote.so a partitioned node
+         * can't disrupt the cluster by inflating term.
+         * If election timeout elapses: start new pre-vote
          */
-        if(log_ok())
-        {
-            set_current_term(current_term() + 1);
-        }
-
-
         clear_vote_response();
 
-        set_role(E_CANDIDATE);
+        set_role(E_PRE_CANDIDATE);
+
+        notify_peers_to_pre_vote();
 
+        set_election_timer();
+    }
 
+    void node::start_election()
+    {
         /**
-         * Rule For Followers:
-         * If election timeout elapses without receiving AppendEntries
-         * RPC from current leader or granting vote to candidate:
-         * convert to candidate
+         * : conversion to candidate, start election:
+         * : Increment currentTerm
+         * : Vote for self
+         * : Reset election timer
+         * : Send RequestVote RPCs to all other servers
          */
-        if (vote_for().size() && vote_for() != node_id())
-        {
-            set_election_timer();
-            std::string vote = vote_for().c_str();
-            logger("vote_for(%s) is not empty. return", vote.c_str());
+        set_leader_id("");
 
-            ///Give a chance to communicate to each other
-            set_current_term(current_term() + 1);
-            return;
-        }
+        set_current_term(current_term() + 1);
 
-        /**
-        * : conversion to candidate, start election:
-        * : Increment currentTerm
-        * : Vote for self
-        * : Reset election timer
-        * : Send RequestVote RPCs to all other servers
-        * : If election timeout elapses: start new election
-        */
+        clear_vote_response();
+
+        set_role(E_CANDIDATE);
 
         set_vote_for(node_id());
 
@@ -1015,6 +2336,19 @@ namespace raft
         }
     }
 
+    void node::notify_peers_to_pre_vote()
+    {
+        logger_debug(ELECTION_SECTION, 2, "trace");
+
+        acl::lock_guard lg(peers_locker_);
+
+        std::map<std::string, peer *>::iterator it = peers_.begin();
+        for (; it != peers_.end(); ++it)
+        {
+            it->second->notify_pre_vote();
+        }
+    }
+
     void  node::update_peers_next_index(log_index_t index)
     {
         acl::lock_guard lg(peers_locker_);
@@ -1103,6 +2437,68 @@ namespace raft
         return true;
     }
 
+    bool node::handle_pre_vote_request(const vote_request &req,
+                                       vote_response &resp)
+    {
+        resp.set_req_id(req.req_id());
+        resp.set_term(current_term());
+        resp.set_log_ok(false);
+        resp.set_vote_granted(false);
+
+        /*pre-vote term must be greater than current term*/
+        if (req.term() <= current_term())
+        {
+            logger_debug(ELECTION_SECTION, 2,
+                         "pre-vote req.term(%lu) "
+                         "current_term(%llu)",
+                         req.term(),
+                         current_term());
+            return true;
+        }
+
+        /*
+         * this node still hear from leader. don't let
+         * a flapping node disrupt the cluster
+         */
+        if (leader_alive())
+        {
+            logger_debug(ELECTION_SECTION, 2,
+                         "leader(%s) alive. reject pre-vote from %s",
+                         leader_id().c_str(),
+                         req.candidate().c_str());
+            return true;
+        }
+
+        if (is_log_up_to_date(req.last_log_index(), req.last_log_term()))
+        {
+            resp.set_log_ok(true);
+            resp.set_vote_granted(true);
+        }
+        return true;
+    }
+
+    bool node::apply_log_entry(log_index_t index)
+    {
+        log_entry entry;
+        version ver;
+        if (!log_manager_->read(index, entry))
+        {
+            logger_error("read log error");
+            return false;
+        }
+        if (!apply_callback_)
+            return true;
+
+        ver.index_ = entry.index();
+        ver.term_ = entry.term();
+        if (!(*apply_callback_)(entry.log_data(), ver))
+        {
+            logger_error("apply_callback::operator() error");
+            return false;
+        }
+        return true;
+    }
+
     void node::invoke_apply_callbacks()
     {
         log_index_t committed = committed_index();
@@ -1110,22 +2506,9 @@ namespace raft
         for (log_index_t index = applied_index() + 1;
              index <= committed; ++index)
         {
-            log_entry entry;
-            version ver;
-            if (log_manager_->read(index, entry))
-            {
-                ver.index_ = entry.index();
-                ver.term_ = entry.term();
-                if (!(*apply_callback_)(entry.log_data(), ver))
-                {
-                    logger_error("apply_callback::operator() error");
-                    return;
-                }
-                set_applied_index(index);
-                continue;
-            }
-            logger_error("read log error");
-            return;
+            if (!apply_log_entry(index))
+                return;
+            set_applied_index(index);
         }
     }
 
@@ -1142,6 +2525,7 @@ namespace raft
             {
                 return;
             }
+            replicate_callbacks_.erase(it++);
         }
     }
     void node::invoke_replicate_callback(replicate_callback::status_t status)
@@ -1151,21 +2535,32 @@ namespace raft
 
         acl::lock_guard lg(replicate_callbacks_locker_);
 
-        replicate_callbacks_t::iterator it = replicate_callbacks_.begin();
-        for (; it != replicate_callbacks_.end();)
+        /*
+         * apply committed entries in log order.entries without
+         * callback (written by old leader) are applied by
+         * apply_callback, as followers do
+         */
+        for (log_index_t index = applied_index() + 1;
+             index <= committed; ++index)
         {
-            if (it->first.index_ <= committed)
+            replicate_callbacks_t::iterator it =
+                replicate_callbacks_.begin();
+
+            if (it != replicate_callbacks_.end() &&
+                it->first.index_ == index)
             {
                 if (!(*(it->second))(status, it->first))
                 {
                     logger_error("replicate_callback::operator()() .error");
                     return;
                 }
-                set_applied_index(it->first.index_);
-                replicate_callbacks_.erase(it++);
-                continue;
+                replicate_callbacks_.erase(it);
+            }
+            else if (!apply_log_entry(index))
+            {
+                return;
             }
-            break;
+            set_applied_index(index);
         }
     }
 
@@ -1202,6 +2597,16 @@ namespace raft
         }
 
 
+        /*
+         * adaptive timing. follow the election timeout derived
+         * by leader before reset election timer
+         */
+        if (req.election_timeout())
+        {
+            set_adaptive_election_timeout(
+                static_cast<unsigned int>(req.election_timeout()));
+        }
+
         /*
          *If RPC request or response contains term T > currentTerm:
          *set currentTerm = T, convert to follower (5.1)
@@ -1209,6 +2614,7 @@ namespace raft
         set_current_term(req.term());
         step_down();
         set_leader_id(req.leader_id());
+        update_leader_contact_time();
 
         resp.set_term(current_term());
 
@@ -1325,53 +2731,238 @@ namespace raft
             }
             /* Append any new entries not already in the log */
 
-            if (!log_manager_->write(entry))
-            {
-                logger_error("!!!!!!!!!!write log error!!!!!!!...");
-                return true;
-            }
-            if (should_compact_log())
-            {
-                logger_debug(NODE_SECTION, 10,
-                             "--------------- "
-                             "should_compact_log true"
-                             "---------------");
-                async_compaction_log();
-            }
+            if (!log_manager_->write(entry))
+            {
+                logger_error("!!!!!!!!!!write log error!!!!!!!...");
+                return true;
+            }
+            if (should_compact_log())
+            {
+                logger_debug(NODE_SECTION, 10,
+                             "--------------- "
+                             "should_compact_log true"
+                             "---------------");
+                async_compaction_log();
+            }
+
+            logger_debug(NODE_SECTION, 15, "write log ok.");
+        }
+        /*
+         *  If leaderCommit > commitIndex,
+         *  set commitIndex = min(leaderCommit, index of last new entry)
+         */
+        if (req.leader_commit() > committed_index())
+        {
+            log_index_t index = req.leader_commit();
+            if (index > last_log_index())
+            {
+                index = last_log_index();
+            }
+            set_committed_index(index);
+            apply_log_.to_apply();
+        }
+        logger_debug(NODE_SECTION, 10, "replicate log ok");
+        resp.set_last_log_index(last_log_index());
+        return true;
+    }
+
+    void node::close_snapshot()
+    {
+        acl_assert(snapshot_info_);
+        acl_assert(snapshot_tmp_);
+
+        snapshot_tmp_->close();
+        close_snapshot_sink(false);
+
+        delete snapshot_info_;
+        delete snapshot_tmp_;
+
+        snapshot_tmp_ = NULL;
+        snapshot_info_ = NULL;
+
+        snapshot_received_ = 0;
+        snapshot_size_ = 0;
+        snapshot_crc_ = 0;
+        snapshot_chunks_.clear();
+    }
+
+    static std::string get_snapshot_progress_path(const std::string &file_path)
+    {
+        std::string path = file_path;
+        size_t pos = path.find_last_of('.');
+        if (pos != path.npos)
+            path = path.substr(0, pos);
+        return path + __SNAPSHOT_PROGRESS_EXT__;
+    }
+
+    void node::remove_snapshot_tmps(const std::string &file_path)
+    {
+        std::set<std::string> files =
+            list_dir(snapshot_path_, __SNAPSHOT_TMP_EXT__);
+        std::set<std::string> progress =
+            list_dir(snapshot_path_, __SNAPSHOT_PROGRESS_EXT__);
+
+        files.insert(progress.begin(), progress.end());
+
+        //scan_dir may join path in other way. compare by name
+        std::string name = get_filename(file_path);
+
+        for (std::set<std::string>::iterator it = files.begin();
+             it != files.end(); ++it)
+        {
+            if (get_filename(*it) == name)
+                continue;
+
+            logger("remove old snapshot temp file %s", it->c_str());
+            remove(it->c_str());
+        }
+    }
+
+    void node::open_snapshot_sink(const snapshot_info &info)
+    {
+        close_snapshot_sink(false);
+
+        //chain file is not a snapshot file
+        if (!snapshot_sink_ || info.chain_files())
+            return;
+
+        version ver(info.last_snapshot_index(),
+                    info.last_included_term());
+        snapshot_sink_open_ = snapshot_sink_->open(ver, info.compressed());
+    }
+
+    void node::write_snapshot_sink(const char *data, size_t len)
+    {
+        if (snapshot_sink_open_ && !snapshot_sink_->write(data, len))
+        {
+            logger_error("snapshot sink write error. "
+                         "load snapshot file when it is done");
+            close_snapshot_sink(false);
+        }
+    }
+
+    bool node::close_snapshot_sink(bool done)
+    {
+        if (!snapshot_sink_open_)
+            return false;
+
+        snapshot_sink_open_ = false;
+        return snapshot_sink_->close(done);
+    }
+
+    bool node::read_snapshot_tmp(unsigned long long from,
+                                 unsigned long long to,
+                                 unsigned int *crc,
+                                 bool to_sink)
+    {
+        if (from >= to)
+            return true;
 
-            logger_debug(NODE_SECTION, 15, "write log ok.");
+        if (snapshot_tmp_->fseek((long long) from, SEEK_SET) == -1)
+        {
+            logger_error("fseek error %s", acl::last_serror());
+            return false;
         }
-        /*
-         *  If leaderCommit > commitIndex,
-         *  set commitIndex = min(leaderCommit, index of last new entry)
-         */
-        if (req.leader_commit() > committed_index())
+
+        std::string buffer;
+        buffer.resize(__1MB__);
+
+        while (from < to)
         {
-            log_index_t index = req.leader_commit();
-            if (index > last_log_index())
+            size_t len = buffer.size();
+            if (to - from < len)
+                len = (size_t) (to - from);
+
+            if (snapshot_tmp_->read((char *) buffer.data(), len) !=
+                (int) len)
             {
-                index = last_log_index();
+                logger_error("read snapshot temp file error");
+                return false;
             }
-            set_committed_index(index);
-            apply_log_.to_apply();
+            if (crc)
+                *crc = (unsigned int) crc32(*crc,
+                                            (const Bytef *) buffer.data(),
+                                            (uInt) len);
+            if (to_sink)
+                write_snapshot_sink(buffer.data(), len);
+            from += len;
         }
-        logger_debug(NODE_SECTION, 10, "replicate log ok");
-        resp.set_last_log_index(last_log_index());
         return true;
     }
 
-    void node::close_snapshot()
+    void node::save_snapshot_progress()
     {
-        acl_assert(snapshot_info_);
-        acl_assert(snapshot_tmp_);
+        unsigned char buffer[sizeof(long long) * 2 + sizeof(int)];
+        unsigned char *ptr = buffer;
 
-        snapshot_tmp_->close();
+        put_uint64(ptr, snapshot_received_);
+        put_uint32(ptr, snapshot_crc_);
+        put_uint64(ptr, snapshot_size_);
 
-        delete snapshot_info_;
-        delete snapshot_tmp_;
+        std::string file_path =
+            get_snapshot_progress_path(snapshot_tmp_->file_path());
 
-        snapshot_tmp_ = NULL;
-        snapshot_info_ = NULL;
+        acl::ofstream file;
+        if (!file.open_trunc(file_path.c_str()))
+        {
+            logger_error("open_trunc %s error.%s",
+                         file_path.c_str(),
+                         acl::last_serror());
+            return;
+        }
+        if (file.write(buffer, sizeof(buffer)) != sizeof(buffer))
+        {
+            logger_error("write %s error.%s",
+                         file_path.c_str(),
+                         acl::last_serror());
+        }
+    }
+
+    bool node::load_snapshot_progress()
+    {
+        std::string file_path =
+            get_snapshot_progress_path(snapshot_tmp_->file_path());
+
+        acl::ifstream file;
+        acl::string buffer;
+
+        if (!file.open_read(file_path.c_str()))
+            return false;
+
+        if (!file.load(&buffer) ||
+            buffer.size() != sizeof(long long) * 2 + sizeof(int))
+        {
+            logger_error("snapshot progress file error.%s",
+                         file_path.c_str());
+            return false;
+        }
+
+        unsigned char *ptr = (unsigned char *) buffer.c_str();
+        unsigned long long received = get_uint64(ptr);
+        unsigned int crc = get_uint32(ptr);
+        unsigned long long size = get_uint64(ptr);
+
+        if ((unsigned long long) snapshot_tmp_->fsize() < received)
+        {
+            logger_error("snapshot temp file is shorter than progress");
+            return false;
+        }
+
+        /*
+         * received bytes may be lost by crash.check it, and
+         * replay them to snapshot sink
+         */
+        unsigned int value = (unsigned int) crc32(0L, Z_NULL, 0);
+        if (!read_snapshot_tmp(0, received, &value, true) || value != crc)
+        {
+            logger_error("snapshot temp file crc error");
+            return false;
+        }
+
+        snapshot_received_ = received;
+        snapshot_crc_ = crc;
+        snapshot_size_ = size;
+        return true;
     }
 
     acl::fstream* node::get_snapshot_tmp(const snapshot_info &info)
@@ -1379,15 +2970,45 @@ namespace raft
         if (!snapshot_info_)
         {
             /*
-             *Create new snapshot file if first chunk (offset is 0)
+             * snapshot temp file is named by version of snapshot.
+             * it is kept across restarts and leader changes, and
+             * resumed when the same snapshot is offered again
              */
             acl::string file_path = snapshot_path_.c_str();
-            file_path.format_append("%lu.snapshot_tmp",
-                                    info.last_snapshot_index());
+            file_path.format_append("%lu.%lu" __SNAPSHOT_TMP_EXT__,
+                                    info.last_snapshot_index(),
+                                    info.last_included_term());
+
+            remove_snapshot_tmps(file_path.c_str());
 
             snapshot_info_ = new snapshot_info(info);
             snapshot_tmp_ = new acl::fstream();
 
+            snapshot_received_ = 0;
+            snapshot_size_ = 0;
+            snapshot_crc_ = (unsigned int) crc32(0L, Z_NULL, 0);
+            snapshot_chunks_.clear();
+
+            open_snapshot_sink(info);
+
+            if (snapshot_tmp_->open(file_path, O_RDWR | O_CREAT, 0600) &&
+                load_snapshot_progress())
+            {
+                logger("resume snapshot temp file %s at offset %llu",
+                       file_path.c_str(),
+                       snapshot_received_);
+                return snapshot_tmp_;
+            }
+
+            snapshot_received_ = 0;
+            snapshot_size_ = 0;
+            snapshot_crc_ = (unsigned int) crc32(0L, Z_NULL, 0);
+            snapshot_tmp_->close();
+
+            //sink has got bytes of bad temp file. restart it
+            if (snapshot_sink_open_)
+                open_snapshot_sink(info);
+
             if (!snapshot_tmp_->open_trunc(file_path))
             {
                 logger_error("open_trunc filename error,"
@@ -1395,6 +3016,7 @@ namespace raft
                              file_path.c_str(),
                              acl::last_serror());
 
+                close_snapshot_sink(false);
                 delete snapshot_info_;
                 delete snapshot_tmp_;
 
@@ -1407,15 +3029,16 @@ namespace raft
         }
         if (info != *snapshot_info_)
         {
-            const char *filepath = snapshot_tmp_->file_path();
+            std::string file_path = snapshot_tmp_->file_path();
 
             logger_error("snapshot_info not "
                          "match current snapshot temp file."
                          "remove old snapshot file. %s",
-                         filepath);
+                         file_path.c_str());
 
             close_snapshot();
-            remove(filepath);
+            remove(file_path.c_str());
+            remove(get_snapshot_progress_path(file_path).c_str());
             return get_snapshot_tmp(info);
         }
         return snapshot_tmp_;
@@ -1428,8 +3051,11 @@ namespace raft
         if (role() == E_LEADER)
         {
             notify_replicate_failed();
+
+            acl::lock_guard lg(metadata_locker_);
+            transfer_to_.clear();
         }
-        else if (role() == E_CANDIDATE)
+        else if (role() == E_CANDIDATE || role() == E_PRE_CANDIDATE)
         {
             clear_vote_response();
         }
@@ -1439,18 +3065,20 @@ namespace raft
 
     void node::load_snapshot_file()
     {
-        version ver;
+        snapshot_info info;
 
         acl_assert(snapshot_tmp_);
 
         std::string file_path = snapshot_tmp_->file_path();
 
+        remove(get_snapshot_progress_path(file_path).c_str());
+
         if (snapshot_tmp_->fseek(0, SEEK_SET) == -1)
         {
             logger_fatal("fseek error %s",
                          acl::last_serror());
         }
-        if (!raft::read(*snapshot_tmp_, ver))
+        if (!raft::read(*snapshot_tmp_, info))
         {
             logger_error("read snapshot file error.path :%s",
                          snapshot_tmp_->file_path());
@@ -1458,44 +3086,79 @@ namespace raft
             remove(file_path.c_str());
             return;
         }
-        close_snapshot();
+        version ver(info.last_snapshot_index(), info.last_included_term());
 
-        std::string temp = get_snapshot();
-        if (0 != temp.size())
-        {
-            acl::ifstream file;
-            version temp_ver;
-
-            acl_assert(file.open_read(temp.c_str()));
-            acl_assert(raft::read(file, temp_ver));
-            file.close();
+        //keep sink open. it is closed after log is discarded
+        bool sink = snapshot_sink_open_;
+        snapshot_sink_open_ = false;
 
+        version temp_ver;
+        if (get_snapshot_version(temp_ver))
+        {
             if (ver < temp_ver)
             {
                 logger("snapshot_tmp(%s) is old",
                        file_path.c_str());
+                close_snapshot();
+                if (sink)
+                    snapshot_sink_->close(false);
                 return;
             }
         }
 
-        std::string snapshot = file_path;
-        size_t pos = snapshot.find_last_of('.');
-        if (pos != snapshot.npos)
+        std::vector<std::string> snapshots;
+        std::string snapshot;
+
+        if (info.chain_files())
+        {
+            /*
+             * leader send full snapshot and delta snapshots
+             * in a chain file
+             */
+            bool ok = split_snapshot_chain(info.chain_files(), snapshots);
+
+            close_snapshot();
+            remove(file_path.c_str());
+
+            if (!ok)
+            {
+                logger_error("split snapshot chain error.path :%s",
+                             file_path.c_str());
+                return;
+            }
+            snapshot = snapshots.back();
+        }
+        else
         {
-            snapshot = snapshot.substr(0, pos);
+            close_snapshot();
+
+            snapshot = file_path;
+            size_t pos = snapshot.find_last_of('.');
+            if (pos != snapshot.npos)
+            {
+                snapshot = snapshot.substr(0, pos);
+            }
+            snapshot += __SNAPSHOT_EXT__;
+
+            /*save snapshot file*/
+            if (0 != rename(file_path.c_str(), snapshot.c_str()))
+            {
+                logger_error("rename error."
+                             "oldFilePath:%s, "
+                             "newFilePath:%s, "
+                             "error:%s",
+                             file_path.c_str(),
+                             snapshot.c_str(),
+                             acl::last_serror());
+            }
+            snapshots.push_back(snapshot);
         }
-        snapshot += __SNAPSHOT_EXT__;
 
-        /*save snapshot file*/
-        if (0 != rename(file_path.c_str(), snapshot.c_str()))
+        for (size_t i = 0; i < snapshots.size(); i++)
         {
-            logger_error("rename error."
-                         "oldFilePath:%s, "
-                         "newFilePath:%s, "
-                         "error:%s",
-                         file_path.c_str(),
-                         snapshot.c_str(),
-                         acl::last_serror());
+            if (!add_snapshot_file(snapshots[i]))
+                logger_error("add snapshot file to catalog error.%s",
+                             snapshots[i].c_str());
         }
 
         logger("snapshot ver.index_(%llu). "
@@ -1514,6 +3177,8 @@ namespace raft
         }
         else
         {
+            if (sink)
+                snapshot_sink_->close(false);
             logger_fatal("error snapshot."
                          "something error happened");
             return;
@@ -1522,17 +3187,31 @@ namespace raft
         set_last_snapshot_index(ver.index_);
         set_last_snapshot_term(ver.term_);
 
-        acl_assert(load_snapshot_callback_);
         /*
-         *  Reset state machine using snapshot contents
-         *  (and load snapshots cluster configuration)
+         * state machine is built from the streamed bytes already
          */
-        if (!(*load_snapshot_callback_)(snapshot))
+        if (sink && snapshot_sink_->close(true))
         {
-            logger_error("receive_snapshot_callback "
-                         "failed,file_path:%s ",
-                         file_path.c_str());
-            return;
+            logger("snapshot sink done.file_path:%s", snapshot.c_str());
+        }
+        else
+        {
+            acl_assert(load_snapshot_callback_);
+            /*
+             *  Reset state machine using snapshot contents
+             *  (and load snapshots cluster configuration).
+             *  delta snapshots are loaded after their base
+             */
+            for (size_t i = 0; i < snapshots.size(); i++)
+            {
+                if (!(*load_snapshot_callback_)(snapshots[i]))
+                {
+                    logger_error("receive_snapshot_callback "
+                                 "failed,file_path:%s ",
+                                 snapshots[i].c_str());
+                    return;
+                }
+            }
         }
         logger("load_snapshot_file ok ."
                "file_path:%s,"
@@ -1581,6 +3260,9 @@ namespace raft
     }
     void node::start()
     {
+        srand(static_cast<unsigned int>(time(NULL)) ^
+              static_cast<unsigned int>((size_t)this));
+
         init_peers();
 
         apply_log_.start();
@@ -1593,13 +3275,149 @@ namespace raft
             metadata_->set_peer_infos(peer_infos_);
     }
 
+    bool node::transfer_leadership(const std::string &peer_id)
+    {
+        if (!is_leader())
+        {
+            logger("node is not leader. can't transfer leadership");
+            return false;
+        }
+
+        acl::lock_guard lg(peers_locker_);
+        std::map<std::string, peer *>::iterator it = peers_.find(peer_id);
+        if (it == peers_.end())
+        {
+            logger_error("peer(%s) not exist", peer_id.c_str());
+            return false;
+        }
+
+        metadata_locker_.lock();
+        if (transfer_to_.size())
+        {
+            logger("leadership is transferring to %s",
+                   transfer_to_.c_str());
+            metadata_locker_.unlock();
+            return false;
+        }
+        transfer_to_ = peer_id;
+        gettimeofday(&transfer_start_, NULL);
+        metadata_locker_.unlock();
+
+        logger("transfer leadership to %s", peer_id.c_str());
+
+        it->second->notify_transfer_leadership();
+        return true;
+    }
+
+    bool node::is_transferring()
+    {
+        acl::lock_guard lg(metadata_locker_);
+        if (transfer_to_.empty())
+            return false;
+
+        timeval now;
+        gettimeofday(&now, NULL);
+
+        long long elapsed =
+            (now.tv_sec - transfer_start_.tv_sec) * 1000 +
+            (now.tv_usec - transfer_start_.tv_usec) / 1000;
+
+        /*
+         * transfer not done in election timeout.
+         * abort it and accept replicate request again
+         */
+        if (elapsed > election_timeout())
+        {
+            logger("transfer leadership to %s timeout",
+                   transfer_to_.c_str());
+            transfer_to_.clear();
+            return false;
+        }
+        return true;
+    }
+
+    void node::transfer_leadership_callback(const std::string &peer_id,
+                                            bool ok)
+    {
+        acl::lock_guard lg(metadata_locker_);
+        if (transfer_to_ != peer_id)
+            return;
+
+        if (ok)
+        {
+            /*
+             * keep rejecting replicate request until new leader's
+             * vote request make this node step down
+             */
+            logger("send timeout_now to %s ok", peer_id.c_str());
+            return;
+        }
+        logger_error("transfer leadership to %s failed",
+                     peer_id.c_str());
+        transfer_to_.clear();
+    }
+
+    bool node::handle_timeout_now_request(
+        const timeout_now_request &req,
+        timeout_now_response &resp)
+    {
+        resp.set_req_id(req.req_id());
+        resp.set_term(current_term());
+        resp.set_success(false);
+
+        if (req.term() < current_term())
+        {
+            logger("timeout_now req.term(%lu) < current_term(%llu)",
+                   req.term(),
+                   current_term());
+            return true;
+        }
+
+        if (is_leader())
+        {
+            logger("node is leader. ignore timeout_now");
+            return true;
+        }
+
+        /*
+         * only the leader of current term can hand over leadership,
+         * else any node could force an election at will
+         */
+        if (req.term() != current_term())
+        {
+            logger("timeout_now req.term(%lu) != current_term(%llu). "
+                   "no known leader in that term, ignore it",
+                   req.term(),
+                   current_term());
+            return true;
+        }
+
+        std::string leader = leader_id();
+        if (leader.empty() || leader != req.leader_id())
+        {
+            logger("timeout_now from %s is not from leader(%s). ignore it",
+                   req.leader_id().c_str(),
+                   leader.c_str());
+            return true;
+        }
+
+        logger("receive timeout_now from leader %s. start election now",
+               req.leader_id().c_str());
+
+        resp.set_success(true);
+
+        cancel_election_timer();
+        start_election();
+        return true;
+    }
+
     bool node::handle_install_snapshot_request(
         const install_snapshot_request &req,
         install_snapshot_response &resp)
     {
         acl::fstream *file = NULL;
 
-        resp.set_req_id(resp.req_id());
+        resp.set_req_id(req.req_id());
 
         if (req.term() < current_term())
         {
@@ -1611,31 +3429,109 @@ namespace raft
         step_down();
         set_current_term(req.term());
         set_leader_id(req.leader_id());
+        update_leader_contact_time();
+
+        std::string raw;
+        if (req.compressed() &&
+            !unzip_blocks(req.data().data(), req.data().size(), raw))
+        {
+            logger_error("unzip snapshot chunk error");
+            resp.set_bytes_stored(0);
+            return true;
+        }
+
+        const std::string &data = req.compressed() ? raw : req.data();
+        unsigned long long offset = req.offset();
+        unsigned long long end = offset + data.size();
+
+        /*
+         * empty chunk is probe of leader, it only asks bytes
+         * stored already
+         */
+        if (data.empty() && !req.snapshot_size())
+            logger_fatal("snapshot req data empty");
+
+        /*
+         * late chunk of snapshot installed already.
+         */
+        if (last_snapshot_index() &&
+            req.snapshot_info().last_snapshot_index() <=
+            last_snapshot_index())
+        {
+            resp.set_bytes_stored(req.snapshot_size() ?
+                                  req.snapshot_size() : end);
+            return true;
+        }
 
         acl::lock_guard lg(snapshot_locker_);
         acl_assert(file = get_snapshot_tmp(req.snapshot_info()));
-        if (file->fsize() != req.offset())
+
+        /*
+         * leader without snapshot_size send chunks in order
+         */
+        if (!req.snapshot_size() && offset != snapshot_received_)
         {
             logger("offset error");
-            resp.set_bytes_stored(
-                (google::protobuf::uint64) file->fsize());
-
+            resp.set_bytes_stored(snapshot_received_);
             return true;
         }
+        if (req.snapshot_size())
+            snapshot_size_ = req.snapshot_size();
+
         /* Write data into snapshot file at given offset*/
-        const std::string &data = req.data();
+        if (end > snapshot_received_)
+        {
+            if (file->fseek((long long) offset, SEEK_SET) == -1)
+                logger_fatal("file fseek error.%s", acl::last_serror());
 
-        if (data.empty())
-            logger_fatal("snapshot req data empty");
+            if (file->write(data.c_str(), data.size()) !=
+                static_cast<int>(data.size()))
+                logger_fatal("file write error.%s", acl::last_serror());
+
+            unsigned long long &chunk_end = snapshot_chunks_[offset];
+            if (chunk_end < end)
+                chunk_end = end;
+
+            unsigned long long received = snapshot_received_;
+            while (snapshot_chunks_.size() &&
+                   snapshot_chunks_.begin()->first <= snapshot_received_)
+            {
+                if (snapshot_chunks_.begin()->second > snapshot_received_)
+                    snapshot_received_ = snapshot_chunks_.begin()->second;
+                snapshot_chunks_.erase(snapshot_chunks_.begin());
+            }
 
-        if (file->write(data.c_str(), data.size()) != data.size())
-            logger_fatal("file write error.%s", acl::last_serror());
+            /*
+             * checksum the new received bytes, and save progress
+             * to resume from it after restart
+             */
+            if (snapshot_received_ > received)
+            {
+                if (offset <= received && end >= snapshot_received_)
+                {
+                    const char *ptr = data.data() + (received - offset);
+                    size_t len = (size_t) (snapshot_received_ - received);
+
+                    snapshot_crc_ = (unsigned int) crc32(
+                        snapshot_crc_, (const Bytef *) ptr, (uInt) len);
+                    write_snapshot_sink(ptr, len);
+                }
+                else if (!read_snapshot_tmp(received,
+                                            snapshot_received_,
+                                            &snapshot_crc_,
+                                            true))
+                {
+                    logger_fatal("read snapshot temp file error");
+                }
+                save_snapshot_progress();
+            }
+        }
 
-        resp.set_bytes_stored(
-            (google::protobuf::uint64) file->fsize());
+        resp.set_bytes_stored(snapshot_received_);
 
-        /*. Reply and wait for more data chunks if done is false*/
-        if (req.done())
+        /*. Reply and wait for more data chunks if not done*/
+        if (snapshot_size_ ?
+            snapshot_received_ == snapshot_size_ : req.done())
         {
             load_snapshot_file();
         }
@@ -1788,7 +3684,7 @@ namespace raft
 
     node::log_compaction::log_compaction(node &_node)
         :node_(_node),
-        do_compact_log_(false),
+        do_compact_log_(true),
         stop_(false)
     {
         acl_pthread_mutex_init(&mutex_, NULL);
@@ -1812,9 +3708,18 @@ namespace raft
         {
             acl_pthread_mutex_lock(&mutex_);
 
-            //wait for do compaction event
-            while (!stop_ && !node_.should_compact_log())
+            /*
+             * wait for do compaction event.logs kept for peers
+             * are checked again when next log is written
+             */
+            while (!stop_ &&
+                   !(do_compact_log_ && (node_.should_compact_log() ||
+                                         node_.should_checkpoint())))
+            {
+                do_compact_log_ = false;
                 acl_pthread_cond_wait(&cond_, &mutex_);
+            }
+            do_compact_log_ = false;
 
             acl_pthread_mutex_unlock(&mutex_);
 
@@ -1833,6 +3738,7 @@ namespace raft
     void node::log_compaction::do_compact_log()
     {
         acl_pthread_mutex_lock(&mutex_);
+        do_compact_log_ = true;
         acl_pthread_cond_signal(&cond_);
         acl_pthread_mutex_unlock(&mutex_);
     }
@@ -1891,6 +3797,11 @@ namespace raft
             timeout.tv_nsec = now.tv_usec * 1000;
             timeout.tv_sec += delay_ / 1000;
             timeout.tv_nsec += (delay_ % 1000) * 1000 * 1000;
+            if (timeout.tv_nsec >= 1000 * 1000 * 1000)
+            {
+                timeout.tv_sec += 1;
+                timeout.tv_nsec -= 1000 * 1000 * 1000;
+            }
 
             acl_assert(!acl_pthread_mutex_lock(&mutex_));
             int status = acl_pthread_cond_timedwait(
@@ -1,19 +1,27 @@
 #include "raft.hpp"
-#define  __1MB__      (1024 * 1024)
 #define TO_REPLICATE  0x01
 #define TO_ELECTION   0x02
 #define TO_STOP       0x04
+#define TO_TRANSFER   0x08
+#define TO_PRE_VOTE   0x10
 
 #define SET_TO_REPLICATE(e)   (e |= TO_REPLICATE)
 #define SET_TO_ELECTION(e)    (e |= TO_ELECTION)
 #define SET_TO_STOP(e)        (e |= TO_STOP)
+#define SET_TO_TRANSFER(e)    (e |= TO_TRANSFER)
+#define SET_TO_PRE_VOTE(e)    (e |= TO_PRE_VOTE)
 
 #define IS_TO_REPLICATE(e)    (e & TO_REPLICATE)
 #define IS_TO_STOP(e)         (e & TO_STOP)
 #define IS_TO_ELECTION(e)     (e & TO_ELECTION)
+#define IS_TO_TRANSFER(e)     (e & TO_TRANSFER)
+#define IS_TO_PRE_VOTE(e)     (e & TO_PRE_VOTE)
 
 #define PEER_SECTION 10
 
+//max milliseconds snapshot chunk wait for replicate requests
+#define __SNAPSHOT_MAX_YIELD__ 20
+
 
 namespace raft
 {
@@ -23,13 +31,16 @@ namespace raft
                const std::string &addr)
 		:node_(_node),
          peer_id_(peer_id),
+         addr_(addr),
          match_index_(0),
          next_index_(0),
          event_(0),
-         heart_inter_(3000),
+         srtt_(0),
+         rttvar_(0),
          rpc_client_(acl::http_rpc_client::get_instance()),
          rpc_fails_(0),
-         req_id_(1)
+         req_id_(1),
+         snapshot_sender_(*this)
 	{
 		//server_id/raft/interface
 		replicate_service_path_.format(
@@ -43,10 +54,17 @@ namespace raft
         election_service_path_.format(
                 "/memkv%s/raft/vote_req", peer_id_.c_str());
 
+        timeout_now_service_path_.format(
+                "/memkv%s/raft/timeout_now_req", peer_id_.c_str());
+
+        pre_vote_service_path_.format(
+                "/memkv%s/raft/pre_vote_req", peer_id_.c_str());
+
         //init rpc_client;
-        rpc_client_.add_service(addr.c_str(), install_snapshot_service_path_);
         rpc_client_.add_service(addr.c_str(), replicate_service_path_);
         rpc_client_.add_service(addr.c_str(), election_service_path_);
+        rpc_client_.add_service(addr.c_str(), timeout_now_service_path_);
+        rpc_client_.add_service(addr.c_str(), pre_vote_service_path_);
 
 		//send heartbeat to sync log index first
 		acl_pthread_mutex_init(&mutex_, NULL);
@@ -55,6 +73,9 @@ namespace raft
         //init last_replicate_time_
         gettimeofday(&last_heartbeat_time_, NULL);
 
+        last_response_time_.tv_sec = 0;
+        last_response_time_.tv_usec = 0;
+
         std::vector<std::string> paths;
 
     }
@@ -66,6 +87,7 @@ namespace raft
 	}
     void peer::start()
     {
+        snapshot_sender_.start();
         acl::thread::start();
     }
 	void peer::notify_replicate()
@@ -90,6 +112,86 @@ namespace raft
 		}
 		acl_pthread_mutex_unlock(&mutex_);
 	}
+	void peer::notify_transfer_leadership()
+	{
+		acl_pthread_mutex_lock(&mutex_);
+		if (!IS_TO_TRANSFER(event_))
+		{
+			SET_TO_TRANSFER(event_);
+			acl_pthread_cond_signal(&cond_);
+		}
+		acl_pthread_mutex_unlock(&mutex_);
+	}
+
+	void peer::notify_pre_vote()
+	{
+		acl_pthread_mutex_lock(&mutex_);
+		if (!IS_TO_PRE_VOTE(event_))
+		{
+			SET_TO_PRE_VOTE(event_);
+			acl_pthread_cond_signal(&cond_);
+		}
+		acl_pthread_mutex_unlock(&mutex_);
+	}
+
+	bool peer::is_active(long long timeout)
+	{
+		timeval now;
+		gettimeofday(&now, NULL);
+
+		acl::lock_guard lg(locker_);
+		long long elapsed =
+			(now.tv_sec - last_response_time_.tv_sec) * 1000 +
+			(now.tv_usec - last_response_time_.tv_usec) / 1000;
+
+		return elapsed < timeout;
+	}
+
+	void peer::update_response_time()
+	{
+		acl::lock_guard lg(locker_);
+		gettimeofday(&last_response_time_, NULL);
+	}
+
+	long long peer::rtt()
+	{
+		acl::lock_guard lg(locker_);
+		if (!srtt_)
+			return 0;
+		return (srtt_ + 4 * rttvar_) / 1000 + 1;
+	}
+
+	void peer::update_rtt(const timeval &start)
+	{
+		timeval now;
+		gettimeofday(&now, NULL);
+
+		long long sample = (now.tv_sec - start.tv_sec) * 1000000 +
+			(now.tv_usec - start.tv_usec);
+		if (sample <= 0)
+			sample = 1;
+
+		/*
+		 * same as TCP RTO estimator (RFC 6298)
+		 * RTTVAR = 3/4 * RTTVAR + 1/4 * |SRTT - R|
+		 * SRTT = 7/8 * SRTT + 1/8 * R
+		 */
+		locker_.lock();
+		if (!srtt_)
+		{
+			srtt_ = sample;
+			rttvar_ = sample / 2;
+		}
+		else
+		{
+			long long diff = srtt_ > sample ?
+				srtt_ - sample : sample - srtt_;
+			rttvar_ = (3 * rttvar_ + diff) / 4;
+			srtt_ = (7 * srtt_ + sample) / 8;
+		}
+		locker_.unlock();
+	}
+
 	void peer::set_next_index(log_index_t index)
 	{
 		acl::lock_guard lg(locker_);
@@ -119,23 +221,74 @@ namespace raft
 				do_replicate();
 			}
 
+			if (IS_TO_PRE_VOTE(event))
+			{
+				do_pre_vote();
+			}
+
 			if (IS_TO_ELECTION(event))
 			{
 				do_election();
 			}
+
+			if (IS_TO_TRANSFER(event) && node_.is_leader())
+			{
+				do_transfer_leadership();
+			}
 		}
 		return NULL;
 	}
 
+	struct peer::snapshot_stream
+	{
+		const char  *data;
+		long long   size;
+		size_t      chunk_size;
+		snapshot_info info;
+		//compress chunks on the wire
+		bool        compress;
+
+		acl::locker locker;
+		//next offset to send
+		long long   cursor;
+		//bytes stored by peer without hole
+		long long   stored;
+		bool        failed;
+	};
+
+	class peer::snapshot_worker : public acl::thread
+	{
+	public:
+		snapshot_worker(peer &_peer, snapshot_stream &stream)
+			:peer_(_peer),
+			 stream_(stream),
+			 conn_(_peer.addr_.c_str())
+		{
+		}
+	private:
+		virtual void *run()
+		{
+			peer_.send_snapshot_chunks(stream_, conn_);
+			return NULL;
+		}
+
+		peer &peer_;
+		snapshot_stream &stream_;
+		//each worker has its own connection to peer
+		acl::http_request conn_;
+	};
+
 	bool peer::do_install_snapshot()
 	{
         logger_debug(PEER_SECTION,10,"trace");
 
-		typedef acl::http_rpc_client::status_t status_t;
-
-		std::string file_path = node_.get_snapshot();
+		/*
+		 * snapshot file, or chain file of full snapshot
+		 * and its delta snapshots
+		 */
+		std::string file_path = node_.get_install_snapshot();
 		acl::ifstream file;
-		version ver;
+		snapshot_stream stream;
 
 		if (file_path.empty())
 		{
@@ -148,87 +301,216 @@ namespace raft
 			return false;
 		}
 
-        long long int file_size =  file.fsize();
-
-        if (!read(file, ver))
+		if (!read(file, stream.info))
 		{
 			logger_error("snapshot read version failed.");
 			return false;
 		}
 
-		long long int offset = 0;
+		stream.size = file.fsize();
+		stream.chunk_size = node_.snapshot_chunk_size();
+		//compressed snapshot file is not compressed again
+		stream.compress = node_.compress_snapshot_transfer() &&
+			!stream.info.compressed();
+		stream.cursor = 0;
+		stream.stored = 0;
+		stream.failed = false;
+
+        logger("snapshot file size(%lld)", stream.size);
+
+		/*
+		 * map the file.chunk is copied from page cache into the
+		 * request buffer once, no read buffer in between
+		 */
+		void *data = open_mmap_read(file.file_handle(),
+									(size_t) stream.size);
+		if (!data)
+		{
+			logger_error("open_mmap_read %s failed",
+						 file_path.c_str());
+			return false;
+		}
+		stream.data = static_cast<const char *>(data);
 
-        logger("snapshot file size(%lld)", file_size);
+		/*
+		 * probe with an empty chunk.peer reply bytes it stored
+		 * already, and sending begins from there
+		 */
+		acl::http_request conn(addr_.c_str());
+		probe_snapshot(stream, conn);
 
-		while (node_.is_leader())
+		std::vector<snapshot_worker *> workers;
+		for (int i = 1; i < node_.snapshot_inflight(); i++)
 		{
-            if (file.fseek(offset, SEEK_SET) == -1)
-			{
-				logger_error("file fseek error.%s",
-                             acl::last_serror());
-				return false;
-			}
+			snapshot_worker *worker = new snapshot_worker(*this, stream);
+			worker->start();
+			workers.push_back(worker);
+		}
 
-            char *buffer = new char [__1MB__];
+		send_snapshot_chunks(stream, conn);
 
-			int bytes = file.read(buffer, __1MB__, false);
-            if(bytes == -1)
-            {
-                logger_fatal("file read error. %s",
-                             acl::last_serror());
-            }
-			bool done = file_size == (bytes + offset);
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i]->wait();
+			delete workers[i];
+		}
+		close_mmap(data, (size_t) stream.size);
 
-			install_snapshot_request req;
-			install_snapshot_response resp;
+		if (stream.stored != stream.size)
+			return false;
 
-            req.set_term(node_.current_term());
-			req.set_data(buffer, (size_t)bytes);
-			req.set_done(done);
-			req.set_offset((size_t)offset);
-			req.set_leader_id(node_.node_id());
+		//update next_index
+		set_next_index(stream.info.last_snapshot_index() + 1);
+		set_match_index(stream.info.last_snapshot_index());
+		logger("send snapshot done");
+		return true;
+	}
 
-			req.mutable_snapshot_info()->
-				set_last_included_term(ver.term_);
+	bool peer::snapshot_call(acl::http_request &conn,
+							 const install_snapshot_request &req,
+							 install_snapshot_response &resp,
+							 std::string &buffer)
+	{
+		buffer.clear();
+		if (!req.AppendToString(&buffer))
+		{
+			logger_error("install_snapshot_request serialize error");
+			return false;
+		}
 
-            req.mutable_snapshot_info()->
-				set_last_snapshot_index(ver.index_);
+		//keep alive the connection between chunks
+		conn.reset();
+		conn.request_header()
+			.set_url(install_snapshot_service_path_.c_str())
+			.set_content_type("application/x-protobuf")
+			.set_keep_alive(true);
 
-            logger("data size(%d)", bytes);
+		acl::string body;
+		if (!conn.request(buffer.data(), buffer.size()) ||
+			!conn.get_body(body))
+		{
+			logger_error("install snapshot to %s error, %s",
+						 addr_.c_str(),
+						 acl::last_serror());
+			return false;
+		}
+		if (!resp.ParseFromArray(body.c_str(), (int) body.size()))
+		{
+			logger_error("install_snapshot_response parse error");
+			return false;
+		}
+		update_response_time();
+		return true;
+	}
 
-            delete []buffer;
+	bool peer::snapshot_reply(snapshot_stream &stream,
+							  const install_snapshot_response &resp)
+	{
+		if (node_.current_term() < resp.term())
+		{
+			logger("receive new term.%zd",resp.term());
+			node_.handle_new_term(resp.term());
 
-            gettimeofday(&last_heartbeat_time_, NULL);
+			acl::lock_guard lg(stream.locker);
+			stream.failed = true;
+			return false;
+		}
 
-			status_t status = rpc_client_.pb_call(
-				install_snapshot_service_path_,
-				req,
-				resp);
-			if (!status)
-			{
-				logger_error("proto_call error,%s",
-					status.error_str_.c_str());
-				return false;
-			}
-			if (node_.current_term() < resp.term())
+		acl::lock_guard lg(stream.locker);
+		long long stored = (long long) resp.bytes_stored();
+		if (stored > stream.stored)
+			stream.stored = stored;
+		//peer has stored more. skip to it
+		if (stream.stored > stream.cursor)
+			stream.cursor = stream.stored;
+		return true;
+	}
+
+	void peer::probe_snapshot(snapshot_stream &stream,
+							  acl::http_request &conn)
+	{
+		install_snapshot_request req;
+		install_snapshot_response resp;
+		std::string buffer;
+
+		req.set_leader_id(node_.node_id());
+		req.set_term(node_.current_term());
+		req.set_snapshot_size((google::protobuf::uint64) stream.size);
+		req.mutable_snapshot_info()->CopyFrom(stream.info);
+		req.set_offset(0);
+		req.set_done(false);
+		req.set_compressed(false);
+
+		if (!snapshot_call(conn, req, resp, buffer))
+		{
+			acl::lock_guard lg(stream.locker);
+			stream.failed = true;
+			return;
+		}
+		snapshot_reply(stream, resp);
+
+		logger("peer %s resume snapshot from %lld",
+			   peer_id_.c_str(), stream.cursor);
+	}
+
+	void peer::send_snapshot_chunks(snapshot_stream &stream,
+									acl::http_request &conn)
+	{
+		//reuse request.data keep its buffer between chunks
+		install_snapshot_request req;
+		install_snapshot_response resp;
+		std::string buffer;
+
+		req.set_leader_id(node_.node_id());
+		req.set_snapshot_size((google::protobuf::uint64) stream.size);
+		req.mutable_snapshot_info()->CopyFrom(stream.info);
+
+		while (node_.is_leader())
+		{
+			long long offset;
 			{
-				logger("receive new term.%zd",resp.term());
-				node_.handle_new_term(resp.term());
-				return false;
+				acl::lock_guard lg(stream.locker);
+				if (stream.failed ||
+					stream.stored == stream.size ||
+					stream.cursor >= stream.size)
+					break;
+				offset = stream.cursor;
+				stream.cursor += stream.chunk_size;
 			}
-			offset = (long long int) resp.bytes_stored();
-			//done
-			if (offset == file_size)
+
+			size_t len = stream.chunk_size;
+			if ((long long) len > stream.size - offset)
+				len = (size_t) (stream.size - offset);
+
+			req.set_term(node_.current_term());
+			req.set_offset((google::protobuf::uint64) offset);
+			req.set_done(offset + (long long) len == stream.size);
+			req.mutable_data()->clear();
+			req.set_compressed(stream.compress &&
+							   zip_block(stream.data + offset,
+										 len,
+										 *req.mutable_data()));
+			if (!req.compressed())
+				req.mutable_data()->assign(stream.data + offset, len);
+
+			//replicate requests go first
+			node_.snapshot_scheduler_.acquire(req.data().size(),
+											  __SNAPSHOT_MAX_YIELD__);
+
+            logger_debug(PEER_SECTION, 10,
+                         "offset(%lld) data size(%zd)", offset, len);
+
+			if (!snapshot_call(conn, req, resp, buffer))
 			{
-				//update next_index
-				next_index_ = ver.index_ + 1;
-				match_index_ = ver.index_;
-				logger("send snapshot done");
-				return true;
+				acl::lock_guard lg(stream.locker);
+				stream.failed = true;
+				break;
 			}
+			if (!snapshot_reply(stream, resp))
+				break;
 		}
-		return false;
 	}
+
 	/*
 	 *If last log index  nextIndex for a follower: send
 	 *AppendEntries RPC with log entries starting at nextIndex
@@ -247,6 +529,13 @@ namespace raft
 			replicate_log_entries_response resp;
 			acl::http_rpc_client::status_t status;
 
+			//snapshot is being sent.only keep peer alive
+			if (snapshot_sender_.is_sending())
+			{
+				do_heartbeat();
+				break;
+			}
+
             logger_debug(PEER_SECTION, 10,
                          "next_index_(%llu)",
                          next_index_);
@@ -260,12 +549,9 @@ namespace raft
                              "failed. next_index_:%llu",
                              next_index_);
 
-				if (!do_install_snapshot())
-				{
-					logger_error("do_install_snapshot error.");
-					break;
-				}
-				continue;
+				snapshot_sender_.notify_send();
+				do_heartbeat();
+				break;
 			}
 
             gettimeofday(&last_heartbeat_time_, NULL);
@@ -283,9 +569,11 @@ namespace raft
 			//for next heartbeat time;
 
 
+			node_.snapshot_scheduler_.replicate_begin();
 			status = rpc_client_.pb_call(replicate_service_path_,
                                          req,
                                          resp);
+			node_.snapshot_scheduler_.replicate_end();
 
 			if (!status)
 			{
@@ -294,6 +582,8 @@ namespace raft
 				rpc_fails_++;
 				break;
 			}
+			update_response_time();
+			update_rtt(last_heartbeat_time_);
 
             logger_debug(PEER_SECTION,10,"replicate done");
 
@@ -337,6 +627,129 @@ namespace raft
 		}
 	}
 
+	void peer::do_heartbeat()
+	{
+		replicate_log_entries_request req;
+		replicate_log_entries_response resp;
+
+		node_.build_heartbeat_request(req, match_index());
+		req.set_req_id(++req_id_);
+
+		gettimeofday(&last_heartbeat_time_, NULL);
+
+		node_.snapshot_scheduler_.replicate_begin();
+		acl::http_rpc_client::status_t status =
+			rpc_client_.pb_call(replicate_service_path_, req, resp);
+		node_.snapshot_scheduler_.replicate_end();
+		if (!status)
+		{
+			logger_error("proto_call error.%s",
+				status.error_str_.c_str());
+			rpc_fails_++;
+			return;
+		}
+		update_response_time();
+		update_rtt(last_heartbeat_time_);
+
+		/*
+		 * peer log is replaced by the snapshot.only term
+		 * of the response matters
+		 */
+		if (node_.current_term() < resp.term())
+		{
+			logger("receive new term.%zd", resp.term());
+			node_.handle_new_term(resp.term());
+		}
+	}
+
+	peer::snapshot_sender::snapshot_sender(peer &_peer)
+		:peer_(_peer),
+		 sending_(false),
+		 stop_(false)
+	{
+		acl_pthread_mutex_init(&mutex_, NULL);
+		acl_pthread_cond_init(&cond_, NULL);
+	}
+
+	peer::snapshot_sender::~snapshot_sender()
+	{
+		acl_pthread_mutex_lock(&mutex_);
+		stop_ = true;
+		acl_pthread_cond_signal(&cond_);
+		acl_pthread_mutex_unlock(&mutex_);
+		wait();
+
+		acl_pthread_mutex_destroy(&mutex_);
+		acl_pthread_cond_destroy(&cond_);
+	}
+
+	void peer::snapshot_sender::start()
+	{
+		acl::thread::start();
+	}
+
+	void peer::snapshot_sender::notify_send()
+	{
+		acl_pthread_mutex_lock(&mutex_);
+		if (!sending_)
+		{
+			sending_ = true;
+			acl_pthread_cond_signal(&cond_);
+		}
+		acl_pthread_mutex_unlock(&mutex_);
+	}
+
+	bool peer::snapshot_sender::is_sending()
+	{
+		acl_pthread_mutex_lock(&mutex_);
+		bool sending = sending_;
+		acl_pthread_mutex_unlock(&mutex_);
+		return sending;
+	}
+
+	void *peer::snapshot_sender::run()
+	{
+		while (true)
+		{
+			acl_pthread_mutex_lock(&mutex_);
+			while (!sending_ && !stop_)
+				acl_pthread_cond_wait(&cond_, &mutex_);
+
+			if (stop_)
+			{
+				acl_pthread_mutex_unlock(&mutex_);
+				break;
+			}
+			acl_pthread_mutex_unlock(&mutex_);
+
+			snapshot_scheduler &scheduler =
+				peer_.node_.snapshot_scheduler_;
+			bool ok = false;
+
+			if (!scheduler.start_transfer())
+			{
+				logger("too many snapshot transfers. "
+					   "retry on next heartbeat");
+			}
+			else
+			{
+				ok = peer_.do_install_snapshot();
+				scheduler.end_transfer();
+				if (!ok)
+					logger_error("do_install_snapshot error.");
+			}
+
+			acl_pthread_mutex_lock(&mutex_);
+			sending_ = false;
+			acl_pthread_mutex_unlock(&mutex_);
+
+			//back to log replication.retry on next heartbeat if failed
+			if (ok)
+				peer_.notify_replicate();
+		}
+		return NULL;
+	}
+
 	void peer::do_election()
 	{
 		logger("start election");
@@ -379,6 +792,99 @@ namespace raft
 		node_.vote_response_callback(peer_id_, resp);
 	}
 
+	void peer::do_transfer_leadership()
+	{
+		logger("transfer leadership to %s", peer_id_.c_str());
+
+		typedef acl::http_rpc_client::status_t status_t;
+
+		/*
+		 * bring peer's log up to date first.
+		 * peer may need a snapshot, it is sent by snapshot sender
+		 * and do_replicate returns at once. keep replicating until
+		 * peer catch up or transfer timeout
+		 */
+		while (match_index() < node_.last_log_index())
+		{
+			if (!node_.is_leader() || !node_.is_transferring())
+			{
+				logger_error("peer log not up to date. "
+							 "match_index(%llu) last_log_index(%llu)",
+							 match_index(),
+							 node_.last_log_index());
+				node_.transfer_leadership_callback(peer_id_, false);
+				return;
+			}
+
+			log_index_t match = match_index();
+			do_replicate();
+
+			//no progress.wait snapshot or peer for a while
+			if (match_index() == match)
+				acl_doze(node_.heartbeat_interval());
+		}
+
+		timeout_now_request req;
+		timeout_now_response resp;
+
+		req.set_req_id(++req_id_);
+		req.set_term(node_.current_term());
+		req.set_leader_id(node_.node_id());
+
+		status_t status = rpc_client_.pb_call(
+			timeout_now_service_path_,
+			req,
+			resp);
+
+		if (!status)
+		{
+			logger_error("proto_call error.%s",
+				status.error_str_.c_str());
+			node_.transfer_leadership_callback(peer_id_, false);
+			return;
+		}
+		update_response_time();
+
+		if (node_.current_term() < resp.term())
+		{
+			logger("receive new term.%lu", resp.term());
+			node_.handle_new_term(resp.term());
+			return;
+		}
+		node_.transfer_leadership_callback(peer_id_, resp.success());
+	}
+
+	void peer::do_pre_vote()
+	{
+		logger("start pre-vote");
+		if (!node_.is_pre_candidate())
+		{
+			logger("node is not pre-candidate return");
+			return;
+		}
+
+		typedef acl::http_rpc_client::status_t status_t;
+		vote_request req;
+		vote_response resp;
+
+		req.set_req_id(++req_id_);
+		node_.build_pre_vote_request(req);
+
+		status_t status = rpc_client_.pb_call(
+			pre_vote_service_path_,
+			req,
+			resp);
+
+		if (!status)
+		{
+			logger_error("proto_call error.%s",
+				status.error_str_.c_str());
+			return;
+		}
+
+		node_.pre_vote_response_callback(peer_id_, resp);
+	}
+
 	bool peer::wait_event(int &event)
 	{
         event = 0;
@@ -388,8 +894,15 @@ namespace raft
         timeout.tv_sec = last_heartbeat_time_.tv_sec;
         timeout.tv_nsec = last_heartbeat_time_.tv_usec * 1000;
 
-        timeout.tv_sec += heart_inter_ / 1000;
-        timeout.tv_nsec += heart_inter_ % 1000 * 1000 * 1000;
+        unsigned int heart_inter = node_.heartbeat_interval();
+
+        timeout.tv_sec += heart_inter / 1000;
+        timeout.tv_nsec += heart_inter % 1000 * 1000 * 1000;
+        if (timeout.tv_nsec >= 1000 * 1000 * 1000)
+        {
+            timeout.tv_sec += 1;
+            timeout.tv_nsec -= 1000 * 1000 * 1000;
+        }
 
         acl_pthread_mutex_lock(&mutex_);
         //has event. just do it .don't wait anymore
@@ -0,0 +1,61 @@
+#include "raft.hpp"
+
+namespace raft
+{
+	rate_limiter::rate_limiter(unsigned long long rate)
+		:rate_(rate),
+		 tokens_((long long) rate)
+	{
+		gettimeofday(&last_time_, NULL);
+	}
+
+	void rate_limiter::set_rate(unsigned long long rate)
+	{
+		acl::lock_guard lg(locker_);
+		rate_ = rate;
+		tokens_ = (long long) rate;
+		gettimeofday(&last_time_, NULL);
+	}
+
+	unsigned long long rate_limiter::rate()
+	{
+		acl::lock_guard lg(locker_);
+		return rate_;
+	}
+
+	void rate_limiter::refill()
+	{
+		timeval now;
+		gettimeofday(&now, NULL);
+
+		long long elapsed = (now.tv_sec - last_time_.tv_sec) * 1000000 +
+			(now.tv_usec - last_time_.tv_usec);
+		if (elapsed <= 0)
+			return;
+
+		last_time_ = now;
+		//bucket hold one second of tokens at most
+		if (elapsed > 1000000)
+			elapsed = 1000000;
+		tokens_ += (long long) (rate_ * elapsed / 1000000);
+		if (tokens_ > (long long) rate_)
+			tokens_ = (long long) rate_;
+	}
+
+	void rate_limiter::acquire(size_t bytes)
+	{
+		long long wait_usec = 0;
+		{
+			acl::lock_guard lg(locker_);
+			if (!rate_)
+				return;
+
+			refill();
+			tokens_ -= (long long) bytes;
+			if (tokens_ < 0)
+				wait_usec = -tokens_ * 1000000 / (long long) rate_;
+		}
+		if (wait_usec > 0)
+			acl_doze((unsigned) (wait_usec / 1000 + 1));
+	}
+}
@@ -0,0 +1,98 @@
+#include "raft.hpp"
+
+namespace raft
+{
+	snapshot_scheduler::snapshot_scheduler()
+		:max_transfers_(2),
+		 transfers_(0),
+		 replicating_(0)
+	{
+		acl_pthread_mutex_init(&mutex_, NULL);
+		acl_pthread_cond_init(&cond_, NULL);
+	}
+
+	snapshot_scheduler::~snapshot_scheduler()
+	{
+		acl_pthread_mutex_destroy(&mutex_);
+		acl_pthread_cond_destroy(&cond_);
+	}
+
+	void snapshot_scheduler::set_rate(unsigned long long bytes_per_sec)
+	{
+		limiter_.set_rate(bytes_per_sec);
+	}
+
+	void snapshot_scheduler::set_max_transfers(int count)
+	{
+		acl_pthread_mutex_lock(&mutex_);
+		max_transfers_ = count;
+		acl_pthread_mutex_unlock(&mutex_);
+	}
+
+	bool snapshot_scheduler::start_transfer()
+	{
+		bool ok = false;
+
+		acl_pthread_mutex_lock(&mutex_);
+		if (max_transfers_ <= 0 || transfers_ < max_transfers_)
+		{
+			transfers_++;
+			ok = true;
+		}
+		acl_pthread_mutex_unlock(&mutex_);
+		return ok;
+	}
+
+	void snapshot_scheduler::end_transfer()
+	{
+		acl_pthread_mutex_lock(&mutex_);
+		if (transfers_ > 0)
+			transfers_--;
+		acl_pthread_mutex_unlock(&mutex_);
+	}
+
+	void snapshot_scheduler::replicate_begin()
+	{
+		acl_pthread_mutex_lock(&mutex_);
+		replicating_++;
+		acl_pthread_mutex_unlock(&mutex_);
+	}
+
+	void snapshot_scheduler::replicate_end()
+	{
+		acl_pthread_mutex_lock(&mutex_);
+		if (replicating_ > 0)
+			replicating_--;
+		if (!replicating_)
+			acl_pthread_cond_broadcast(&cond_);
+		acl_pthread_mutex_unlock(&mutex_);
+	}
+
+	void snapshot_scheduler::acquire(size_t bytes, unsigned int max_wait)
+	{
+		timeval now;
+		timespec timeout;
+
+		gettimeofday(&now, NULL);
+		timeout.tv_sec = now.tv_sec + max_wait / 1000;
+		timeout.tv_nsec = now.tv_usec * 1000 +
+			(long) (max_wait % 1000) * 1000 * 1000;
+		if (timeout.tv_nsec >= 1000 * 1000 * 1000)
+		{
+			timeout.tv_sec += 1;
+			timeout.tv_nsec -= 1000 * 1000 * 1000;
+		}
+
+		acl_pthread_mutex_lock(&mutex_);
+		while (replicating_ > 0)
+		{
+			if (acl_pthread_cond_timedwait(&cond_,
+										   &mutex_,
+										   &timeout) == ACL_ETIMEDOUT)
+				break;
+		}
+		acl_pthread_mutex_unlock(&mutex_);
+
+		limiter_.acquire(bytes);
+	}
+}
@@ -0,0 +1,327 @@
+#include "raft.hpp"
+#include <zlib.h>
+
+//raw size, zipped size, crc32
+#define __ZIP_HEAD_SIZE__ (sizeof(unsigned int) * 3)
+
+//raw size of block is limited.bigger one is broken
+#define __ZIP_MAX_BLOCK__ (64 * 1024 * 1024)
+
+namespace raft
+{
+	struct zip_head
+	{
+		unsigned int raw_size;
+		unsigned int zipped_size;
+		unsigned int crc;
+	};
+
+	static bool get_zip_head(const char *data, zip_head &head)
+	{
+		unsigned char *ptr = (unsigned char *) data;
+
+		head.raw_size = get_uint32(ptr);
+		head.zipped_size = get_uint32(ptr);
+		head.crc = get_uint32(ptr);
+
+		if (head.raw_size > __ZIP_MAX_BLOCK__ ||
+			head.zipped_size > head.raw_size ||
+			(head.raw_size && !head.zipped_size))
+		{
+			logger_error("zip block head error.raw_size:%u "
+						 "zipped_size:%u",
+						 head.raw_size,
+						 head.zipped_size);
+			return false;
+		}
+		return true;
+	}
+
+	//decompress block data and check crc. data is appended to out
+	static bool unzip_block(const zip_head &head,
+							const char *data,
+							std::string &out)
+	{
+		size_t pos = out.size();
+
+		if (head.zipped_size == head.raw_size)
+		{
+			out.append(data, head.raw_size);
+		}
+		else
+		{
+			out.resize(pos + head.raw_size);
+
+			uLongf len = head.raw_size;
+			int ret = uncompress((Bytef *) &out[pos],
+								 &len,
+								 (const Bytef *) data,
+								 head.zipped_size);
+
+			if (ret != Z_OK || len != head.raw_size)
+			{
+				logger_error("uncompress error.%d", ret);
+				out.resize(pos);
+				return false;
+			}
+		}
+
+		unsigned int crc = (unsigned int) crc32(
+			0, (const Bytef *) out.data() + pos, head.raw_size);
+		if (crc != head.crc)
+		{
+			logger_error("zip block crc error");
+			out.resize(pos);
+			return false;
+		}
+		return true;
+	}
+
+	bool zip_block(const char *data,
+				   size_t len,
+				   std::string &out,
+				   int level)
+	{
+		if (len > __ZIP_MAX_BLOCK__)
+		{
+			logger_error("block too large.%zd", len);
+			return false;
+		}
+
+		size_t pos = out.size();
+		uLongf zipped = compressBound((uLong) len);
+
+		out.resize(pos + __ZIP_HEAD_SIZE__ + zipped);
+
+		Bytef *dest = (Bytef *) &out[pos + __ZIP_HEAD_SIZE__];
+		int ret = compress2(dest,
+							&zipped,
+							(const Bytef *) data,
+							(uLong) len,
+							level);
+		if (ret != Z_OK)
+		{
+			logger_error("compress2 error.%d", ret);
+			out.resize(pos);
+			return false;
+		}
+
+		//store data if it can not be compressed smaller
+		if (zipped >= len)
+		{
+			zipped = len;
+			if (len)
+				memcpy(dest, data, len);
+		}
+		out.resize(pos + __ZIP_HEAD_SIZE__ + zipped);
+
+		unsigned char *ptr = (unsigned char *) &out[pos];
+		put_uint32(ptr, (unsigned int) len);
+		put_uint32(ptr, (unsigned int) zipped);
+		put_uint32(ptr, (unsigned int) crc32(0, (const Bytef *) data,
+											 (uInt) len));
+		return true;
+	}
+
+	bool unzip_blocks(const char *data, size_t len, std::string &out)
+	{
+		zip_decoder decoder;
+
+		if (!decoder.update(data, len, out))
+			return false;
+
+		if (!decoder.finished())
+		{
+			logger_error("zip block not finished");
+			return false;
+		}
+		return true;
+	}
+
+	zip_ostream::zip_ostream(acl::ostream &stream,
+							 bool compress,
+							 size_t block_size)
+		:stream_(stream),
+		 compress_(compress),
+		 block_size_(block_size)
+	{
+		if (compress_)
+			buffer_.reserve(block_size_);
+	}
+
+	zip_ostream::~zip_ostream()
+	{
+		if (buffer_.size())
+			logger_warn("zip_ostream data not flushed.%zd",
+						buffer_.size());
+	}
+
+	int zip_ostream::write(const void *data, size_t len)
+	{
+		if (!compress_)
+			return stream_.write(data, len);
+
+		const char *ptr = static_cast<const char *>(data);
+		size_t remain = len;
+
+		while (remain)
+		{
+			size_t size = block_size_ - buffer_.size();
+			if (size > remain)
+				size = remain;
+
+			buffer_.append(ptr, size);
+			ptr += size;
+			remain -= size;
+
+			if (buffer_.size() >= block_size_ && !flush())
+				return -1;
+		}
+		return (int) len;
+	}
+
+	bool zip_ostream::flush()
+	{
+		if (!compress_ || buffer_.empty())
+			return true;
+
+		block_.clear();
+		if (!zip_block(buffer_.data(), buffer_.size(), block_))
+			return false;
+		buffer_.clear();
+
+		return stream_.write(block_.data(), block_.size()) ==
+			(int) block_.size();
+	}
+
+	zip_istream::zip_istream(acl::istream &stream, bool compress)
+		:stream_(stream),
+		 compress_(compress),
+		 error_(false),
+		 eof_(false),
+		 offset_(0)
+	{
+	}
+
+	bool zip_istream::read_block()
+	{
+		char head_data[__ZIP_HEAD_SIZE__];
+		zip_head head;
+
+		buffer_.clear();
+		offset_ = 0;
+
+		int ret = stream_.read(head_data, sizeof(head_data));
+		if (ret <= 0)
+		{
+			eof_ = true;
+			return false;
+		}
+		if (ret != sizeof(head_data) || !get_zip_head(head_data, head))
+		{
+			error_ = true;
+			return false;
+		}
+
+		zipped_.resize(head.zipped_size);
+		if (head.zipped_size &&
+			stream_.read(&zipped_[0], head.zipped_size) !=
+			(int) head.zipped_size)
+		{
+			logger_error("read zip block error");
+			error_ = true;
+			return false;
+		}
+		if (!unzip_block(head, zipped_.data(), buffer_))
+		{
+			error_ = true;
+			return false;
+		}
+		return true;
+	}
+
+	int zip_istream::read(void *data, size_t len, bool loop)
+	{
+		if (!compress_)
+		{
+			int ret = stream_.read(data, len, loop);
+			if (ret <= 0)
+				eof_ = stream_.eof();
+			return ret;
+		}
+
+		char *ptr = static_cast<char *>(data);
+		size_t copied = 0;
+
+		while (copied < len)
+		{
+			if (offset_ == buffer_.size())
+			{
+				if (error_ || eof_ || !read_block())
+					break;
+				continue;
+			}
+
+			size_t size = buffer_.size() - offset_;
+			if (size > len - copied)
+				size = len - copied;
+
+			memcpy(ptr + copied, buffer_.data() + offset_, size);
+			offset_ += size;
+			copied += size;
+
+			if (!loop)
+				break;
+		}
+		return copied ? (int) copied : -1;
+	}
+
+	bool zip_istream::eof() const
+	{
+		if (!compress_)
+			return stream_.eof();
+		return (eof_ || error_) && offset_ == buffer_.size();
+	}
+
+	bool zip_istream::error() const
+	{
+		return error_;
+	}
+
+	bool zip_decoder::update(const char *data,
+							 size_t len,
+							 std::string &out)
+	{
+		buffer_.append(data, len);
+
+		size_t pos = 0;
+		while (buffer_.size() - pos >= __ZIP_HEAD_SIZE__)
+		{
+			zip_head head;
+			if (!get_zip_head(buffer_.data() + pos, head))
+				return false;
+
+			size_t size = __ZIP_HEAD_SIZE__ + head.zipped_size;
+			if (buffer_.size() - pos < size)
+				break;
+
+			if (!unzip_block(head,
+							 buffer_.data() + pos + __ZIP_HEAD_SIZE__,
+							 out))
+				return false;
+			pos += size;
+		}
+		buffer_.erase(0, pos);
+		return true;
+	}
+
+	bool zip_decoder::finished() const
+	{
+		return buffer_.empty();
+	}
+
+	void zip_decoder::reset()
+	{
+		buffer_.clear();
+	}
+}
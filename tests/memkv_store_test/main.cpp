@@ -0,0 +1,280 @@
+#include "acl_cpp/lib_acl.hpp"
+#include "lib_acl.h"
+#include <set>
+#include <string>
+#include <vector>
+#include "memkv_store.h"
+
+#define MEMKV_STORE_TEST_ITEMS 100000
+
+std::string make_key(int i)
+{
+	acl::string key;
+	key.format("key_%d", i);
+	return key.c_str();
+}
+
+void arena_test()
+{
+	memkv_arena arena;
+	memkv_meta meta1;
+	meta1.version = 100;
+	meta1.expire_at = 1000;
+
+	memkv_arena::ref ref1 = arena.add("key1", "value1", meta1);
+	memkv_arena::ref ref2 = arena.add("key2", "");
+
+	memkv_bytes key;
+	memkv_bytes value;
+	memkv_meta meta;
+
+	arena.get(ref1, key, value, &meta);
+	acl_assert(key.str() == "key1");
+	acl_assert(value.str() == "value1");
+	acl_assert(meta.version == 100 && meta.expire_at == 1000);
+
+	arena.get(ref2, key, value, &meta);
+	acl_assert(key.str() == "key2");
+	acl_assert(value.str().empty());
+	acl_assert(!meta.version && !meta.expire_at);
+
+	//value and meta of the same size are written in place
+	size_t used = arena.used();
+	meta1.version = 101;
+	meta1.expire_at = 1001;
+	acl_assert(arena.replace(ref1, "VALUE1", meta1));
+	acl_assert(arena.used() == used);
+	arena.get(ref1, key, value, &meta);
+	acl_assert(key.str() == "key1");
+	acl_assert(value.str() == "VALUE1");
+	acl_assert(meta.version == 101 && meta.expire_at == 1001);
+
+	acl_assert(!arena.replace(ref1, "value", meta1));
+	meta1.version = 1000;
+	acl_assert(!arena.replace(ref1, "value1", meta1));
+	meta1.version = 101;
+	meta1.expire_at = 0;
+	acl_assert(!arena.replace(ref1, "value1", meta1));
+
+	arena.release(ref1);
+	acl_assert(arena.used() < used);
+	acl_assert(arena.garbage() >= used - arena.used());
+
+	//record bigger than a chunk has its own chunk
+	std::string big(__MEMKV_ARENA_CHUNK__ * 2, 'b');
+	memkv_arena::ref ref3 = arena.add("big", big);
+	arena.get(ref3, key, value);
+	acl_assert(key.str() == "big");
+	acl_assert(value.size == big.size());
+	acl_assert(!memcmp(value.data, big.data(), big.size()));
+	acl_assert(arena.bytes() >= big.size());
+
+	arena.get(ref2, key, value);
+	acl_assert(key.str() == "key2");
+
+	arena.clear();
+	acl_assert(!arena.bytes() && !arena.used() && !arena.garbage());
+}
+
+void hash_test()
+{
+	memkv_hash hash;
+	memkv_meta meta;
+
+	for (int i = 0; i < MEMKV_STORE_TEST_ITEMS; i++)
+	{
+		meta.version = i;
+		acl_assert(hash.set(make_key(i), std::string(i % 100, 'v'), meta));
+	}
+	acl_assert(hash.size() == MEMKV_STORE_TEST_ITEMS);
+
+	for (int i = 0; i < MEMKV_STORE_TEST_ITEMS; i++)
+	{
+		std::string value;
+		acl_assert(hash.find(make_key(i), &value, &meta));
+		acl_assert(value == std::string(i % 100, 'v'));
+		acl_assert(meta.version == (unsigned long long) i);
+	}
+	acl_assert(!hash.find("not_exist", NULL));
+
+	//value of the same size is replaced in place
+	size_t bytes = hash.arena().bytes();
+	size_t used = hash.arena().used();
+	meta.version = 50;
+	acl_assert(!hash.set(make_key(50), std::string(50, 'w'), meta));
+	acl_assert(hash.arena().bytes() == bytes);
+	acl_assert(hash.arena().used() == used);
+
+	//overwrite all values with another size, arena is compacted
+	for (int i = 0; i < MEMKV_STORE_TEST_ITEMS; i++)
+		acl_assert(!hash.set(make_key(i), std::string(i % 100 + 1, 'x')));
+	acl_assert(hash.arena().garbage() <= hash.arena().used() ||
+			   hash.arena().garbage() <= __MEMKV_ARENA_MIN_CHUNK__);
+
+	size_t count = 0;
+	for (memkv_hash::const_iterator it = hash.begin();
+		 it != hash.end(); ++it)
+	{
+		acl_assert(it.value().size >= 1);
+		acl_assert(it.value().data[0] == 'x');
+		acl_assert(!it.meta().version);
+		count++;
+	}
+	acl_assert(count == MEMKV_STORE_TEST_ITEMS);
+
+	for (int i = 0; i < MEMKV_STORE_TEST_ITEMS; i += 2)
+		acl_assert(hash.erase(make_key(i)));
+	for (int i = 0; i < MEMKV_STORE_TEST_ITEMS; i++)
+		acl_assert(hash.find(make_key(i), NULL) == (i % 2 == 1));
+	acl_assert(!hash.erase(make_key(0)));
+
+	hash.clear();
+	acl_assert(!hash.size() && !hash.table_bytes());
+}
+
+//erased slots are dropped when table grows, it does not keep growing
+void hash_tombstone_test()
+{
+	memkv_hash hash;
+
+	for (int i = 0; i < 1000; i++)
+		acl_assert(hash.set(make_key(i), "v"));
+	size_t table_bytes = hash.table_bytes();
+
+	for (int round = 0; round < 100; round++)
+	{
+		for (int i = 0; i < 1000; i++)
+		{
+			acl_assert(hash.erase(make_key(i)));
+			acl_assert(hash.set(make_key(i + 1000), "v"));
+			acl_assert(hash.erase(make_key(i + 1000)));
+			acl_assert(hash.set(make_key(i), "v"));
+		}
+	}
+	acl_assert(hash.size() == 1000);
+	acl_assert(hash.table_bytes() <= table_bytes * 2);
+
+	for (int i = 0; i < 2000; i++)
+		acl_assert(hash.find(make_key(i), NULL) == (i < 1000));
+}
+
+void items_test()
+{
+	memkv_items items;
+
+	//shards take keys by the high bits of hash
+	std::set<size_t> shards;
+	for (int i = 0; i < MEMKV_STORE_TEST_ITEMS; i++)
+	{
+		size_t index = items.shard_index(make_key(i));
+		acl_assert(index < items.shards());
+		shards.insert(index);
+	}
+	acl_assert(shards.size() == items.shards());
+}
+
+//store keeps no items of its own, any key is a key of user
+void store_meta_test()
+{
+	memkv_store store;
+	std::string key(2, '\0');
+	key[1] = 't';
+	key += make_key(1);
+
+	store.set(key, "binary", 5000, 7);
+	store.set(make_key(1), "value", 2000, 8);
+	acl_assert(store.size() == 2);
+
+	std::string value;
+	unsigned long long version = 0;
+	acl_assert(store.get(key, value, &version));
+	acl_assert(value == "binary" && version == 7);
+
+	memkv_store::memory_stats stats;
+	store.memory(stats);
+	acl_assert(stats.keys == 2 && stats.items == 2);
+
+	memkv_store::scan_items_t scan;
+	acl_assert(!store.scan("", "", 10, scan));
+	acl_assert(scan.size() == 2 && scan[0].first == key);
+
+	//set without expire time make key persistent
+	store.set(make_key(1), "value", 0, 9);
+	acl_assert(store.next_expire() == 5000);
+	acl_assert(store.expire(10000) == 1);
+	acl_assert(!store.exist(key));
+	acl_assert(store.version(make_key(1)) == 9);
+
+	//version and expire time of legacy files are items
+	memkv_store::items_t items;
+	std::string meta(2, '\0');
+	meta[1] = 'v';
+	items.set(make_key(2), "value");
+	items.set(meta + make_key(2), std::string("\0\0\0\0\0\0\0\x0c", 8));
+	meta[1] = 't';
+	items.set(meta + make_key(2), std::string("\0\0\0\0\0\0\x0b\xb8", 8));
+	memkv_store::fold_legacy_items(items);
+	acl_assert(items.size() == 1);
+
+	store.reset(items);
+	acl_assert(store.size() == 1);
+	acl_assert(store.version(make_key(2)) == 12);
+	acl_assert(store.next_expire() == 3000);
+	acl_assert(store.expire(3000) == 1 && !store.size());
+
+	memkv_meta decoded;
+	memkv_meta encoded;
+	encoded.version = 12;
+	encoded.expire_at = 3000;
+	acl_assert(memkv_store::encode_meta(memkv_meta()).empty());
+	acl_assert(memkv_store::decode_meta(memkv_store::encode_meta(encoded),
+										decoded));
+	acl_assert(decoded.version == 12 && decoded.expire_at == 3000);
+	acl_assert(!memkv_store::decode_meta("bad", decoded));
+}
+
+//pages of scan cover the range once, in key order
+void store_scan_test()
+{
+	memkv_store store;
+	std::set<std::string> keys;
+
+	for (int i = 0; i < 1000; i++)
+	{
+		store.set(make_key(i), "v");
+		keys.insert(make_key(i));
+	}
+
+	std::string start = make_key(100);
+	std::string end = make_key(500);
+	std::set<std::string>::iterator it = keys.lower_bound(start);
+	bool more = true;
+	while (more)
+	{
+		memkv_store::scan_items_t items;
+		std::string next;
+		more = store.scan(start, end, 7, items, &next);
+		acl_assert(items.size() == 7 || !more);
+
+		for (size_t i = 0; i < items.size(); i++, ++it)
+			acl_assert(it != keys.end() && items[i].first == *it);
+		acl_assert(!more || next == *it);
+		start = next;
+	}
+	acl_assert(it == keys.lower_bound(end));
+}
+
+int main()
+{
+	acl::log::stdout_open(true);
+
+	arena_test();
+	hash_test();
+	hash_tombstone_test();
+	items_test();
+	store_meta_test();
+	store_scan_test();
+
+	logger("memkv_store_test done");
+	return 0;
+}
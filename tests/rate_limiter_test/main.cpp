@@ -0,0 +1,50 @@
+#include "raft.hpp"
+using namespace raft;
+
+#define RATE_LIMITER_TEST_RATE  (1024 * 1024)
+#define RATE_LIMITER_TEST_CHUNK (64 * 1024)
+
+long long now_ms()
+{
+	timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000LL + now.tv_usec / 1000;
+}
+
+//take bytes from limiter and return milliseconds it takes
+long long do_acquire_test(rate_limiter &limiter, size_t bytes)
+{
+	long long start = now_ms();
+	for (size_t i = 0; i < bytes; i += RATE_LIMITER_TEST_CHUNK)
+	{
+		limiter.acquire(RATE_LIMITER_TEST_CHUNK);
+	}
+	return now_ms() - start;
+}
+
+int main()
+{
+	acl::log::stdout_open(true);
+
+	/*
+	 * only lower bounds are asserted.a loaded machine can make
+	 * acquire slower, but never faster than the rate
+	 */
+	rate_limiter unlimited;
+	long long cost = do_acquire_test(unlimited, 100 * 1024 * 1024);
+	logger("100MB without limit cost %lld ms", cost);
+
+	rate_limiter limiter(RATE_LIMITER_TEST_RATE);
+
+	//first second is in bucket already. 3MB take 2 seconds
+	cost = do_acquire_test(limiter, 3 * RATE_LIMITER_TEST_RATE);
+	logger("3MB at 1MB/s cost %lld ms", cost);
+	acl_assert(cost >= 1800);
+
+	//bucket is empty now.1MB take 1 second
+	cost = do_acquire_test(limiter, RATE_LIMITER_TEST_RATE);
+	logger("1MB at 1MB/s cost %lld ms", cost);
+	acl_assert(cost >= 900);
+
+	return 0;
+}
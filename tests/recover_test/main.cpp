@@ -0,0 +1,110 @@
+#include "raft.hpp"
+#include <sys/stat.h>
+using namespace raft;
+
+#define RECOVER_TEST_PATH    "recover_test/"
+//node recovers at most 10000 entries a batch
+#define RECOVER_TEST_ENTRIES (10000 * 3 + 1234)
+
+//keep the log index in data, to check parse and apply order
+struct recover_test_callback : recover_callback
+{
+	struct test_entry : entry
+	{
+		log_index_t index_;
+	};
+
+	recover_test_callback(log_index_t applied = 0,
+						  log_index_t fail_at = 0)
+		:applied_(applied),
+		 fail_at_(fail_at)
+	{
+	}
+
+	virtual entry *parse(const std::string &data, const version &ver)
+	{
+		log_index_t index = 0;
+		if (sscanf(data.c_str(), "%llu", &index) != 1 ||
+			index != ver.index_)
+			return NULL;
+
+		test_entry *parsed = new test_entry;
+		parsed->index_ = index;
+		return parsed;
+	}
+
+	virtual bool apply(entry *parsed, const version &ver)
+	{
+		test_entry *e = static_cast<test_entry *>(parsed);
+		if (e->index_ != ver.index_ || ver.index_ != applied_ + 1 ||
+			ver.index_ == fail_at_)
+			return false;
+		applied_ = ver.index_;
+		return true;
+	}
+
+	log_index_t applied_;
+	//apply fail at the index, 0 for never
+	log_index_t fail_at_;
+};
+
+class recover_test : public node
+{
+public:
+	void do_test()
+	{
+		write_logs();
+
+		set_log_path(RECOVER_TEST_PATH "log");
+		set_metadata_path(RECOVER_TEST_PATH "metadata");
+		acl_assert(reload());
+		acl_assert(last_log_index() == RECOVER_TEST_ENTRIES);
+		set_committed_index(RECOVER_TEST_ENTRIES);
+
+		//apply fail in the middle of second batch
+		recover_test_callback failed(0, 15000);
+		acl_assert(!recover(failed, 0, 4));
+		acl_assert(failed.applied_ == 14999);
+		acl_assert(applied_index() == 14999);
+
+		//more than two batches, so both batch slots are reused
+		recover_test_callback callback(applied_index());
+		acl_assert(recover(callback, applied_index(), 4));
+		acl_assert(callback.applied_ == RECOVER_TEST_ENTRIES);
+		acl_assert(applied_index() == RECOVER_TEST_ENTRIES);
+	}
+
+private:
+	void write_logs()
+	{
+		log_manager *manager = new mmap_log_manager(RECOVER_TEST_PATH "log/");
+		manager->reload_logs();
+
+		//logs are left by last run
+		for (log_index_t i = manager->last_index() + 1;
+			 i <= RECOVER_TEST_ENTRIES; i++)
+		{
+			char buffer[32];
+			snprintf(buffer, sizeof(buffer), "%llu", i);
+
+			log_entry entry;
+			entry.set_term(1);
+			entry.set_type(e_raft_log);
+			entry.set_log_data(buffer);
+			acl_assert(manager->write(entry) == i);
+		}
+		delete manager;
+	}
+};
+
+int main()
+{
+	acl::log::stdout_open(true);
+
+	mkdir(RECOVER_TEST_PATH, S_IRWXU);
+	mkdir(RECOVER_TEST_PATH "log", S_IRWXU);
+	mkdir(RECOVER_TEST_PATH "metadata", S_IRWXU);
+
+	recover_test().do_test();
+	return 0;
+}
@@ -0,0 +1,90 @@
+#include "raft.hpp"
+using namespace raft;
+
+#define ZIP_STREAM_TEST_FILE  "zip_stream_test.data"
+#define ZIP_STREAM_TEST_ITEMS 10000
+
+void write_test(bool compress)
+{
+	acl::ofstream file;
+	acl_assert(file.open_trunc(ZIP_STREAM_TEST_FILE));
+
+	zip_ostream out(file, compress, 4096);
+	acl_assert(write(out, (unsigned int) ZIP_STREAM_TEST_ITEMS));
+
+	for (int i = 0; i < ZIP_STREAM_TEST_ITEMS; i++)
+	{
+		acl::string key;
+		key.format("key_%d", i);
+		acl_assert(write(out, std::string(key.c_str())));
+		acl_assert(write(out, std::string(i % 100, 'v')));
+	}
+	acl_assert(out.flush());
+	file.close();
+}
+
+void read_test(bool compress)
+{
+	acl::ifstream file;
+	acl_assert(file.open_read(ZIP_STREAM_TEST_FILE));
+
+	zip_istream in(file, compress);
+	unsigned int items = 0;
+	acl_assert(read(in, items));
+	acl_assert(items == ZIP_STREAM_TEST_ITEMS);
+
+	for (int i = 0; i < ZIP_STREAM_TEST_ITEMS; i++)
+	{
+		std::string key;
+		std::string value;
+		acl::string expect;
+		expect.format("key_%d", i);
+
+		acl_assert(read(in, key) && key == expect.c_str());
+		acl_assert(read(in, value) && value == std::string(i % 100, 'v'));
+	}
+	std::string tail;
+	acl_assert(!read(in, tail));
+	acl_assert(in.eof() && !in.error());
+}
+
+void decoder_test()
+{
+	acl::string data;
+	acl_assert(acl::ifstream::load(ZIP_STREAM_TEST_FILE, &data));
+
+	//push one byte each time
+	zip_decoder decoder;
+	std::string raw;
+	for (size_t i = 0; i < data.size(); i++)
+	{
+		acl_assert(decoder.update(data.c_str() + i, 1, raw));
+	}
+	acl_assert(decoder.finished());
+
+	std::string expect;
+	acl_assert(unzip_blocks(data.c_str(), data.size(), expect));
+	acl_assert(raw == expect);
+
+	//broken data is found by crc
+	std::string broken(data.c_str(), data.size());
+	broken[broken.size() / 2] ^= 0x5a;
+	raw.clear();
+	acl_assert(!unzip_blocks(broken.data(), broken.size(), raw));
+}
+
+int main()
+{
+	acl::log::stdout_open(true);
+
+	write_test(false);
+	read_test(false);
+
+	write_test(true);
+	read_test(true);
+	decoder_test();
+
+	remove(ZIP_STREAM_TEST_FILE);
+	logger("zip_stream test ok");
+	return 0;
+}